@@ -1,19 +1,118 @@
 #pragma once
 
+#include <cstdio>
+#include <cstring>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "output/output.h"
 #include "zfs/block.h"
 #include "zfs/indirect_block.h"
 #include "zfs/physical/dnode.h"
+#include "zfs/sa.h"
+#include "zfs/zap_cache.h"
 #include "zfs/zpool_reader.h"
 
-bool extractFileContents(zfs::ZPoolReader &          reader,
+// Identifies the contents of a data block: its checksum, together with
+// everything else that determines what the block decodes to. Blocks shared
+// through dedup or clones have the same checksum, and so do blocks with the
+// same DVA. Only cryptographic checksums make for a key.
+struct BlockKey {
+  u8  checksum[32];
+  u64 props; // lsize, psize, compression and checksum type
+
+  bool operator==(const BlockKey &rhs) const {
+    return props == rhs.props &&
+           std::memcmp(checksum, rhs.checksum, sizeof(checksum)) == 0;
+  }
+};
+
+struct BlockKeyHash {
+  std::size_t operator()(const BlockKey &key) const {
+    // the checksum is as good as random already
+    std::size_t hash;
+    std::memcpy(&hash, key.checksum, sizeof(hash));
+    return hash ^ key.props;
+  }
+};
+
+// Where a data block has first been written to.
+struct BlockLocation {
+  u32 file; // index into ExtractionContext::dedupFiles
+  u32 size;
+  u64 offset;
+};
+
+// Everything an extraction of a dataset needs to carry around.
+struct ExtractionContext {
+  explicit ExtractionContext(
+      zfs::ZPoolReader &reader_,
+      zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock_, Output &output_)
+      : reader{reader_}, dslBlock{dslBlock_}, output{output_} {}
+
+  zfs::ZPoolReader &                           reader;
+  zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock;
+  Output &                                     output;
+
+  // Directories and other ZAP objects of the dataset looked up by name.
+  zfs::ZapCache zapCache;
+
+  // Decodes the ZNodes of the dataset, see SaRegistry::load().
+  zfs::SaRegistry sa;
+
+  // All objects that have been extracted so far.
+  std::set<const zfs::physical::DNode *> extractedNodes;
+
+  // Where files with more than one link were first written to (see
+  // Output::pathOf()), so that they can be hard linked when encountered again.
+  std::unordered_map<const zfs::physical::DNode *, std::string> linkTargets;
+
+  // If set, data blocks that have already been written are cloned from the
+  // output (see Output::cloneFileData()) instead of being read again.
+  bool                                                      dedupBlocks = false;
+  std::vector<std::string>                                  dedupFiles;
+  std::unordered_map<BlockKey, BlockLocation, BlockKeyHash> writtenBlocks;
+
+  // If set, the SHA-256 digest of every extracted file is written here, in
+  // the format of sha256sum. The data is hashed as it is written, so this
+  // costs no extra reads.
+  std::FILE *manifest = nullptr;
+
+  // The digests of the files in linkTargets, for the manifest lines of their
+  // other links.
+  std::unordered_map<const zfs::physical::DNode *, std::string> linkDigests;
+
+  // If not 0, the output already holds an extraction of the dataset as of
+  // this txg, which is brought up to date: files whose blocks are all older
+  // and whose metadata matches are left alone, the others only get the blocks
+  // born since then patched in. Parts of the block tree that are older are
+  // never read.
+  u64         sinceTxg       = 0;
+  std::size_t unchangedFiles = 0;
+  u64         patchedBlocks  = 0;
+};
+
+bool extractFileContents(ExtractionContext &ctx, u64 objid,
                          const zfs::physical::DNode &dnode,
-                         const std::string &         outFile);
+                         const std::string &         name);
+
+std::size_t extractDirContents(ExtractionContext &         ctx,
+                               const zfs::physical::DNode &dnode,
+                               const std::string &         name);
+
+// Extracts every directory and file of the dataset that has not been extracted
+// yet, i.e. that is not reachable from the root anymore, named after their
+// object ID. The dnode array is scanned by several threads, which only read the
+// dnode blocks; the extraction itself happens afterwards, in object ID order.
+std::size_t extractDanglingObjects(ExtractionContext &ctx);
 
-std::size_t
-extractDirContents(zfs::ZPoolReader &                           reader,
-                   zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock,
-                   const zfs::physical::DNode &dnode, const std::string &outDir,
-                   std::set<const zfs::physical::DNode *> &extractedNodes);
+// Extracts only what the given paths (relative to the root directory ROOTOBJID,
+// with shell glob patterns allowed in any component) refer to, into a tree
+// named NAME that only contains the directories leading to them. Literal
+// components are looked up through ctx.zapCache, so the cost depends on the
+// depth of the paths rather than on the size of the dataset.
+std::size_t extractPaths(ExtractionContext &ctx, u64 rootObjID,
+                         const std::vector<std::string> &paths,
+                         const std::string &             name);
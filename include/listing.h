@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdio>
+#include <set>
+#include <string>
+
+#include "zfs/indirect_block.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/sa.h"
+#include "zfs/zpool_reader.h"
+
+enum class ListingFormat {
+  Tsv,   // one tab separated line per object, see listingHeader()
+  NdJson // one JSON object per line
+};
+
+// Everything a listing of a dataset needs to carry around.
+struct ListingContext {
+  explicit ListingContext(
+      zfs::ZPoolReader &reader_,
+      zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock_, std::FILE *out_,
+      ListingFormat format_)
+      : reader{reader_}, dslBlock{dslBlock_}, out{out_}, format{format_} {}
+
+  zfs::ZPoolReader &                           reader;
+  zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock;
+  std::FILE *                                  out;
+  ListingFormat                                format;
+
+  // Decodes the ZNodes of the dataset, see SaRegistry::load().
+  zfs::SaRegistry sa;
+
+  // Directories that have been listed already, to stop at cycles in a damaged
+  // tree.
+  std::set<u64> listedDirs;
+};
+
+// Appends PATH to LINE, escaped for the given format.
+void appendPath(ListingFormat format, const std::string &path,
+                INOUT std::string *line);
+
+// Writes the column names for the TSV format.
+void listingHeader(ListingContext &ctx);
+
+// Lists the directory OBJID and everything below it, one line per object.
+// Only dnode blocks and directory ZAPs are read, never any file data, so this
+// is a cheap inventory of what an extraction would produce. Returns the number
+// of objects listed.
+std::size_t listDirContents(ListingContext &ctx, u64 objid,
+                            const std::string &path);
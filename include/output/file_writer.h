@@ -0,0 +1,139 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <vector>
+
+#include "utils/common.h"
+
+struct WriterConfig {
+  // Writes are collected until this many bytes are pending, then issued as a
+  // single pwritev().
+  size_t batchSize = 8 * MB;
+
+  // Files at least this large are written with O_DIRECT, bypassing the page
+  // cache. 0 disables direct I/O.
+  size_t directThreshold = 0;
+
+  // Writeback of a file is started in the background every time this many
+  // bytes have been written to it. 0 disables background writeback, the dirty
+  // budget and the final barrier.
+  size_t syncInterval = 64 * MB;
+
+  // The maximum number of bytes that may be written but not yet written back.
+  // Writers block when it would be exceeded.
+  size_t dirtyBudget = 512 * MB;
+};
+
+// Shared by all output files: a background thread that writes back finished
+// ranges of the output files and keeps track of how many bytes are dirty.
+struct WritebackQueue {
+  explicit WritebackQueue(const WriterConfig &config);
+
+  WritebackQueue(const WritebackQueue &other) = delete;
+  WritebackQueue &operator=(const WritebackQueue &other) = delete;
+
+  ~WritebackQueue();
+
+  bool enabled() const { return m_config.syncInterval != 0; }
+
+  // Accounts for SIZE freshly written (dirty) bytes.
+  void addDirty(size_t size);
+
+  bool overBudget();
+
+  // Queues the given range of FD for writeback. If CLOSE is set, the queue
+  // takes over FD and closes it once the range is written back; the range may
+  // be empty then.
+  void submit(int fd, off_t offset, off_t length, bool close);
+
+  // Blocks until the number of dirty bytes is within the budget.
+  void throttle();
+
+  // Waits until everything submitted so far has been written back.
+  void drain();
+
+private:
+  struct Range {
+    int   fd;
+    off_t offset;
+    off_t length;
+    bool  close;
+  };
+
+  void run();
+
+  const WriterConfig &    m_config;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+  std::deque<Range>       m_ranges;
+  size_t                  m_dirty    = 0;
+  bool                    m_busy     = false;
+  bool                    m_stopping = false;
+  std::thread             m_thread;
+};
+
+// Writes one output file in large batches: buffered files gather the caller's
+// buffers into a single pwritev() without copying, files that qualify for
+// O_DIRECT are staged through an aligned buffer.
+// NOTE: in buffered mode the data passed to append() has to stay valid until
+// the next flush, at the latest until close() returns.
+struct FileWriter {
+  explicit FileWriter(WritebackQueue &queue, const WriterConfig &config)
+      : m_queue{&queue}, m_config{&config} {}
+
+  FileWriter(const FileWriter &other) = delete;
+  FileWriter &operator=(const FileWriter &other) = delete;
+
+  ~FileWriter();
+
+  bool isOpen() const { return m_fd >= 0; }
+  int  fd() const { return m_fd; }
+
+  // Takes over FD. EXPECTEDSIZE is used to decide whether to use direct I/O.
+  void open(int fd, u64 expectedSize);
+
+  bool append(const void *data, size_t size);
+
+  // Appends SIZE bytes from SRCFD at SRCOFFSET, sharing the extents with
+  // FICLONERANGE if the filesystem supports it, copying them in the kernel
+  // otherwise. Not supported for files written with direct I/O.
+  bool clone(int srcFd, off_t srcOffset, size_t size);
+
+  // Writes out everything that is still pending. No more data may be appended
+  // afterwards.
+  bool finish();
+
+  // Closes the file, or hands it over to the writeback queue to be closed once
+  // all of its ranges have been written back.
+  void close();
+
+private:
+  bool flushBuffered();
+  bool flushDirect(bool final);
+  bool writeAll(const struct iovec *iov, int iovcnt, size_t size);
+  void written(size_t size);
+
+  WritebackQueue *    m_queue;
+  const WriterConfig *m_config;
+
+  int   m_fd     = -1;
+  off_t m_offset = 0;
+  bool  m_direct = false;
+
+  // buffered mode
+  std::vector<struct iovec> m_iovecs;
+  size_t                    m_pending = 0;
+
+  // direct mode
+  std::unique_ptr<char, void (*)(void *)> m_staging{nullptr, nullptr};
+  size_t                                  m_stagingUsed = 0;
+
+  // the start of the range that has not been submitted for writeback yet
+  off_t m_unsyncedStart = 0;
+};
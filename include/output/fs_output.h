@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "output/file_writer.h"
+#include "output/output.h"
+
+// Writes the extracted tree into a directory of the local filesystem.
+// Every directory is kept open while it is being populated, and all entries are
+// created relative to it with the *at() family of syscalls, so the kernel never
+// has to resolve a full path. The mode, ownership and timestamps from the ZNode
+// are restored through the already open descriptors: for files right before
+// they are closed, for directories when they are left (so that populating them
+// does not change their mtime again). Every file also records the object it
+// was extracted from in an extended attribute, so that incremental extractions
+// can tell a renamed file from the one it replaced.
+// File data goes through a FileWriter, see WriterConfig for the knobs.
+struct FsOutput : Output {
+  static std::unique_ptr<FsOutput> open(const std::string & baseDir,
+                                        const WriterConfig &config = {});
+
+  explicit FsOutput(int baseDirFd, const WriterConfig &config);
+
+  FsOutput(const FsOutput &other) = delete;
+  FsOutput &operator=(const FsOutput &other) = delete;
+
+  ~FsOutput();
+
+  bool enterDirectory(const std::string &          name,
+                      const zfs::physical::ZNode &znode) override;
+  void leaveDirectory() override;
+
+  bool beginFile(const std::string &name, u64 objid,
+                 const zfs::physical::ZNode &znode) override;
+  bool writeFileData(const void *data, size_t size) override;
+  bool endFile() override;
+
+  bool cloneFileData(const std::string &source, u64 offset,
+                     size_t size) override;
+
+  bool isFileCurrent(const std::string &name, u64 objid,
+                     const zfs::physical::ZNode &znode) const override;
+  bool beginFileUpdate(const std::string &name, u64 objid,
+                       const zfs::physical::ZNode &znode) override;
+  bool patchFileData(u64 offset, const void *data, size_t size) override;
+
+  bool linkFile(const std::string &name, const zfs::physical::ZNode &znode,
+                const std::string &target) override;
+
+  std::string pathOf(const std::string &name) const override {
+    return m_path.empty() ? name : m_path + "/" + name;
+  }
+
+  // Waits for the background writeback, then issues a single barrier for the
+  // whole destination filesystem.
+  bool finish() override;
+
+private:
+  struct OpenNode {
+    int                  fd;
+    zfs::physical::ZNode znode;
+  };
+
+  int currentDirFd() const { return m_dirs.back().fd; }
+
+  static void restoreMetadata(const OpenNode &node);
+
+  void closeCloneSource();
+
+  std::string              m_path;
+  std::vector<std::size_t> m_pathLengths;
+  std::string              m_filePath;
+  std::string              m_cloneSourcePath;
+  int                      m_cloneSourceFd = -1;
+  WriterConfig             m_config;
+  WritebackQueue           m_writeback;
+  std::vector<OpenNode>    m_dirs;
+  FileWriter               m_file;
+  int                      m_updateFd = -1; // see beginFileUpdate()
+  zfs::physical::ZNode     m_fileZNode;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <string>
+
+#include "utils/common.h"
+#include "zfs/physical/znode.h"
+
+// Receives the extracted filesystem tree. Directories are entered and left in a
+// strictly nested fashion, file contents are written between beginFile() and
+// endFile(). Names are always relative to the current directory. Files come
+// with the ID of the object they are extracted from.
+// The data passed to writeFileData() has to stay valid until endFile() returns,
+// so that outputs can batch writes without copying.
+struct Output {
+  virtual ~Output() {}
+
+  virtual bool enterDirectory(const std::string &          name,
+                              const zfs::physical::ZNode &znode) = 0;
+  virtual void leaveDirectory() = 0;
+
+  virtual bool beginFile(const std::string &name, u64 objid,
+                         const zfs::physical::ZNode &znode) = 0;
+  virtual bool writeFileData(const void *data, size_t size) = 0;
+  virtual bool endFile() = 0;
+
+  // Appends SIZE bytes to the current file, taken from an already written
+  // file (given by its pathOf() path) at OFFSET, without the caller providing
+  // the data. Outputs that cannot read back what they wrote return false.
+  virtual bool cloneFileData(const std::string & /*source*/, u64 /*offset*/,
+                             size_t /*size*/) {
+    return false;
+  }
+
+  // For incremental extractions: whether NAME in the current directory has
+  // been written from the same object before and still has the size, mode,
+  // ownership and modification time of ZNODE.
+  virtual bool isFileCurrent(const std::string & /*name*/, u64 /*objid*/,
+                             const zfs::physical::ZNode & /*znode*/) const {
+    return false;
+  }
+
+  // Reopens NAME, written before, instead of beginFile(): its contents are
+  // kept, only what patchFileData() overwrites changes, and endFile() sets the
+  // size and metadata of ZNODE. Outputs that cannot update files in place
+  // return false, and so do they if NAME does not exist or was not written
+  // from the object OBJID.
+  virtual bool beginFileUpdate(const std::string & /*name*/, u64 /*objid*/,
+                               const zfs::physical::ZNode & /*znode*/) {
+    return false;
+  }
+
+  // Overwrites SIZE bytes at OFFSET of the file opened with beginFileUpdate(),
+  // with zeros if DATA is null.
+  virtual bool patchFileData(u64 /*offset*/, const void * /*data*/,
+                             size_t /*size*/) {
+    return false;
+  }
+
+  // Creates NAME as a hard link to an already written file. TARGET is the path
+  // returned by pathOf() for that file.
+  virtual bool linkFile(const std::string &          name,
+                        const zfs::physical::ZNode &znode,
+                        const std::string &          target) = 0;
+
+  // The path of NAME in the current directory, relative to the output root.
+  virtual std::string pathOf(const std::string &name) const = 0;
+
+  // Called once after everything has been written.
+  virtual bool finish() { return true; }
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "output/output.h"
+
+#define TAR_BLOCK_SIZE 512
+
+// Streams the extracted tree as a POSIX (pax) tar archive. Everything is
+// written strictly sequentially, so the output can be a pipe.
+struct TarOutput : Output {
+  // A path of "-" means the standard output.
+  static std::unique_ptr<TarOutput> open(const std::string &path);
+
+  explicit TarOutput(std::FILE *fp, bool own = false);
+
+  TarOutput(const TarOutput &other) = delete;
+  TarOutput &operator=(const TarOutput &other) = delete;
+
+  ~TarOutput();
+
+  bool enterDirectory(const std::string &          name,
+                      const zfs::physical::ZNode &znode) override;
+  void leaveDirectory() override;
+
+  bool beginFile(const std::string &name, u64 objid,
+                 const zfs::physical::ZNode &znode) override;
+  bool writeFileData(const void *data, size_t size) override;
+  bool endFile() override;
+
+  bool linkFile(const std::string &name, const zfs::physical::ZNode &znode,
+                const std::string &target) override;
+
+  std::string pathOf(const std::string &name) const override {
+    return m_path.empty() ? name : m_path + "/" + name;
+  }
+
+  // Writes the end-of-archive marker and flushes. Called by the destructor if
+  // it was not called explicitly.
+  bool finish() override;
+
+private:
+  bool writeHeader(const std::string &path, char typeflag,
+                   const zfs::physical::ZNode &znode, u64 size,
+                   const std::string &linkTarget = "");
+  bool writePadding(u64 size);
+
+  std::FILE *              m_fp;
+  bool                     m_own;
+  bool                     m_finished = false;
+  std::unique_ptr<char[]>  m_buffer;
+  std::string              m_path;
+  std::vector<std::size_t> m_pathLengths;
+
+  bool m_inFile      = false;
+  u64  m_fileSize    = 0;
+  u64  m_fileWritten = 0;
+};
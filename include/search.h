@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdio>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "zfs/indirect_block.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/sa.h"
+#include "zfs/zpool_reader.h"
+
+// Everything a search of a dataset needs to carry around.
+struct SearchContext {
+  explicit SearchContext(
+      zfs::ZPoolReader &reader_,
+      zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock_, std::FILE *out_,
+      const std::vector<std::string> &patterns_)
+      : reader{reader_}, dslBlock{dslBlock_}, out{out_}, patterns{patterns_} {}
+
+  zfs::ZPoolReader &                           reader;
+  zfs::IndirectObjBlock<zfs::physical::DNode> &dslBlock;
+  std::FILE *                                  out;
+
+  // The literal byte strings to look for.
+  const std::vector<std::string> &patterns;
+
+  // Decodes the ZNodes of the dataset, see SaRegistry::load().
+  zfs::SaRegistry sa;
+
+  // Directories that have been visited already, to stop at cycles in a
+  // damaged tree.
+  std::set<u64> visitedDirs;
+};
+
+// Searches the contents of every regular file below the directory OBJID for
+// any of ctx.patterns, writing a tab separated line for each match: the path
+// (escaped like in a listing), the byte offset in the file and the pattern.
+// Matches that span data blocks are found too. Nothing is written to disk.
+//
+// The directory tree is walked first, then the files are searched by
+// NUMTHREADS threads, each streaming the blocks of one file at a time. Returns
+// the number of matches.
+std::size_t searchDirContents(SearchContext &ctx, u64 objid,
+                              unsigned numThreads);
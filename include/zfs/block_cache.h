@@ -0,0 +1,46 @@
+#pragma once
+
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+#include "zfs/block.h"
+#include "zfs/physical/blkptr.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// Decoded blocks shared between threads. A block is identified by its first
+// DVA and its birth txg, which ZFS never reuses for different contents. When
+// several threads ask for the same block at once, it is only read once and
+// they all wait for that read.
+struct BlockCache {
+  explicit BlockCache(ZPoolReader &reader) : m_reader{&reader} {}
+
+  BlockCache(const BlockCache &other) = delete;
+  BlockCache &operator=(const BlockCache &other) = delete;
+
+  // The block BP points to, trying each of its DVAs in turn. Returns nullptr if
+  // none of them can be read, never throws.
+  std::shared_ptr<const BlockPtr> read(const physical::Blkptr &bp);
+
+  // Follows the first block pointer of every indirect level below DNODE, and
+  // returns its first data block.
+  std::shared_ptr<const BlockPtr> readFirstDataBlock(
+      const physical::DNode &dnode);
+
+private:
+  using Key    = std::tuple<u32, u64, u64>; // vdev, address, birth txg
+  using Future = std::shared_future<std::shared_ptr<const BlockPtr>>;
+
+  std::shared_ptr<const BlockPtr> readUncached(const physical::Blkptr &bp);
+
+  ZPoolReader *         m_reader;
+  std::mutex            m_mutex;
+  std::map<Key, Future> m_blocks;
+};
+
+} // end namespace zfs
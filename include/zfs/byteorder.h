@@ -43,11 +43,25 @@ namespace zfs {
 #define BE_64(x) BSWAP_64(x)
 #endif
 
+// Reverse the byte order of every integer of the array, in place. SIZE is in
+// bytes. They use pshufb/vpshufb when the CPU has them.
 void byteswap_uint64_array(void *vbuf, std::size_t size);
 void byteswap_uint32_array(void *vbuf, std::size_t size);
 void byteswap_uint16_array(void *vbuf, std::size_t size);
 void byteswap_uint8_array(void *vbuf, std::size_t size);
 
+// The byteswap functions of the object types (see dmu_ot in dmu.c), for
+// decompressed blocks written by a machine of the other byte order.
+// System attributes in the bonus buffer of a dnode are left alone, they can
+// only be swapped once their layout is known (see SaRegistry::znode()).
+void byteswap_dnode_array(void *vbuf, std::size_t size);
+void byteswap_objset(void *vbuf, std::size_t size);
+void byteswap_zap(void *vbuf, std::size_t size);
+
+// Swaps a block of the given type at the given level of the block tree, if
+// its type needs it.
+void byteswap_block(DNodeType type, u8 level, void *vbuf, std::size_t size);
+
 #ifdef _BIG_ENDIAN
 #define SYSTEM_ENDIAN Endian::Big
 #else
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+
+#include "zfs/general.h"
+#include "zfs/space_map.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// What carveImage() found.
+struct CarveResult {
+  u64    bytes     = 0; // bytes scanned
+  u64    microZaps = 0;
+  u64    dnodes    = 0; // runs of dnodes, see carveImage()
+  u64    objsets   = 0;
+  u64    lz4       = 0; // hits of any kind inside LZ4 compressed blocks
+  double seconds   = 0;
+};
+
+// Scans the whole device for metadata blocks without following any block
+// pointers, for when the uberblocks or the MOS are gone: micro ZAPs (such as
+// directories), dnode arrays and objsets, both as they are and inside LZ4
+// compressed blocks. Candidates are picked by a vectorised test of the first
+// bytes of every sector and then checked with the isValid() predicates and a
+// few sanity checks of their own.
+//
+// Writes one tab separated line per hit to CATALOG, in offset order: the byte
+// offset on the device, the kind (mzap, dnodes, objset), the encoding (plain,
+// or lz4 with the compressed size), the number of entries or dnodes, and the
+// dnode type of the first dnode or the objset type. Consecutive dnodes are
+// reported as one run, up to the size of a dnode block.
+//
+// Only EXTENTS are scanned if given, e.g. the free space of the pool to look
+// for deleted files (see SpaceMaps), otherwise the whole device. Nothing is
+// read past the end of an extent.
+//
+// The device is read in large chunks by NUMTHREADS threads.
+CarveResult carveImage(ZPoolReader &reader, std::FILE *catalog,
+                       unsigned                   numThreads,
+                       const std::vector<Extent> *extents = nullptr);
+
+void printCarveReport(std::FILE *fp, const CarveResult &result);
+
+} // end namespace zfs
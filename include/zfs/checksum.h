@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "zfs/general.h"
+#include "zfs/physical/blkptr.h"
+
+namespace zfs {
+
+// Computes the fletcher4 checksum (see zfs_fletcher.c) of SIZE bytes of DATA,
+// which are native endian 32-bit words, so SIZE has to be a multiple of 4.
+using Fletcher4Fn = void (*)(const void *data, std::size_t size,
+                             OUT u64 cksum[4]);
+
+// The reference implementation.
+void fletcher4Scalar(const void *data, std::size_t size, OUT u64 cksum[4]);
+
+// Vectorised implementations, which keep several partial sums per lane and
+// combine them at the end. They may only be called if the CPU supports them,
+// see fletcher4Implementations().
+void fletcher4SSE2(const void *data, std::size_t size, OUT u64 cksum[4]);
+void fletcher4AVX2(const void *data, std::size_t size, OUT u64 cksum[4]);
+void fletcher4AVX512(const void *data, std::size_t size, OUT u64 cksum[4]);
+
+struct Fletcher4Impl {
+  const char *name;
+  Fletcher4Fn fn;
+};
+
+// The implementations the CPU supports, the fastest first.
+const std::vector<Fletcher4Impl> &fletcher4Implementations();
+
+// The fastest implementation the CPU supports, chosen on first use.
+void fletcher4(const void *data, std::size_t size, OUT u64 cksum[4]);
+
+// Computes the SHA-256 digest of SIZE bytes of DATA.
+using Sha256Fn = void (*)(const void *data, std::size_t size,
+                          OUT u8 digest[32]);
+
+// The reference implementation, and the one using the SHA extensions, which
+// may only be called if the CPU has them, see sha256Implementations().
+void sha256Scalar(const void *data, std::size_t size, OUT u8 digest[32]);
+void sha256SHANI(const void *data, std::size_t size, OUT u8 digest[32]);
+
+struct Sha256Impl {
+  const char *name;
+  Sha256Fn    fn;
+};
+
+// The implementations the CPU supports, the fastest first.
+const std::vector<Sha256Impl> &sha256Implementations();
+
+// The fastest implementation the CPU supports, chosen on first use.
+void sha256(const void *data, std::size_t size, OUT u8 digest[32]);
+
+// Computes the SHA-256 digest of a message that arrives in pieces, with the
+// fastest implementation the CPU supports.
+class Sha256Stream {
+public:
+  Sha256Stream();
+
+  void update(const void *data, std::size_t size);
+
+  // The digest of everything passed to update(). The stream cannot be used
+  // afterwards.
+  void finish(OUT u8 digest[32]);
+
+private:
+  u32         m_state[8];
+  u8          m_buffer[64]; // the incomplete block at the end
+  std::size_t m_buffered = 0;
+  u64         m_size     = 0;
+};
+
+// Hashes 8 messages of SIZE bytes each at once, one per 32-bit lane of the
+// AVX2 registers. May only be called if haveSha256x8() says so.
+void sha256x8AVX2(const void *const data[8], std::size_t size,
+                  OUT u8 digests[8][32]);
+bool haveSha256x8();
+
+// Whether BP's checksum can be checked by verifyChecksum().
+bool canVerifyChecksum(const physical::Blkptr &bp);
+
+// Checks DATA, the SIZE bytes of BP's block as stored on disk (i.e. before
+// decompression), against the checksum in BP. Checksums that cannot be
+// verified (see canVerifyChecksum()) always match.
+bool verifyChecksum(const physical::Blkptr &bp, const void *data,
+                    std::size_t size);
+
+// A block for verifyChecksums().
+struct ChecksumJob {
+  const physical::Blkptr *bp;
+  const void *            data;
+  std::size_t             size;
+  bool                    matches;
+};
+
+// Verifies several blocks at once, setting their MATCHES. Without the SHA
+// extensions, SHA-256 blocks of the same size are hashed 8 at a time.
+void verifyChecksums(INOUT std::vector<ChecksumJob> *jobs);
+
+} // end namespace zfs
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "zfs/general.h"
+
+namespace zfs {
+
+// Decompresses SRC, the PSIZE bytes of a block as stored on disk, into the
+// LSIZE bytes of DST. Returns false if the data is corrupt. Decoders that need
+// state keep a context per thread, so they do not allocate per block.
+using DecompressFn = bool (*)(const u8 *src, std::size_t psize, OUT u8 *dst,
+                              std::size_t lsize);
+
+// Compresses the SIZE bytes of SRC into DST, which can hold CAPACITY bytes, in
+// the on-disk format. Returns the compressed size, or 0 if it does not fit.
+// Only used to produce input for the benchmarks.
+using CompressFn = std::size_t (*)(const u8 *src, std::size_t size,
+                                   OUT u8 *dst, std::size_t capacity);
+
+// An entry of the codec registry, see zio_compress_table in zio_compress.c.
+struct Codec {
+  Compress     comp;
+  const char * name;
+  DecompressFn decompress; // nullptr if the codec is not built in
+  CompressFn   compress;   // ditto
+};
+
+// The codec of the given on-disk compression, or nullptr if the value is not
+// one that can appear in a block pointer (such as Compress::Inherit).
+const Codec *findCodec(Compress comp);
+
+// Every codec that is built in.
+std::vector<const Codec *> availableCodecs();
+
+} // end namespace zfs
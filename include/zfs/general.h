@@ -13,13 +13,25 @@ namespace zfs {
 // matches dmu_object_type in dmu.h in ZFS-on-Linux
 enum class DNodeType : u8 {
   Invalid,
-  ObjDirectory = 1, // contains information about meta objects
-  DNode        = 10,
-  ObjSet       = 11,
-  DataSet      = 16,
-  FileContents = 19,
-  DirContents  = 20,
-  MasterNode   = 21,
+  ObjDirectory      = 1, // contains information about meta objects
+  ObjectArray       = 2, // 64-bit integers, e.g. the metaslab array
+  PackedNvList      = 3, // XDR encoded name-value pairs, e.g. the config
+  SpaceMap          = 8,
+  DNode             = 10,
+  ObjSet            = 11,
+  DSLDirChildMap    = 13,
+  DSLDataSetSnapMap = 14,
+  DSLProps          = 15,
+  DataSet           = 16,
+  ZNode             = 17, // bonus type of ZPL objects before system attributes
+  FileContents      = 19,
+  DirContents       = 20,
+  MasterNode        = 21,
+
+  SystemAttributes = 44, // bonus type of ZPL objects
+  SaMasterNode     = 45,
+  SaRegistry       = 46,
+  SaLayouts        = 47,
 };
 
 static inline const char *getDNodeTypeAsString(DNodeType dt) {
@@ -30,12 +42,23 @@ static inline const char *getDNodeTypeAsString(DNodeType dt) {
   switch (dt) {
     DT(Invalid);
     DT(ObjDirectory);
+    DT(ObjectArray);
+    DT(PackedNvList);
+    DT(SpaceMap);
     DT(DNode);
     DT(ObjSet);
+    DT(DSLDirChildMap);
+    DT(DSLDataSetSnapMap);
+    DT(DSLProps);
     DT(DataSet);
+    DT(ZNode);
     DT(FileContents);
     DT(DirContents);
     DT(MasterNode);
+    DT(SystemAttributes);
+    DT(SaMasterNode);
+    DT(SaRegistry);
+    DT(SaLayouts);
 
   default:
     return "(unknown)";
@@ -50,11 +73,45 @@ enum class Compress : u8 {
   Inherit = 0,
   On,
   Off,
-  LZ4 = 0xf,
+  LZJB,
+  Empty,
+  Gzip1,
+  Gzip2,
+  Gzip3,
+  Gzip4,
+  Gzip5,
+  Gzip6,
+  Gzip7,
+  Gzip8,
+  Gzip9,
+  ZLE,
+  LZ4,
+  ZStd,
 
   Default = LZ4
 };
 
+// zio_checksum in include/sys/zio.h
+enum class Checksum : u8 {
+  Inherit = 0,
+  On,
+  Off,
+  Label,
+  GangHeader,
+  ZILog,
+  Fletcher2,
+  Fletcher4,
+  SHA256,
+  ZILog2,
+  NoParity,
+  SHA512,
+  Skein,
+  EdonR,
+  Blake3,
+
+  Default = Fletcher4
+};
+
 enum class Endian : bool { Little = 1, Big = 0 };
 
 // Each class representing a ZFS on-disk object has to:
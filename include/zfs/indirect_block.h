@@ -23,8 +23,16 @@ struct IndirectBlockNode {
 
   std::size_t size() const { return m_blkptr->getLogicalSize(); }
 
+  const physical::Blkptr &blkptr() const { return *m_blkptr; }
+
   BlockRef readBlock(ZPoolReader &reader, bool allowRead);
 
+  bool isRead() const { return static_cast<bool>(m_ptr); }
+
+  // Sets the block once it has been read some other way, see
+  // IndirectBlockBase::prefetch().
+  void setBlock(BlockPtr block) { m_ptr = std::move(block); }
+
   IndirectBlockNode *readIndirectChild(ZPoolReader &reader, std::size_t index,
                                        bool allowRead);
 
@@ -60,6 +68,17 @@ struct IndirectBlockBase {
     return 1 << ((m_dnode->indblkshift - BLKPTR_SHIFT) * numLevels());
   }
 
+  // The block pointer of the given data block. Only the indirect blocks leading
+  // to it are read, the data block itself is not.
+  const physical::Blkptr *blkptrByID(u64 blockid) {
+    detail::IndirectBlockNode *node = _getChildNode(blockid, true);
+    return node ? &node->blkptr() : nullptr;
+  }
+
+  // Reads the given data blocks, in on-disk order, so that accessing them
+  // afterwards does not cause any I/O. Blocks that cannot be read are skipped.
+  void prefetch(std::vector<u64> blockids);
+
 protected:
   BlockRef blockByIDImpl(u64 blockid) {
     return _getChildNode(blockid, true)->readBlock(*m_reader, true);
@@ -205,6 +224,19 @@ struct IndirectObjBlock : detail::IndirectBlockBase {
     return static_cast<ArrayBlockPtr<TObj> *>(blockByIDImpl(blockid));
   }
 
+  // Reads the blocks holding the given objects, see prefetch().
+  void prefetchObjects(const std::vector<u64> &objids) {
+    const std::size_t objsPerBlock = numObjectsPerBlock();
+
+    std::vector<u64> blockids;
+    for (u64 objid : objids) {
+      if (objid < numObjects())
+        blockids.push_back(objid / objsPerBlock);
+    }
+
+    prefetch(std::move(blockids));
+  }
+
   TObj &objectByID(u64 objid) {
     ASSERT0(objid < numObjects());
     const std::size_t   objsPerBlock = numObjectsPerBlock();
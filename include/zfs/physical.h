@@ -2,6 +2,7 @@
 
 #include "zfs/physical/blkptr.h"
 #include "zfs/physical/dnode.h"
+#include "zfs/physical/fzap.h"
 #include "zfs/physical/mzap.h"
 #include "zfs/physical/objset.h"
 #include "zfs/physical/uberblock.h"
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstring>
+
 #include "zfs/general.h"
 
 // Apparently, ZFS on Linux stores 1 less value in the lsize and psize fields
@@ -7,6 +9,15 @@
 #define BLKPTR_SIZE_BIAS 1u
 #define BLKPTR_SIZE_SHIFT SECTOR_SHIFT
 
+// embedded block pointers carry up to this many bytes of data, in place of the
+// DVAs, the padding and the fill count and checksum (see include/sys/spa.h)
+#define BPE_PAYLOAD_SIZE 112
+#define BPE_LSIZE_BITS 25
+#define BPE_PSIZE_BITS 7
+
+// embedded payload types, stored in place of the checksum type
+#define BP_EMBEDDED_TYPE_DATA 0
+
 namespace zfs {
 namespace physical {
 
@@ -39,7 +50,7 @@ struct Blkptr {
   Compress comp : 7;
   bool     embedded : 1;
 
-  u8        cksum;
+  Checksum  cksum; // the embedded payload type for embedded block pointers
   DNodeType type; // this type seems to be the same as DNode's type
   u8        lvl : 5;
   bool      encrypt : 1;
@@ -52,14 +63,45 @@ struct Blkptr {
   u64 fill;
   u8  checksum[32];
 
+  // The props word as a whole: embedded block pointers lay it out
+  // differently.
+  u64 getProps() const {
+    u64 props;
+    std::memcpy(&props, &lsize, sizeof(props));
+    return props;
+  }
+
+  // Sizes are in bytes for embedded block pointers, and in sectors otherwise.
   size_t getLogicalSize() const {
+    if (embedded)
+      return (getProps() & ((1u << BPE_LSIZE_BITS) - 1)) + BLKPTR_SIZE_BIAS;
+
     return (static_cast<size_t>(lsize) + BLKPTR_SIZE_BIAS) << BLKPTR_SIZE_SHIFT;
   }
 
   size_t getPhysicalSize() const {
+    if (embedded)
+      return ((getProps() >> BPE_LSIZE_BITS) & ((1u << BPE_PSIZE_BITS) - 1)) +
+             BLKPTR_SIZE_BIAS;
+
     return (static_cast<size_t>(psize) + BLKPTR_SIZE_BIAS) << BLKPTR_SIZE_SHIFT;
   }
 
+  u8 getEmbeddedType() const { return static_cast<u8>(cksum); }
+
+  // The number of copies the block can be read from: the leading valid DVAs,
+  // or the block pointer itself if it is embedded.
+  u32 numCopies() const {
+    if (embedded)
+      return 1;
+
+    u32 n = 0;
+    while (n < 3 && dva[n].isValid())
+      n++;
+
+    return n;
+  }
+
   VALID_IF(type != DNodeType::Invalid);
   void dump(std::FILE *fp, DumpFlags flags = DumpFlags::None) const;
 } __attribute__((packed));
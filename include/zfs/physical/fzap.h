@@ -0,0 +1,104 @@
+#pragma once
+
+#include "zfs/general.h"
+#include "zfs/physical/mzap.h"
+
+#define ZAP_MAGIC 0x2F52AB2ABuLL
+#define ZAP_LEAF_MAGIC 0x2AB1EAFu
+
+#define ZAP_LEAF_CHUNKSIZE 24
+#define ZAP_LEAF_ARRAY_BYTES (ZAP_LEAF_CHUNKSIZE - 3)
+#define ZAP_CHAIN_END 0xffffu
+
+// FatZapHeader::flags
+#define ZAP_FLAG_HASH64 (1uLL << 0)
+#define ZAP_FLAG_UINT64_KEY (1uLL << 1)
+#define ZAP_FLAG_PRE_HASHED_KEY (1uLL << 2)
+
+// fat ZAP, i.e. a ZAP spanning multiple blocks: a header block, a pointer table
+// mapping hash prefixes to leaf blocks, and the leaf blocks holding the actual
+// entries
+// matches zap_impl.h and zap_leaf.h in ZFS-on-Linux
+
+namespace zfs {
+namespace physical {
+
+struct ZapTable {
+  u64 blk;         // starting block number
+  u64 numblks;     // number of blocks, 0 if embedded in the header block
+  u64 shift;       // log2 of the number of entries
+  u64 nextblk;     // next (larger) copy start block
+  u64 blks_copied; // number of source blocks copied
+} __attribute__((packed));
+
+// lives in block 0 of a fat ZAP object; the second half of the block is the
+// embedded pointer table
+struct FatZapHeader {
+  ZapBlockType block_type;
+  u64          magic;
+  ZapTable     ptrtbl;
+  u64          freeblk;
+  u64          num_leafs;
+  u64          num_entries;
+  u64          salt;
+  u64          normflags;
+  u64          flags;
+
+  VALID_IF(block_type == ZapBlockType::Header && magic == ZAP_MAGIC);
+  void dump(std::FILE *fp, DumpFlags flags = DumpFlags::None) const;
+} __attribute__((packed));
+
+// The leaf block header is followed by a hash table of u16 chunk indices
+// (1/32 of the block size in entries), then by an array of chunks.
+struct ZapLeafHeader {
+  ZapBlockType block_type;
+  PADDING(sizeof(u64));
+  u64 prefix;     // hash prefix of this leaf
+  u32 magic;
+  u16 nfree;      // number of free chunks
+  u16 nentries;   // number of entries
+  u16 prefix_len; // number of bits used in the prefix
+  u16 freelist;   // chunk head of the free list
+  u8  flags;
+  PADDING(11);
+
+  VALID_IF(block_type == ZapBlockType::Leaf && magic == ZAP_LEAF_MAGIC);
+  void dump(std::FILE *fp, DumpFlags flags = DumpFlags::None) const;
+} __attribute__((packed));
+
+static_assert(sizeof(ZapLeafHeader) == 2 * ZAP_LEAF_CHUNKSIZE,
+              "ZapLeafHeader invalid!");
+
+enum class ZapChunkType : u8 {
+  Array = 251,
+  Entry = 252,
+  Free  = 253,
+};
+
+union ZapLeafChunk {
+  struct {
+    ZapChunkType type;
+    u8           value_intlen;  // size of the value's integers
+    u16          next;          // next entry in the hash chain
+    u16          name_chunk;    // first chunk of the name
+    u16          name_numints;  // number of integers in the name, incl. NUL
+    u16          value_chunk;   // first chunk of the value
+    u16          value_numints; // number of integers in the value
+    u32          cd;            // collision differentiator
+    u64          hash;          // hash value of the name
+  } __attribute__((packed)) entry;
+
+  struct {
+    ZapChunkType type;
+    u8           data[ZAP_LEAF_ARRAY_BYTES];
+    u16          next; // next chunk, or ZAP_CHAIN_END
+  } __attribute__((packed)) array;
+
+  ZapChunkType type;
+} __attribute__((packed));
+
+static_assert(sizeof(ZapLeafChunk) == ZAP_LEAF_CHUNKSIZE,
+              "ZapLeafChunk invalid!");
+
+} // end namespace physical
+} // end namespace zfs
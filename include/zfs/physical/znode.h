@@ -2,6 +2,14 @@
 
 #include "zfs/general.h"
 
+// the value of a directory ZAP entry: the object ID is in the low 48 bits, the
+// type (DT_*) in the top 4 bits
+#define ZFS_DIRENT_OBJ(de) ((de) & ((1uLL << 48) - 1))
+
+// the number of directory entries sorted and prefetched together, see
+// forEachDirEntryBatch()
+#define DIR_ENTRY_BATCH 65536
+
 namespace zfs {
 namespace physical {
 
@@ -13,49 +21,68 @@ struct ZNodeTime {
   void dump(std::FILE *of, DumpFlags flags = DumpFlags::None) const;
 } __attribute__((packed));
 
-// lives in the bonus array of ZPL DNode-s
-// this seems to be deprecated in ZFS-on-Linux (deprecated in ZPL version
-// 5)
-/*struct ZNode {
-  ZNodeTime time_accessed;
-  ZNodeTime time_modified;
-  ZNodeTime time_changed;
-  ZNodeTime time_created;
-  u64       gen_txg;
+// the bonus buffer of ZPL dnodes before system attributes, i.e. with a bonus
+// type of DNodeType::ZNode (znode_phys_t in zfs_znode.h)
+struct ZNodePhys {
+  ZNodeTime atime;  // accessed
+  ZNodeTime mtime;  // modified
+  ZNodeTime ctime;  // changed
+  ZNodeTime crtime; // created
+  u64       gen;
   u64       mode;
   u64       size;
-  u64       parent_obj;
+  u64       parent;
   u64       links;
   u64       xattr;
   u64       rdev;
   u64       flags;
   u64       uid;
   u64       gid;
-  PADDING(4 * sizeof(u64));
-  PADDING(2 * sizeof(u64) + 2 * sizeof(u64) * 6); // zp_acl
+  u64       zap;
+  PADDING(3 * sizeof(u64));
+  PADDING(2 * sizeof(u64) + 72); // zp_acl
 
   VALID_IF(true);
 
   void dump(std::FILE *of, DumpFlags flags = DumpFlags::None) const;
-} __attribute__((packed));*/
-
-// this seems to be the new "ZNode" from ZPL v5
-// this structure doesn't exist directly in ZFS, they switched to a "system
-// attribute" (SA) management system - this order and size of fields was
-// determined based on dump_znode() in zdb.c and zfs_sa.h's SA_*_OFFSET macros,
-// as well as manual examination of the data (e.g. the timestamps can be
-// recognised)
-// there are more fields (see enum zpl_attr), but the order of them I'm not sure
-// about
+} __attribute__((packed));
+
+static_assert(sizeof(ZNodePhys) == 264, "ZNodePhys invalid!");
+
+#define SA_MAGIC 0x2F505A
+
+// the start of the bonus buffer of dnodes with system attributes, i.e. with a
+// bonus type of DNodeType::SystemAttributes (sa_hdr_phys_t in sa_impl.h)
+// the attributes follow the header in the order given by the layout, each
+// aligned to 8 bytes, see SaRegistry
+struct SaHeader {
+  u32 magic;
+  u16 layout_info; // layout number in bits 0-9, header size / 8 in bits 10-15
+  u16 lengths[];   // VLA, of the variable length attributes
+
+  u16         layout() const { return layout_info & 0x3ff; }
+  std::size_t headerSize() const { return (layout_info >> 10) * 8uL; }
+
+  VALID_IF(magic == SA_MAGIC && headerSize() >= 8);
+  void dump(std::FILE *of, DumpFlags flags = DumpFlags::None) const;
+} __attribute__((packed));
+
+// The ZPL attributes of a file or directory. Since ZPL version 5, this
+// structure doesn't exist directly in ZFS: the attributes are "system
+// attributes" (SA), stored in whatever order the layout of the dnode says, so
+// SaRegistry decodes them into this.
+// This order and size of fields is the most common layout (determined based on
+// dump_znode() in zdb.c, zfs_sa.h's SA_*_OFFSET macros and manual examination
+// of the data), which is assumed for datasets without an SA registry.
 struct ZNode {
-  PADDING(8); // header?
+  PADDING(8); // SaHeader
   u64       mode;
   u64       size;
   u64       gen;
   u64       uid;
   u64       gid;
   u64       parent;
-  u64       links;  // ?
+  u64       links;
   ZNodeTime atime;  // accessed
   ZNodeTime mtime;  // modified
   ZNodeTime crtime; // created
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <vector>
+
+#include "zfs/indirect_block.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/physical/znode.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// The system attribute (SA) registry of a dataset: the length of every
+// registered attribute, and the order in which each layout stores them in the
+// bonus buffer of a dnode. It is read once per dataset, and every layout is
+// compiled into a table of the offsets of the ZNode fields, so that decoding a
+// ZNode is a handful of copies instead of a walk over the layout.
+struct SaRegistry {
+  SaRegistry() = default;
+
+  SaRegistry(const SaRegistry &other) = delete;
+  SaRegistry &operator=(const SaRegistry &other) = delete;
+
+  // Reads the registry and the layouts of the dataset whose master node is
+  // MASTERNODE (object 1 of DSLBLOCK). Returns false if it has none, in which
+  // case znode() assumes the layout of physical::ZNode.
+  bool load(ZPoolReader &reader, IndirectObjBlock<physical::DNode> &dslBlock,
+            const physical::DNode &masterNode);
+
+  bool isLoaded() const { return !m_layouts.empty(); }
+
+  // The ZPL attributes in the bonus buffer of DNODE, either system attributes
+  // or a pre-SA physical::ZNodePhys. Attributes that are not present (or are in
+  // a spill block) are zero, and so is everything for objects without them.
+  physical::ZNode znode(const physical::DNode &dnode) const;
+
+private:
+  // Copies an attribute into the ZNode.
+  struct FieldCopy {
+    u16 from;   // offset from the end of the SaHeader
+    u16 to;     // offset in physical::ZNode
+    u16 length; // at most the size of the ZNode field
+  };
+
+  struct Layout {
+    std::vector<u16> attrs; // attribute numbers, in the order they are stored
+
+    // the ZNode fields stored before the first variable length attribute,
+    // whose offsets are the same for every dnode
+    std::vector<FieldCopy> fixed;
+
+    // the index of the first variable length attribute in ATTRS, and its
+    // offset; from there on, the lengths in the SaHeader have to be walked
+    std::size_t firstVariable  = 0;
+    std::size_t variableOffset = 0;
+  };
+
+  void compileLayout(u16 number, const std::vector<u64> &attrs);
+
+  void decodeVariable(const Layout &layout, const u8 *bonus,
+                      std::size_t bonusLength, INOUT physical::ZNode *znode)
+      const;
+
+  std::vector<u16> m_attrLengths; // by attribute number, 0 if variable
+  std::vector<i32> m_zplFields;   // by attribute number, into ZPL_ATTRS or -1
+  std::vector<Layout> m_layouts;  // by layout number, no ATTRS if unused
+};
+
+} // end namespace zfs
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <utility>
+
+#include "zfs/general.h"
+#include "zfs/physical/blkptr.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// What scrubPool() found.
+struct ScrubResult {
+  u64    blocks      = 0; // blocks read, including the damaged ones
+  u64    bytes       = 0; // physical bytes read
+  u64    unverified  = 0; // blocks whose checksum type cannot be verified
+  u64    unsupported = 0; // blocks that cannot be read at all, e.g. gang blocks
+  u64    damaged     = 0; // blocks none of whose copies could be read
+  double seconds     = 0;
+
+  struct Damage {
+    DNodeType type;
+    u64       blocks;
+  };
+
+  // Damaged blocks by dataset (the object id of its DSL dataset in the MOS, 0
+  // for the MOS itself) and object id.
+  std::map<std::pair<u64, u64>, Damage> damage;
+};
+
+// Reads every block reachable from ROOTBP, the root of the MOS: the MOS
+// itself, and the objsets of all datasets and snapshots, down to their data
+// blocks. Every block is checksummed and decompressed, but nothing is written.
+//
+// The tree is walked depth first by NUMTHREADS threads, each reading a batch of
+// blocks at a time with ZPoolReader::readBatch(), in on-disk order within the
+// batch. Like the scrub of ZFS, each dataset only visits the blocks born after
+// its previous snapshot, so shared blocks are only read once. Memory is bound
+// by the depth of the tree times the block pointers below a batch, not by the
+// size of the pool.
+ScrubResult scrubPool(ZPoolReader &reader, const physical::Blkptr &rootbp,
+                      unsigned numThreads);
+
+void printScrubReport(std::FILE *fp, const ScrubResult &result);
+
+} // end namespace zfs
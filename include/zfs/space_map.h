@@ -0,0 +1,67 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "zfs/general.h"
+#include "zfs/indirect_block.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// A range of the device, as byte offsets: [start, end).
+struct Extent {
+  u64 start;
+  u64 end;
+
+  u64 size() const { return end - start; }
+};
+
+// Sorted, non-overlapping ranges of the device. Adjacent ranges are merged.
+struct ExtentTree {
+  void add(u64 start, u64 end);
+  void remove(u64 start, u64 end);
+
+  bool empty() const { return m_extents.empty(); }
+
+  // The total size of the extents.
+  u64 bytes() const;
+
+  // The extents, or the gaps between them inside [START, END), in order.
+  std::vector<Extent> extents() const;
+  std::vector<Extent> gaps(u64 start, u64 end) const;
+
+private:
+  std::map<u64, u64> m_extents; // start -> end
+};
+
+// The space accounting of a pool, as far as the metaslab space maps tell.
+struct SpaceMaps {
+  ExtentTree allocated;
+
+  // The part of the device covered by the metaslabs; everything else are the
+  // labels and the boot area.
+  u64 start = 0;
+  u64 end   = 0;
+
+  u64 metaslabs = 0;
+
+  std::vector<Extent> freeExtents() const {
+    return allocated.gaps(start, end);
+  }
+  std::vector<Extent> allocatedExtents() const { return allocated.extents(); }
+};
+
+// Builds the allocated ranges of the device from the space maps of its
+// metaslabs, found through the pool configuration in the object directory of
+// MOS. Each space map is a log of allocations and frees, replayed in order.
+//
+// Only pools with a single top level vdev are understood, and the log space
+// maps of newer pools are not replayed, so the allocations of the last few
+// transaction groups can be missing. Returns false if the configuration
+// cannot be read.
+bool loadSpaceMaps(ZPoolReader &reader, IndirectObjBlock<physical::DNode> &mos,
+                   OUT SpaceMaps *maps);
+
+} // end namespace zfs
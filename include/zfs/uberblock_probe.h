@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+
+#include "zfs/block_cache.h"
+#include "zfs/physical/uberblock.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// Whether the critical metadata UB points to decodes: its root objset, the
+// head of the MOS dnode array, and the object directory ZAP.
+bool probeUberblock(BlockCache &cache, const physical::Uberblock &ub);
+
+// Probes the given uberblocks concurrently, sharing a block cache, and returns
+// the newest one that passes probeUberblock(), or nullptr if none does. UBS
+// has to be sorted the newest first, see ZPoolReader::scanUberblocks().
+const UberblockEntry *
+findUsableUberblock(ZPoolReader &reader,
+                    const std::vector<UberblockEntry> &ubs);
+
+} // end namespace zfs
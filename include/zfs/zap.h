@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "zfs/block.h"
+#include "zfs/indirect_block.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/physical/fzap.h"
+#include "zfs/physical/mzap.h"
+#include "zfs/physical/znode.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// A decoded ZAP entry. Most values are a single integer, which is all there is
+// for directories and object directories; fat ZAPs can also hold arrays (e.g.
+// the SA layouts), which are kept in full in VALUES.
+struct ZapEntry {
+  std::string      name;
+  u64              value;  // the first integer of the value
+  u64              hash;   // as stored in fat ZAP leaves, 0 for micro ZAPs
+  std::vector<u64> values; // every integer, if there is more than one
+};
+
+// The salted CRC64 hash ZFS uses for ZAP names (zap_hash() in zap_micro.c),
+// truncated to the top HASHBITS bits.
+u64 zapHash(u64 salt, const char *name, std::size_t length,
+            unsigned hashBits);
+
+// A ZAP object: either a micro ZAP, which is a single block, or a fat ZAP.
+// Entries are streamed: the leaf blocks of a fat ZAP are read in batches and
+// dropped once they have been iterated, so that even directories with millions
+// of entries can be walked in bounded memory.
+struct ZapObject {
+  struct Cursor;
+
+  // An input iterator over the entries. Copies share the same position.
+  struct iterator {
+    iterator() = default;
+    explicit iterator(std::shared_ptr<Cursor> cursor);
+
+    const ZapEntry &operator*() const { return m_entry; }
+    const ZapEntry *operator->() const { return &m_entry; }
+
+    iterator &operator++();
+
+    bool operator==(const iterator &rhs) const {
+      return m_cursor == rhs.m_cursor;
+    }
+
+    bool operator!=(const iterator &rhs) const { return !operator==(rhs); }
+
+  private:
+    std::shared_ptr<Cursor> m_cursor;
+    ZapEntry                m_entry;
+  };
+
+  explicit ZapObject(ZPoolReader &reader, const physical::DNode &dnode);
+  ~ZapObject();
+
+  ZapObject(const ZapObject &other) = delete;
+  ZapObject &operator=(const ZapObject &other) = delete;
+
+  // Whether the first block could be read and is a valid micro or fat ZAP
+  // header.
+  bool isValid() const { return m_micro || m_fat; }
+  bool isMicro() const { return m_micro; }
+
+  std::size_t blockSize() const { return m_blocks.dataBlockSize(); }
+
+  u64 salt() const;
+
+  // The number of hash bits the ZAP uses.
+  unsigned hashBits() const;
+
+  // Whether the hashes stored in the entries can be reproduced with zapHash():
+  // only for fat ZAPs with plain string keys and no name normalization.
+  bool hasNativeHashes() const;
+
+  iterator begin();
+  iterator end() { return iterator{}; }
+
+  bool findEntry(const std::string &name, OUT u64 *value);
+
+  void dump(std::FILE *fp, DumpFlags flags = DumpFlags::None);
+
+private:
+  friend struct Cursor;
+
+  // Reads the given block of the ZAP object, without caching it. Returns
+  // nullptr on failure.
+  BlockPtr readBlock(u64 blockid);
+
+  // The on-disk address of the given block, used to order reads.
+  u64 blockAddress(u64 blockid);
+
+  const physical::FatZapHeader &fatHeader() const {
+    return *reinterpret_cast<const physical::FatZapHeader *>(m_fat.data());
+  }
+
+  ZPoolReader * m_reader;
+  IndirectBlock m_blocks;
+  MZapBlockPtr  m_micro;
+  BlockPtr      m_fat; // the fat ZAP header block
+};
+
+// Walks the entries of the directory DIRDNODE in batches of DIR_ENTRY_BATCH, to
+// bound the memory used by huge directories. Each batch is sorted by object ID
+// and the dnode blocks it needs are read in one go before it is passed to FN,
+// so that the dnode array is read front to back instead of in hash order.
+// Returns false if the ZAP of the directory cannot be read.
+template <typename TFn>
+bool forEachDirEntryBatch(ZPoolReader &                      reader,
+                          IndirectObjBlock<physical::DNode> &dslBlock,
+                          const physical::DNode &            dirDnode,
+                          TFn                                fn) {
+  ZapObject dirZap{reader, dirDnode};
+  if (!dirZap.isValid())
+    return false;
+
+  std::vector<ZapEntry> entries;
+  const auto flush = [&dslBlock, &entries, &fn]() {
+    std::sort(entries.begin(), entries.end(),
+              [](const ZapEntry &lhs, const ZapEntry &rhs) {
+                return ZFS_DIRENT_OBJ(lhs.value) < ZFS_DIRENT_OBJ(rhs.value);
+              });
+
+    std::vector<u64> objids;
+    for (const ZapEntry &entry : entries)
+      objids.push_back(ZFS_DIRENT_OBJ(entry.value));
+
+    dslBlock.prefetchObjects(objids);
+
+    fn(static_cast<const std::vector<ZapEntry> &>(entries));
+    entries.clear();
+  };
+
+  for (const ZapEntry &entry : dirZap) {
+    entries.push_back(entry);
+
+    if (entries.size() == DIR_ENTRY_BATCH)
+      flush();
+  }
+
+  if (!entries.empty())
+    flush();
+
+  return true;
+}
+
+} // end namespace zfs
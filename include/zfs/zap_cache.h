@@ -0,0 +1,86 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "zfs/physical/dnode.h"
+#include "zfs/zap.h"
+#include "zfs/zpool_reader.h"
+
+namespace zfs {
+
+// All entries of a ZAP object, decoded once and indexed by name. Names are kept
+// in a single buffer, and looked up through an open addressing table keyed by
+// the ZAP's own salted name hash.
+struct ZapIndex {
+  explicit ZapIndex(ZapObject &zap);
+
+  ZapIndex(const ZapIndex &other) = delete;
+  ZapIndex &operator=(const ZapIndex &other) = delete;
+
+  bool findEntry(const std::string &name, OUT u64 *value) const;
+
+  std::size_t numEntries() const { return m_entries.size(); }
+
+  // A rough estimate of the memory used by the index.
+  std::size_t memoryUsage() const;
+
+private:
+  struct Entry {
+    u64 hash;
+    u64 value;
+    u32 nameOffset;
+    u32 nameLength;
+  };
+
+  u64 hashName(const char *name, std::size_t length) const {
+    return zapHash(m_salt, name, length, m_hashBits);
+  }
+
+  std::size_t slotOf(u64 hash) const;
+
+  u64                m_salt;
+  unsigned           m_hashBits;
+  std::string        m_names;
+  std::vector<Entry> m_entries;
+  std::vector<u32>   m_table;      // index + 1 into m_entries, 0 if empty
+  unsigned           m_tableShift; // 64 - log2 of the table size
+};
+
+// Decoded ZAP objects of a single object set, keyed by object ID, so that
+// resolving paths or looking up names repeatedly never reads a ZAP block
+// twice. The least recently used indexes are dropped once the total number of
+// entries exceeds the budget.
+struct ZapCache {
+  explicit ZapCache(std::size_t maxEntries = 4 * 1024 * 1024)
+      : m_maxEntries{maxEntries} {}
+
+  ZapCache(const ZapCache &other) = delete;
+  ZapCache &operator=(const ZapCache &other) = delete;
+
+  // The index of the ZAP object OBJID (whose dnode is DNODE), decoding it on
+  // first use. Returns nullptr if it is not a valid ZAP object.
+  std::shared_ptr<const ZapIndex>
+  get(ZPoolReader &reader, u64 objid, const physical::DNode &dnode);
+
+  bool findEntry(ZPoolReader &reader, u64 objid, const physical::DNode &dnode,
+                 const std::string &name, OUT u64 *value);
+
+private:
+  struct CachedIndex {
+    std::shared_ptr<const ZapIndex> index;
+    std::list<u64>::iterator        lruPos;
+  };
+
+  void evict();
+
+  std::size_t                          m_maxEntries;
+  std::size_t                          m_numEntries = 0;
+  std::list<u64>                       m_lru; // most recently used first
+  std::unordered_map<u64, CachedIndex> m_indexes;
+};
+
+} // end namespace zfs
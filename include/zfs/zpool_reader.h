@@ -4,6 +4,7 @@
 #include <exception>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "utils/common.h"
 #include "zfs/block.h"
@@ -42,6 +43,13 @@ private:
   std::string m_msg;
 };
 
+// A valid uberblock found by ZPoolReader::scanUberblocks().
+struct UberblockEntry {
+  u32                 label;
+  u32                 index; // slot in the uberblock ring of the label
+  physical::Uberblock ub;
+};
+
 struct ZPoolReader {
   static std::unique_ptr<ZPoolReader> open(const std::string &path) {
     std::FILE *fp = std::fopen(path.c_str(), "rb");
@@ -70,9 +78,37 @@ struct ZPoolReader {
   bool readUberblock(u32 label_index, u32 ub_index,
                      OUT physical::Uberblock *ub);
 
+  // Reads the whole uberblock ring of every label, with one read per label and
+  // all of them in parallel. Returns the usable uberblocks of all labels, the
+  // newest first.
+  std::vector<UberblockEntry> scanUberblocks();
+
+  // Tells the kernel that the given block is going to be read soon, so that
+  // the reads of a batch of blocks can be queued up together.
+  void prefetch(const physical::Blkptr &bp, u32 dva_index);
+
+  // All reads are positional and can be issued from several threads at once.
   bool read(const physical::Blkptr &bp, u32 dva_index, OUT void *data);
   BlockPtr read(const physical::Blkptr &pbp, u32 dva_index);
 
+  // Reads BP's block from the first of its copies, starting with FIRST_DVA,
+  // that can be read and matches its checksum. Returns nullptr if none does.
+  BlockPtr readAnyCopy(const physical::Blkptr &bp, u32 first_dva = 0);
+
+  // Reads the blocks of all of BPS, in the given order, and verifies their
+  // checksums together (see verifyChecksums()) before decompressing them.
+  // Blocks whose first copy is damaged are read from the others, the ones that
+  // cannot be read at all are nullptr.
+  std::vector<BlockPtr>
+  readBatch(const std::vector<const physical::Blkptr *> &bps);
+
+  // Reads SIZE bytes at OFFSET of the device as they are, for scanning it
+  // without any block pointers. Returns the number of bytes read.
+  std::size_t readRaw(u64 offset, std::size_t size, OUT void *data);
+
+  // The size of the image file or block device.
+  u64 deviceSize() const;
+
   template <typename TPtr>
   TPtr read(const physical::Blkptr &pbp, u32 dva_index) {
     return read(pbp, dva_index).cast<TPtr>();
@@ -85,6 +121,11 @@ struct ZPoolReader {
   }
 
 private:
+  // Reads and decompresses the given copy of BP's block, in the byte order it
+  // was written in.
+  bool readDecompressed(const physical::Blkptr &bp, u32 dva_index,
+                        OUT void *data);
+
   std::FILE *m_fp;
   bool       m_own;
 };
@@ -1,11 +1,14 @@
-#include <sys/stat.h> // mkdir
+#include <algorithm>
+#include <atomic>
+#include <fnmatch.h>
+#include <thread>
 
+#include "zfs/checksum.h"
 #include "zfs/indirect_block.h"
-#include "zfs/physical/mzap.h"
 #include "zfs/physical/znode.h"
+#include "zfs/zap.h"
 
 #include "utils/common.h"
-#include "utils/file.h"
 #include "utils/log.h"
 
 #include "extraction.h"
@@ -17,105 +20,761 @@ enum class DirEntryFlags : u64 {
   File = 0x8000000000000000  // bit 63
 };
 
-bool extractFileContents(ZPoolReader &reader, const physical::DNode &dnode,
-                         const std::string &outFile) {
+// the number of dnode blocks a sweep thread takes at a time
+#define SWEEP_CHUNK_BLOCKS 64
+
+// the number of changed data blocks read together when updating a file
+#define UPDATE_BATCH 16
+
+// Whether equal checksums of the given type mean equal data. Fletcher sums
+// collide easily, which is why ZFS only dedups with them if it can verify the
+// data; neither does Edon-R qualify on its own (see zio_checksum_table).
+static bool isCryptographicChecksum(Checksum cksum) {
+  switch (cksum) {
+  case Checksum::SHA256:
+  case Checksum::SHA512:
+  case Checksum::Skein:
+  case Checksum::Blake3:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool getBlockKey(const physical::Blkptr &bp, OUT BlockKey *key) {
+  // embedded block pointers have their payload where the checksum would be
+  if (bp.embedded || !isCryptographicChecksum(bp.cksum))
+    return false;
+
+  static const u8 zeros[sizeof(bp.checksum)] = {};
+  if (std::memcmp(bp.checksum, zeros, sizeof(zeros)) == 0)
+    return false;
+
+  std::memcpy(key->checksum, bp.checksum, sizeof(key->checksum));
+  key->props = static_cast<u64>(bp.lsize) |
+               (static_cast<u64>(bp.psize) << 16) |
+               (static_cast<u64>(bp.comp) << 32) |
+               (static_cast<u64>(bp.cksum) << 40);
+  return true;
+}
+
+// Tries to append a block that has already been written to the current output
+// file without reading it from the pool.
+static bool cloneDataBlock(ExtractionContext &ctx, const BlockKey &key,
+                           std::size_t size) {
+  auto it = ctx.writtenBlocks.find(key);
+  if (it == ctx.writtenBlocks.end() || it->second.size < size)
+    return false;
+
+  const BlockLocation &loc = it->second;
+  return ctx.output.cloneFileData(ctx.dedupFiles[loc.file], loc.offset, size);
+}
+
+// Writes the manifest line of the file at PATH, like sha256sum does: paths
+// with a backslash or a newline in them are escaped, and the line marked with
+// a leading backslash.
+static void writeManifestLine(std::FILE *fp, const std::string &digest,
+                              const std::string &path) {
+  if (path.find_first_of("\\\n") == std::string::npos) {
+    std::fprintf(fp, "%s  %s\n", digest.c_str(), path.c_str());
+    return;
+  }
+
+  std::fprintf(fp, "\\%s  ", digest.c_str());
+  for (const char c : path) {
+    if (c == '\\')
+      std::fputs("\\\\", fp);
+    else if (c == '\n')
+      std::fputs("\\n", fp);
+    else
+      std::fputc(c, fp);
+  }
+  std::fputc('\n', fp);
+}
+
+static std::string toHex(const u8 *data, std::size_t size) {
+  static const char digits[] = "0123456789abcdef";
+
+  std::string result(2 * size, '\0');
+  for (std::size_t i = 0; i < size; i++) {
+    result[2 * i]     = digits[data[i] >> 4];
+    result[2 * i + 1] = digits[data[i] & 0xf];
+  }
+
+  return result;
+}
+
+// Hard links a file that has already been extracted under a different name.
+static bool linkFileContents(ExtractionContext &    ctx,
+                             const physical::DNode &dnode,
+                             const std::string &    name) {
+  auto it = ctx.linkTargets.find(&dnode);
+  if (it == ctx.linkTargets.end())
+    return false;
+
+  LOG("Linking file %s to %s...\n", name.c_str(), it->second.c_str());
+  if (!ctx.output.linkFile(name, ctx.sa.znode(dnode), it->second))
+    return false;
+
+  if (ctx.manifest)
+    writeManifestLine(ctx.manifest, ctx.linkDigests[&dnode],
+                      ctx.output.pathOf(name));
+  return true;
+}
+
+namespace {
+
+// What patchChangedBlocks() needs to know about the file being updated.
+struct FileUpdate {
+  ExtractionContext &ctx;
+  u64                fileSize;
+  u64                blockSize;
+  unsigned           epbs; // log2 of the block pointers per indirect block
+};
+
+} // end anonymous namespace
+
+// The part of the file that the block BLOCKID at LEVEL covers. Returns false
+// if it lies past the end of the file.
+static bool fileRange(const FileUpdate &update, u64 blockid, unsigned level,
+                      OUT u64 *offset, OUT u64 *size) {
+  const u64 numBlocks =
+      (update.fileSize + update.blockSize - 1) / update.blockSize;
+  const unsigned shift = update.epbs * level;
+
+  // checked first, so that the shifts below cannot overflow
+  if (shift < 64 ? blockid > (numBlocks >> shift) : blockid > 0)
+    return false;
+
+  const u64 first = shift < 64 ? blockid << shift : 0;
+  if (first >= numBlocks)
+    return false;
+
+  const u64 count = shift < 64
+                        ? std::min<u64>(1uLL << shift, numBlocks - first)
+                        : numBlocks - first;
+
+  *offset = first * update.blockSize;
+  *size   = std::min(count * update.blockSize, update.fileSize - *offset);
+  return true;
+}
+
+// Patches in what changed below the COUNT block pointers BPS at LEVEL, the
+// first of which is block FIRSTBLOCKID of that level. Block pointers that are
+// not newer than ctx.sinceTxg are skipped along with everything below them.
+static bool patchChangedBlocks(FileUpdate &update, const physical::Blkptr *bps,
+                               std::size_t count, u64 firstBlockid,
+                               unsigned level) {
+  ExtractionContext &ctx = update.ctx;
+
+  // the changed data blocks, read in batches
+  std::vector<const physical::Blkptr *> dataBps;
+  std::vector<u64>                      dataIds;
+
+  const auto flush = [&] {
+    std::vector<BlockPtr> blocks = ctx.reader.readBatch(dataBps);
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+      if (!blocks[i])
+        throw ZPoolReaderException{dataBps[i], nullptr,
+                                   "None of the copies of the block could be "
+                                   "read!"};
+
+      u64 offset, size;
+      if (!fileRange(update, dataIds[i], 0, OUT & offset, OUT & size))
+        continue;
+
+      if (!ctx.output.patchFileData(offset, blocks[i].data(),
+                                    std::min<u64>(size, blocks[i].size())))
+        return false;
+
+      ctx.patchedBlocks++;
+    }
+
+    dataBps.clear();
+    dataIds.clear();
+    return true;
+  };
+
+  for (std::size_t i = 0; i < count; i++) {
+    const physical::Blkptr &bp      = bps[i];
+    const u64               blockid = firstBlockid + i;
+
+    if (bp.birth_txg <= ctx.sinceTxg)
+      continue;
+
+    u64 offset, size;
+    if (!fileRange(update, blockid, level, OUT & offset, OUT & size))
+      continue;
+
+    // holes born since then are ranges that have been freed
+    if (!bp.embedded && bp.numCopies() == 0) {
+      if (!ctx.output.patchFileData(offset, nullptr, size))
+        return false;
+      continue;
+    }
+
+    if (level == 0) {
+      dataBps.push_back(&bp);
+      dataIds.push_back(blockid);
+
+      if (dataBps.size() == UPDATE_BATCH && !flush())
+        return false;
+      continue;
+    }
+
+    BlockPtr block = ctx.reader.readAnyCopy(bp);
+    if (!block)
+      throw ZPoolReaderException{&bp, nullptr,
+                                 "None of the copies of the block could be "
+                                 "read!"};
+
+    if (!patchChangedBlocks(
+            update, static_cast<const physical::Blkptr *>(block.data()),
+            block.size() / sizeof(physical::Blkptr), blockid << update.epbs,
+            level - 1))
+      return false;
+  }
+
+  return dataBps.empty() || flush();
+}
+
+// Brings NAME, left behind by the extraction as of ctx.sinceTxg, up to date.
+// Returns false if it has to be extracted in full instead, e.g. because it is
+// not in the output or was extracted from a different object.
+static bool updateFileContents(ExtractionContext &ctx, u64 objid,
+                               const physical::DNode &dnode,
+                               const std::string &    name) {
+  const physical::ZNode znode = ctx.sa.znode(dnode);
+
+  // a block pointer is rewritten whenever anything below it changes
+  bool changed = false;
+  for (u64 i = 0; i < dnode.nblkptr; i++)
+    changed = changed || dnode.bps[i].birth_txg > ctx.sinceTxg;
+
+  if (!changed && ctx.output.isFileCurrent(name, objid, znode)) {
+    ctx.unchangedFiles++;
+
+    if (znode.links > 1)
+      ctx.linkTargets.emplace(&dnode, ctx.output.pathOf(name));
+    return true;
+  }
+
+  if (!ctx.output.beginFileUpdate(name, objid, znode))
+    return false;
+
+  LOG("Updating file %s...\n", name.c_str());
+
+  FileUpdate update{ctx, znode.size,
+                    static_cast<u64>(dnode.datablksecsize) << SECTOR_SHIFT,
+                    dnode.indblkshift - static_cast<unsigned>(BLKPTR_SHIFT)};
+
+  bool ok;
+  try {
+    ok = patchChangedBlocks(update, dnode.bps, dnode.nblkptr, 0,
+                            dnode.nlevels - 1u);
+  } catch (...) {
+    ctx.output.endFile();
+    throw;
+  }
+
+  if (!ctx.output.endFile() || !ok)
+    return false;
+
+  if (znode.links > 1)
+    ctx.linkTargets.emplace(&dnode, ctx.output.pathOf(name));
+  return true;
+}
+
+bool extractFileContents(ExtractionContext &ctx, u64 objid,
+                         const physical::DNode &dnode,
+                         const std::string &    name) {
   ASSERT0(dnode.type == DNodeType::FileContents);
 
-  LOG("Extracting file to %s...\n", outFile.c_str());
+  if (linkFileContents(ctx, dnode, name))
+    return true;
+
+  if (ctx.sinceTxg != 0 && updateFileContents(ctx, objid, dnode, name))
+    return true;
 
-  IndirectBlock indirectBlock{reader, dnode};
+  LOG("Extracting file %s...\n", name.c_str());
+
+  Output &output = ctx.output;
+
+  IndirectBlock indirectBlock{ctx.reader, dnode};
   LOG("File blocks total size: %zu, indirect block size: %zu, num data blocks: "
       "%zu\n",
       indirectBlock.size(), indirectBlock.indirectBlockSize(),
       indirectBlock.numDataBlocks());
 
-  File fp{outFile, File::Write};
-  if (!fp) {
+  const physical::ZNode znode = ctx.sa.znode(dnode);
+  znode.dump(stderr);
+
+  LOG("Actual file size: %lu\n", znode.size);
+
+  if (!output.beginFile(name, objid, znode)) {
     LOG("Failed to open output file!\n");
     return false;
   }
 
-  const auto &znode = dnode.getBonusAs<physical::ZNode>();
-  znode.dump(stderr);
+  const std::size_t fileSize = znode.size;
 
-  LOG("Actual file size: %lu\n", znode.size);
+  std::size_t  writtenSize = 0;
+  long         dedupIndex  = -1; // index into ctx.dedupFiles, once known
+  Sha256Stream hash;
+  try {
+    for (u64 blockid = 0; blockid < indirectBlock.numDataBlocks(); blockid++) {
+      const physical::Blkptr *bp =
+          ctx.dedupBlocks ? indirectBlock.blkptrByID(blockid) : nullptr;
 
-  const std::size_t fileSize = znode.size;
+      BlockKey   key;
+      const bool dedup = bp && getBlockKey(*bp, OUT & key);
+
+      if (dedup) {
+        const std::size_t writeSize =
+            std::min(bp->getLogicalSize(), fileSize - writtenSize);
+
+        if (cloneDataBlock(ctx, key, writeSize)) {
+          LOG("Cloned block %lu of length %zu from the output\n", blockid,
+              writeSize);
+
+          // the manifest still needs the data, only the write is saved
+          if (ctx.manifest)
+            hash.update(indirectBlock.blockByID(blockid).data(), writeSize);
+
+          writtenSize += writeSize;
+          continue;
+        }
+      }
+
+      BlockRef          dataBlock = indirectBlock.blockByID(blockid);
+      const std::size_t writeSize =
+          std::min(dataBlock.size(), fileSize - writtenSize);
+      // const std::size_t writeSize = dataBlock.size();
+
+      LOG("Extracting block %p of size %zu, writing effective length %zu...\n",
+          dataBlock.data(), dataBlock.size(), writeSize);
+      ASSERT0(output.writeFileData(dataBlock.data(), writeSize));
+
+      // hashed while the block is still in cache
+      if (ctx.manifest)
+        hash.update(dataBlock.data(), writeSize);
 
-  std::size_t writtenSize = 0;
-  for (BlockRef dataBlock : indirectBlock.blocks()) {
-    const std::size_t writeSize =
-        std::min(dataBlock.size(), fileSize - writtenSize);
-    // const std::size_t writeSize = dataBlock.size();
+      if (dedup && writeSize > 0) {
+        if (dedupIndex < 0) {
+          dedupIndex = static_cast<long>(ctx.dedupFiles.size());
+          ctx.dedupFiles.push_back(output.pathOf(name));
+        }
 
-    LOG("Extracting block %p of size %zu, writing effective length %zu...\n",
-        dataBlock.data(), dataBlock.size(), writeSize);
-    ASSERT0(std::fwrite(dataBlock.data(), writeSize, 1, fp) == 1);
+        ctx.writtenBlocks.emplace(
+            key, BlockLocation{static_cast<u32>(dedupIndex),
+                               static_cast<u32>(writeSize), writtenSize});
+      }
+
+      writtenSize += writeSize;
+    }
+  } catch (...) {
+    output.endFile();
+    throw;
+  }
 
-    writtenSize += writeSize;
+  if (!output.endFile()) {
+    LOG("Failed to finish writing the output file!\n");
+    return false;
   }
 
+  if (ctx.manifest) {
+    u8 digest[32];
+    hash.finish(OUT digest);
+
+    const std::string hex = toHex(digest, sizeof(digest));
+    writeManifestLine(ctx.manifest, hex, output.pathOf(name));
+
+    if (znode.links > 1)
+      ctx.linkDigests.emplace(&dnode, hex);
+  }
+
+  if (znode.links > 1)
+    ctx.linkTargets.emplace(&dnode, output.pathOf(name));
+
   LOG("Extraction complete!\n");
   return true;
 }
 
-std::size_t
-extractDirContents(ZPoolReader &                      reader,
-                   IndirectObjBlock<physical::DNode> &dslBlock,
-                   const physical::DNode &dnode, const std::string &outDir,
-                   std::set<const physical::DNode *> &extractedNodes) {
+// Extracts a batch of entries of the current output directory, see
+// forEachDirEntryBatch().
+static std::size_t extractDirEntries(ExtractionContext &          ctx,
+                                     const std::vector<ZapEntry> &entries) {
+  IndirectObjBlock<physical::DNode> &dslBlock = ctx.dslBlock;
+
+  std::size_t nfiles = 0;
+  for (const ZapEntry &entry : entries) {
+    if (flag_isset(entry.value, DirEntryFlags::Dir)) {
+      const u64 nodeID = entry.value - static_cast<u64>(DirEntryFlags::Dir);
+      const physical::DNode &dirNode = dslBlock.objectByID(nodeID);
+
+      try {
+        nfiles += extractDirContents(ctx, dirNode, entry.name);
+
+        ctx.extractedNodes.insert(&dirNode);
+      } catch (const std::exception &ex) {
+        LOG("Error: cannot extract directory contents of %s: %s\n",
+            entry.name.c_str(), ex.what());
+      }
+    } else if (flag_isset(entry.value, DirEntryFlags::File)) {
+      const u64 nodeID = entry.value - static_cast<u64>(DirEntryFlags::File);
+      const physical::DNode &fileNode = dslBlock.objectByID(nodeID);
+
+      if (extractFileContents(ctx, nodeID, fileNode, entry.name)) {
+        ctx.extractedNodes.insert(&fileNode);
+        nfiles++;
+      }
+    } else {
+      LOG("Unrecognised flag in directory ZAP entry, ignoring: %s = 0x%lx\n",
+          entry.name.c_str(), entry.value);
+    }
+  }
+
+  return nfiles;
+}
+
+std::size_t extractDirContents(ExtractionContext &    ctx,
+                               const physical::DNode &dnode,
+                               const std::string &    name) {
   ASSERT0(dnode.type == DNodeType::DirContents);
 
-  LOG("Extracting directory to '%s'...\n", outDir.c_str());
+  ZPoolReader &reader = ctx.reader;
+  Output &     output = ctx.output;
+
+  LOG("Extracting directory '%s'...\n", name.c_str());
   dnode.dump(stderr);
 
-  const int mkresult = mkdir(outDir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
-  if (mkresult != 0 && mkresult != EEXIST) {
-    LOG("Failed to create directory, error code: %d\n", mkresult);
+  if (!output.enterDirectory(name, ctx.sa.znode(dnode)))
     return 0;
+
+  std::size_t nfiles = 0;
+  bool        readable;
+  try {
+    readable = forEachDirEntryBatch(
+        reader, ctx.dslBlock, dnode,
+        [&ctx, &nfiles](const std::vector<ZapEntry> &entries) {
+          nfiles += extractDirEntries(ctx, entries);
+        });
+  } catch (...) {
+    output.leaveDirectory();
+    throw;
   }
 
-  auto dirZap = reader.read<MZapBlockPtr>(dnode.bps[0], /*dva=*/0);
-  if (!dirZap) {
+  output.leaveDirectory();
+
+  if (!readable) {
     LOG("Failed to read the ZAP block belonging to the DirContents DNode, "
         "skipping!\n");
     return 0;
   }
 
-  std::size_t nfiles = 0;
-  for (const physical::MZapEntry &entry : dirZap.entries()) {
-    if (!entry.isValid())
+  ctx.extractedNodes.insert(&dnode);
+  return nfiles;
+}
+
+// Collects the object IDs of the directories and files in the given dnode
+// array block that have not been extracted. Only the type byte of a free slot
+// is looked at.
+static void findDanglingObjects(const ExtractionContext &ctx,
+                                ArrayBlockRef<physical::DNode> &dnodes,
+                                u64                             firstObjID,
+                                OUT std::vector<u64> *          objids) {
+  for (std::size_t i = 0; i < dnodes.numObjects(); i++) {
+    const physical::DNode &dnode = dnodes[i];
+    if (dnode.type != DNodeType::DirContents &&
+        dnode.type != DNodeType::FileContents)
       continue;
 
-    std::string entryPath = outDir + "/" + entry.name;
+    if (dnode.isValid() && !ctx.extractedNodes.count(&dnode))
+      objids->push_back(firstObjID + i);
+  }
+}
 
-    if (flag_isset(entry.value, DirEntryFlags::Dir)) {
-      const u64 nodeID = entry.value - static_cast<u64>(DirEntryFlags::Dir);
-      const physical::DNode &dirNode = dslBlock.objectByID(nodeID);
+std::size_t extractDanglingObjects(ExtractionContext &ctx) {
+  IndirectObjBlock<physical::DNode> &dslBlock = ctx.dslBlock;
+
+  // Resolve every block pointer up front: after that, reading distinct blocks
+  // only touches distinct leaves of the block tree, so the threads below can
+  // do it concurrently.
+  std::vector<u64> blockids;
+  for (u64 blockid = 0; blockid < dslBlock.numDataBlocks(); blockid++) {
+    try {
+      const physical::Blkptr *bp = dslBlock.blkptrByID(blockid);
+      if (bp && bp->isValid())
+        blockids.push_back(blockid);
+    } catch (const std::exception &ex) {
+      LOG("Cannot resolve dnode block %lu, skipping: %s\n", blockid,
+          ex.what());
+    }
+  }
+
+  const std::size_t numChunks =
+      (blockids.size() + SWEEP_CHUNK_BLOCKS - 1) / SWEEP_CHUNK_BLOCKS;
+  const std::size_t numThreads = std::max<std::size_t>(
+      1, std::min<std::size_t>(std::thread::hardware_concurrency(), numChunks));
+
+  const std::size_t        objsPerBlock = dslBlock.numObjectsPerBlock();
+  std::atomic<std::size_t> nextChunk{0};
+  std::vector<std::vector<u64>> found(numThreads);
+
+  const auto worker = [&](std::size_t threadIndex) {
+    for (std::size_t chunk; (chunk = nextChunk++) < numChunks;) {
+      const std::size_t end =
+          std::min(blockids.size(), (chunk + 1) * SWEEP_CHUNK_BLOCKS);
+
+      for (std::size_t i = chunk * SWEEP_CHUNK_BLOCKS; i < end; i++) {
+        try {
+          ArrayBlockRef<physical::DNode> dnodes =
+              dslBlock.blockByID(blockids[i]);
+          findDanglingObjects(ctx, dnodes, blockids[i] * objsPerBlock,
+                              OUT & found[threadIndex]);
+        } catch (const std::exception &ex) {
+          LOG("Cannot read dnode block %lu, skipping: %s\n", blockids[i],
+              ex.what());
+        }
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (std::size_t t = 1; t < numThreads; t++)
+    threads.emplace_back(worker, t);
+
+  worker(0);
+
+  for (std::thread &thread : threads)
+    thread.join();
+
+  std::vector<u64> objids;
+  for (const std::vector<u64> &threadFound : found)
+    objids.insert(objids.end(), threadFound.begin(), threadFound.end());
+
+  std::sort(objids.begin(), objids.end());
+  LOG("Found %zu unreferenced objects\n", objids.size());
 
+  std::size_t nfiles = 0;
+  for (u64 objid : objids) {
+    const physical::DNode &dnode = dslBlock.objectByID(objid);
+
+    // may have been extracted as part of a dangling directory since
+    if (ctx.extractedNodes.count(&dnode))
+      continue;
+
+    if (dnode.type == DNodeType::DirContents) {
+      try {
+        nfiles += extractDirContents(ctx, dnode, "extracted_dangling_dir" +
+                                                     std::to_string(objid));
+      } catch (const std::exception &ex) {
+        LOG("Failed to extract dangling directory (node ID %lu): %s\n", objid,
+            ex.what());
+      }
+    } else {
       try {
-        nfiles += extractDirContents(reader, dslBlock, dirNode, entryPath,
-                                     extractedNodes);
+        if (extractFileContents(ctx, objid, dnode,
+                                "extracted_dangling_file" +
+                                    std::to_string(objid)))
+          nfiles++;
 
-        extractedNodes.insert(&dirNode);
+        ctx.extractedNodes.insert(&dnode);
       } catch (const std::exception &ex) {
-        LOG("Error: cannot extract directory contents of %s: %s\n",
-            entryPath.c_str(), ex.what());
+        LOG("Failed to extract dangling file (node ID %lu): %s\n", objid,
+            ex.what());
       }
-    } else if (flag_isset(entry.value, DirEntryFlags::File)) {
-      const u64 nodeID = entry.value - static_cast<u64>(DirEntryFlags::File);
-      const physical::DNode &fileNode = dslBlock.objectByID(nodeID);
+    }
+  }
 
-      if (extractFileContents(reader, fileNode, entryPath)) {
-        extractedNodes.insert(&fileNode);
-        nfiles++;
+  return nfiles;
+}
+
+namespace {
+
+// A directory entry matched by extractPaths().
+struct SelectedPath {
+  std::vector<std::string> names;  // path components, relative to the root
+  std::vector<u64>         objids; // the root, then one for each component
+};
+
+} // end anonymous namespace
+
+static std::vector<std::string> splitPath(const std::string &path) {
+  std::vector<std::string> components;
+
+  std::size_t start = 0;
+  while (start <= path.size()) {
+    std::size_t end = path.find('/', start);
+    if (end == std::string::npos)
+      end = path.size();
+
+    std::string component = path.substr(start, end - start);
+    if (!component.empty() && component != ".")
+      components.push_back(std::move(component));
+
+    start = end + 1;
+  }
+
+  return components;
+}
+
+static bool isGlobPattern(const std::string &component) {
+  return component.find_first_of("*?[") != std::string::npos;
+}
+
+static void resolvePath(ExtractionContext &             ctx,
+                        const std::vector<std::string> &components,
+                        INOUT SelectedPath *current,
+                        OUT std::vector<SelectedPath> *matches) {
+  const std::size_t depth = current->names.size();
+  if (depth == components.size()) {
+    matches->push_back(*current);
+    return;
+  }
+
+  const u64              dirObjID = current->objids.back();
+  const physical::DNode &dir      = ctx.dslBlock.objectByID(dirObjID);
+  if (dir.type != DNodeType::DirContents)
+    return;
+
+  const std::string &component = components[depth];
+
+  std::vector<ZapEntry> entries;
+  if (isGlobPattern(component)) {
+    ZapObject dirZap{ctx.reader, dir};
+    for (const ZapEntry &entry : dirZap) {
+      if (::fnmatch(component.c_str(), entry.name.c_str(), FNM_PERIOD) == 0)
+        entries.push_back(entry);
+    }
+  } else {
+    u64 value;
+    if (ctx.zapCache.findEntry(ctx.reader, dirObjID, dir, component,
+                               OUT & value))
+      entries.push_back(ZapEntry{component, value, 0, {}});
+  }
+
+  for (const ZapEntry &entry : entries) {
+    current->names.push_back(entry.name);
+    current->objids.push_back(ZFS_DIRENT_OBJ(entry.value));
+
+    resolvePath(ctx, components, INOUT current, OUT matches);
+
+    current->names.pop_back();
+    current->objids.pop_back();
+  }
+}
+
+// Extracts a single selected object into the current output directory.
+static std::size_t extractSelected(ExtractionContext &ctx,
+                                   const SelectedPath &path) {
+  const physical::DNode &dnode = ctx.dslBlock.objectByID(path.objids.back());
+  const std::string &    name  = path.names.back();
+
+  try {
+    if (dnode.type == DNodeType::DirContents) {
+      const std::size_t nfiles = extractDirContents(ctx, dnode, name);
+      ctx.extractedNodes.insert(&dnode);
+      return nfiles;
+    }
+
+    if (dnode.type == DNodeType::FileContents) {
+      if (!extractFileContents(ctx, path.objids.back(), dnode, name))
+        return 0;
+
+      ctx.extractedNodes.insert(&dnode);
+      return 1;
+    }
+
+    LOG("Unsupported object type for %s, skipping!\n", name.c_str());
+  } catch (const std::exception &ex) {
+    LOG("Error: cannot extract %s: %s\n", name.c_str(), ex.what());
+  }
+
+  return 0;
+}
+
+std::size_t extractPaths(ExtractionContext &ctx, u64 rootObjID,
+                         const std::vector<std::string> &paths,
+                         const std::string &             name) {
+  std::vector<SelectedPath> matches;
+  for (const std::string &path : paths) {
+    const std::size_t numMatches = matches.size();
+
+    SelectedPath root{{}, {rootObjID}};
+    resolvePath(ctx, splitPath(path), INOUT & root, OUT & matches);
+
+    if (matches.size() == numMatches)
+      std::fprintf(stderr, "Warning: nothing matches '%s'\n", path.c_str());
+  }
+
+  const physical::DNode &rootDir = ctx.dslBlock.objectByID(rootObjID);
+
+  // selecting the root selects everything
+  for (const SelectedPath &match : matches) {
+    if (match.names.empty())
+      return extractDirContents(ctx, rootDir, name);
+  }
+
+  // in sorted order, everything below a selected directory directly follows
+  // it, and directories shared by several paths only have to be entered once
+  std::sort(matches.begin(), matches.end(),
+            [](const SelectedPath &lhs, const SelectedPath &rhs) {
+              return lhs.names < rhs.names;
+            });
+
+  if (matches.empty() ||
+      !ctx.output.enterDirectory(name, ctx.sa.znode(rootDir)))
+    return 0;
+
+  std::vector<std::string> entered; // directories entered below the root
+  std::size_t              nfiles   = 0;
+  const SelectedPath *     previous = nullptr;
+
+  try {
+    for (const SelectedPath &match : matches) {
+      if (previous && previous->names.size() <= match.names.size() &&
+          std::equal(previous->names.begin(), previous->names.end(),
+                     match.names.begin()))
+        continue; // the same, or already extracted as part of previous
+
+      previous = &match;
+
+      // leave what is not on the way, enter what is missing
+      const std::size_t numParents = match.names.size() - 1;
+      std::size_t       common     = 0;
+      while (common < entered.size() && common < numParents &&
+             entered[common] == match.names[common])
+        common++;
+
+      while (entered.size() > common) {
+        ctx.output.leaveDirectory();
+        entered.pop_back();
       }
-    } else {
-      LOG("Unrecognised flag in directory ZAP entry, ignoring: ");
-      entry.dump(stderr);
+
+      while (entered.size() < numParents) {
+        const std::size_t      i = entered.size();
+        const physical::DNode &dir =
+            ctx.dslBlock.objectByID(match.objids[i + 1]);
+
+        if (!ctx.output.enterDirectory(match.names[i], ctx.sa.znode(dir)))
+          break;
+
+        entered.push_back(match.names[i]);
+      }
+
+      if (entered.size() == numParents)
+        nfiles += extractSelected(ctx, match);
     }
+  } catch (...) {
+    for (std::size_t i = 0; i <= entered.size(); i++)
+      ctx.output.leaveDirectory();
+
+    throw;
   }
 
-  extractedNodes.insert(&dnode);
+  for (std::size_t i = 0; i <= entered.size(); i++)
+    ctx.output.leaveDirectory();
+
   return nfiles;
 }
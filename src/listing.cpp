@@ -0,0 +1,153 @@
+#include <cinttypes>
+#include <sys/stat.h>
+#include <vector>
+
+#include "zfs/physical/znode.h"
+#include "zfs/zap.h"
+
+#include "utils/common.h"
+#include "utils/log.h"
+
+#include "listing.h"
+
+using namespace zfs;
+
+static const char *objectType(const physical::DNode &dnode, u64 mode) {
+  if (dnode.type == DNodeType::DirContents)
+    return "dir";
+
+  if (dnode.type != DNodeType::FileContents)
+    return "other";
+
+  switch (mode & S_IFMT) {
+  case 0: // no mode, assume a regular file like extraction does
+  case S_IFREG:
+    return "file";
+  case S_IFLNK:
+    return "symlink";
+  default:
+    return "special";
+  }
+}
+
+void appendPath(ListingFormat format, const std::string &path,
+                INOUT std::string *line) {
+  for (const char c : path) {
+    switch (c) {
+    case '\\':
+      *line += "\\\\";
+      break;
+    case '\t':
+      *line += "\\t";
+      break;
+    case '\n':
+      *line += "\\n";
+      break;
+    case '"':
+      *line += format == ListingFormat::NdJson ? "\\\"" : "\"";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        *line += escaped;
+      } else {
+        *line += c;
+      }
+    }
+  }
+}
+
+static void listObject(ListingContext &ctx, u64 objid,
+                       const physical::DNode &dnode, const std::string &path) {
+  const physical::ZNode znode = ctx.sa.znode(dnode);
+
+  const u64 nblocks = dnode.bps[0].isValid() ? dnode.max_block_id + 1 : 0;
+
+  // the root is listed with an empty path, its children as "/name"
+  const std::string &shownPath = path.empty() ? std::string{"/"} : path;
+
+  std::string line;
+  char        fields[256];
+
+  if (ctx.format == ListingFormat::NdJson) {
+    line = "{\"path\":\"";
+    appendPath(ctx.format, shownPath, INOUT & line);
+    std::snprintf(fields, sizeof(fields),
+                  "\",\"objid\":%" PRIu64 ",\"type\":\"%s\",\"size\":%" PRIu64
+                  ",\"mode\":\"%04" PRIo64 "\",\"uid\":%" PRIu64
+                  ",\"gid\":%" PRIu64 ",\"mtime\":%" PRIu64
+                  ",\"nblocks\":%" PRIu64 "}\n",
+                  objid, objectType(dnode, znode.mode), znode.size,
+                  znode.mode & 07777, znode.uid, znode.gid,
+                  znode.mtime.seconds, nblocks);
+  } else {
+    appendPath(ctx.format, shownPath, INOUT & line);
+    std::snprintf(fields, sizeof(fields),
+                  "\t%" PRIu64 "\t%s\t%" PRIu64 "\t%04" PRIo64 "\t%" PRIu64
+                  "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n",
+                  objid, objectType(dnode, znode.mode), znode.size,
+                  znode.mode & 07777, znode.uid, znode.gid,
+                  znode.mtime.seconds, nblocks);
+  }
+
+  line += fields;
+  std::fwrite(line.data(), 1, line.size(), ctx.out);
+}
+
+// Lists a batch of entries of the directory PATH, see forEachDirEntryBatch().
+static std::size_t listDirEntries(ListingContext &ctx, const std::string &path,
+                                  const std::vector<ZapEntry> &entries) {
+  std::size_t nobjects = 0;
+  for (const ZapEntry &entry : entries) {
+    const u64         childID   = ZFS_DIRENT_OBJ(entry.value);
+    const std::string childPath = path + "/" + entry.name;
+
+    try {
+      const physical::DNode &child = ctx.dslBlock.objectByID(childID);
+
+      if (child.type == DNodeType::DirContents) {
+        nobjects += listDirContents(ctx, childID, childPath);
+      } else {
+        listObject(ctx, childID, child, childPath);
+        nobjects++;
+      }
+    } catch (const std::exception &ex) {
+      LOG("Error: cannot list %s: %s\n", childPath.c_str(), ex.what());
+    }
+  }
+
+  return nobjects;
+}
+
+void listingHeader(ListingContext &ctx) {
+  if (ctx.format == ListingFormat::Tsv)
+    std::fputs("path\tobjid\ttype\tsize\tmode\tuid\tgid\tmtime\tnblocks\n",
+               ctx.out);
+}
+
+std::size_t listDirContents(ListingContext &ctx, u64 objid,
+                            const std::string &path) {
+  const physical::DNode &dnode = ctx.dslBlock.objectByID(objid);
+  if (dnode.type != DNodeType::DirContents) {
+    LOG("Object %lu is not a directory, cannot list it!\n", objid);
+    return 0;
+  }
+
+  listObject(ctx, objid, dnode, path);
+  std::size_t nobjects = 1;
+
+  if (!ctx.listedDirs.insert(objid).second) {
+    LOG("Directory %lu has been listed already, skipping!\n", objid);
+    return nobjects;
+  }
+
+  if (!forEachDirEntryBatch(
+          ctx.reader, ctx.dslBlock, dnode,
+          [&ctx, &path, &nobjects](const std::vector<ZapEntry> &entries) {
+            nobjects += listDirEntries(ctx, path, entries);
+          }))
+    LOG("Failed to read the ZAP of directory %lu, skipping!\n", objid);
+
+  return nobjects;
+}
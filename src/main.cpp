@@ -1,6 +1,10 @@
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <memory>
 #include <set>
+#include <string>
+#include <thread>
 #include <vector>
 
 #include "utils/array_view.h"
@@ -8,34 +12,56 @@
 #include "utils/file.h"
 #include "utils/log.h"
 
+#include "output/fs_output.h"
+#include "output/tar_output.h"
+
+#include "zfs/carve.h"
+#include "zfs/checksum.h"
+#include "zfs/compression.h"
 #include "zfs/indirect_block.h"
 #include "zfs/physical.h"
+#include "zfs/scrub.h"
+#include "zfs/space_map.h"
+#include "zfs/uberblock_probe.h"
+#include "zfs/zap.h"
 #include "zfs/zpool_reader.h"
 
 #include "extraction.h"
+#include "listing.h"
+#include "search.h"
 
 using namespace zfs;
 
+enum class Mode { None, ListUberblocks, Extract, List, Verify, Grep, Carve };
+
+// What --carve scans.
+enum class CarveSpace { All, Free, Allocated };
+
+struct Options {
+  Mode                     mode         = Mode::None;
+  long                     ubIndex      = -1;
+  bool                     autoUb       = false; // probe for a usable one
+  const char *             tarPath      = nullptr;
+  bool                     dedupBlocks  = false;
+  const char *             manifestPath = nullptr;
+  std::FILE *              manifest     = nullptr; // opened from manifestPath
+  u64                      sinceTxg     = 0;       // for --incremental
+  std::vector<std::string> paths;    // only extract these, if any
+  std::vector<std::string> patterns; // for --grep
+  ListingFormat            listFormat = ListingFormat::Tsv;
+  CarveSpace               carveSpace = CarveSpace::All;
+  WriterConfig             writer;
+};
+
 static bool getRootDataset(ZPoolReader &reader, const physical::DNode &objDir,
                            OUT u64 *rootIndex) {
-  for (std::size_t bp_index = 0; bp_index < objDir.nblkptr; bp_index++) {
-    MZapBlockPtr zap;
-    for (std::size_t dva = 0; dva < 3 && !zap; dva++) {
-      zap = reader.read(objDir.bps[bp_index], dva).cast<MZapBlockPtr>();
-    }
-
-    if (!zap)
-      continue;
-
-    zap.dump(stderr);
+  ZapObject zap{reader, objDir};
+  if (!zap.isValid())
+    return false;
 
-    if (const physical::MZapEntry *entry = zap.findEntry("root_dataset")) {
-      OUT *rootIndex = entry->value;
-      return true;
-    }
-  }
+  zap.dump(stderr);
 
-  return false;
+  return zap.findEntry("root_dataset", OUT rootIndex);
 }
 
 static physical::DNode *getRootDataset(ZPoolReader &reader,
@@ -57,8 +83,55 @@ static physical::DNode *getRootDataset(ZPoolReader &reader,
   return nullptr;
 }
 
+static bool listDataset(ZPoolReader &                      reader,
+                        IndirectObjBlock<physical::DNode> &dslBlock,
+                        const Options &                    opts) {
+  ZapObject masterZap{reader, dslBlock.objectByID(1)};
+
+  u64 rootDirObjID;
+  if (!masterZap.findEntry("ROOT", OUT & rootDirObjID)) {
+    LOG("Could not find the ZAP entry for the filesystem root!\n");
+    return false;
+  }
+
+  // the listing can get large, keep the number of writes down
+  static char buffer[4 * MB];
+  std::setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+  ListingContext ctx{reader, dslBlock, stdout, opts.listFormat};
+  ctx.sa.load(reader, dslBlock, dslBlock.objectByID(1));
+  listingHeader(ctx);
+  const std::size_t nobjects = listDirContents(ctx, rootDirObjID, "");
+  std::fflush(stdout);
+
+  LOG("Listed %zu objects\n", nobjects);
+  return true;
+}
+
+static bool searchDataset(ZPoolReader &                      reader,
+                          IndirectObjBlock<physical::DNode> &dslBlock,
+                          const Options &                    opts) {
+  ZapObject masterZap{reader, dslBlock.objectByID(1)};
+
+  u64 rootDirObjID;
+  if (!masterZap.findEntry("ROOT", OUT & rootDirObjID)) {
+    LOG("Could not find the ZAP entry for the filesystem root!\n");
+    return false;
+  }
+
+  SearchContext ctx{reader, dslBlock, stdout, opts.patterns};
+  ctx.sa.load(reader, dslBlock, dslBlock.objectByID(1));
+  const std::size_t nmatches = searchDirContents(
+      ctx, rootDirObjID, std::thread::hardware_concurrency());
+  std::fflush(stdout);
+
+  LOG("Found %zu matches\n", nmatches);
+  return true;
+}
+
 static bool handleMOS(ZPoolReader &                      reader,
-                      IndirectObjBlock<physical::DNode> &mos) {
+                      IndirectObjBlock<physical::DNode> &mos, Output *output,
+                      const Options &opts) {
   physical::DNode *rootDatasetNode = getRootDataset(reader, mos);
   if (!rootDatasetNode) {
     LOG("Could not find the root dataset entry in an object directory!\n");
@@ -71,8 +144,14 @@ static bool handleMOS(ZPoolReader &                      reader,
       mos.objectByID(rootDataset.head_dataset_obj);
   auto &headDataset = headDatasetNode.getBonusAs<physical::DSLDataSet>();
 
+  // a damaged copy is as good as none, the ditto copies may be fine
   auto dslObjSet =
-      reader.read<ObjBlockPtr<physical::ObjSet>>(headDataset.bp, /*dva=*/0);
+      reader.readAnyCopy(headDataset.bp).cast<ObjBlockPtr<physical::ObjSet>>();
+  if (!dslObjSet) {
+    LOG("Could not read the objset of the head dataset!\n");
+    return false;
+  }
+
   dslObjSet->dump(stderr);
 
   // the master node always has the object id = 1
@@ -88,76 +167,70 @@ static bool handleMOS(ZPoolReader &                      reader,
 
   return true;*/
 
+  if (opts.mode == Mode::List)
+    return listDataset(reader, dslBlock, opts);
+
+  if (opts.mode == Mode::Grep)
+    return searchDataset(reader, dslBlock, opts);
+
   const physical::DNode &masterNode = dslBlock.objectByID(1);
   masterNode.dump(stderr);
 
-  auto masterZap = reader.read<MZapBlockPtr>(masterNode.bps[0], /*dva=*/0);
-  ASSERT0(masterZap && masterZap->isValid());
-
-  masterZap.dump(stderr);
+  ExtractionContext ctx{reader, dslBlock, *output};
+  ctx.dedupBlocks = opts.dedupBlocks;
+  ctx.manifest    = opts.manifest;
+  ctx.sinceTxg    = opts.sinceTxg;
+  ctx.sa.load(reader, dslBlock, masterNode);
 
-  const physical::MZapEntry *rootEntry = masterZap.findEntry("ROOT");
-  if (!rootEntry) {
-    LOG("Could not find the MZapEntry for the filesystem root!\n");
+  u64 rootDirObjID;
+  if (!ctx.zapCache.findEntry(reader, 1, masterNode, "ROOT",
+                              OUT & rootDirObjID)) {
+    LOG("Could not find the ZAP entry for the filesystem root!\n");
     return false;
   }
 
-  const u64 rootDirObjID = rootEntry->value;
-  LOG("Extracting filesystem root (objid = %lu)...\n", rootDirObjID);
+  if (!opts.paths.empty()) {
+    // no dangling object sweep here, that would touch the whole dataset
+    const std::size_t nfiles =
+        extractPaths(ctx, rootDirObjID, opts.paths, "extracted");
+    LOG("Finished extracting %zu files!\n", nfiles);
+    return true;
+  }
 
-  std::set<const physical::DNode *> extractedNodes;
-  std::size_t                       nfiles = 0;
+  LOG("Extracting filesystem root (objid = %lu)...\n", rootDirObjID);
+  std::size_t       nfiles = 0;
 
   try {
-    nfiles =
-        extractDirContents(reader, dslBlock, dslBlock.objectByID(rootDirObjID),
-                           "extracted", extractedNodes);
+    nfiles = extractDirContents(ctx, dslBlock.objectByID(rootDirObjID),
+                                "extracted");
     LOG("Finished extracting %zu files!\n", nfiles);
+    if (ctx.sinceTxg != 0)
+      LOG("%zu of them were unchanged, %lu blocks were patched\n",
+          ctx.unchangedFiles, ctx.patchedBlocks);
   } catch (const std::exception &ex) {
     LOG("Could not extract the root directory: %s\n", ex.what());
   }
 
   LOG("Looking for an extracting unreferenced files and directories...\n");
-  int counter = -1;
-  for (const physical::DNode &dnode : dslBlock.objects()) {
-    counter++;
-    if (!dnode.isValid() || extractedNodes.count(&dnode))
-      continue;
-
-    if (dnode.type == DNodeType::DirContents) {
-      try {
-        extractDirContents(reader, dslBlock, dnode,
-                           "extracted_dangling_dir" + std::to_string(counter),
-                           extractedNodes);
-      } catch (const std::exception &ex) {
-        LOG("Failed to extract dangling directory (node ID) %d: %s\n", counter,
-            ex.what());
-      }
-    } else if (dnode.type == DNodeType::FileContents) {
-      try {
-        extractFileContents(reader, dnode, "extracted_dangling_file" +
-                                               std::to_string(counter));
-        extractedNodes.insert(&dnode);
-      } catch (const std::exception &ex) {
-        LOG("Failed to extract dangling file (node ID %d): %s\n", counter,
-            ex.what());
-      }
-    }
-  }
+  nfiles = extractDanglingObjects(ctx);
+  LOG("Extracted %zu unreferenced files!\n", nfiles);
 
   LOG("All done!\n");
   return true;
 }
 
-static void handle_ub(ZPoolReader &reader, const physical::Uberblock &ub) {
+// OUTPUT may only be null when listing or searching.
+static void handle_ub(ZPoolReader &reader, const physical::Uberblock &ub,
+                      Output *output, const Options &opts) {
   ub.dump(stderr);
   std::fprintf(stderr, "\n");
 
   ASSERT(ub.rootbp.type == DNodeType::ObjSet,
          "rootbp does not seem to point to an object!");
 
-  ObjBlockPtr<physical::ObjSet> objset;
-  if (!reader.read(ub.rootbp, /*dva=*/0, OUT & objset)) {
+  auto objset =
+      reader.readAnyCopy(ub.rootbp).cast<ObjBlockPtr<physical::ObjSet>>();
+  if (!objset) {
     LOG("Uberblock rootbp: could not read root objset!\n");
     return;
   }
@@ -165,69 +238,568 @@ static void handle_ub(ZPoolReader &reader, const physical::Uberblock &ub) {
   objset->dump(stderr);
 
   IndirectObjBlock<physical::DNode> objsetBlock{reader, objset->metadnode};
-  handleMOS(reader, objsetBlock);
+  if (handleMOS(reader, objsetBlock, output, opts) && output &&
+      !opts.tarPath)
+    std::fprintf(stderr, "Extracted as of txg %lu, use --incremental %lu to "
+                         "update the extraction later\n",
+                 ub.txg, ub.txg);
 }
 
-static void list_ubs(ZPoolReader &                           reader,
-                     const std::vector<physical::Uberblock> &ubs,
-                     ssize_t                                 maxTxgIndex) {
-  std::size_t i = 0;
-  for (const physical::Uberblock &ub : ubs) {
-    if (i == maxTxgIndex) {
+// Carves the free or the allocated space of the pool, as the space maps of the
+// MOS of UB tell.
+static int carveSpace(ZPoolReader &reader, const physical::Uberblock &ub,
+                      const Options &opts) {
+  auto objset =
+      reader.readAnyCopy(ub.rootbp).cast<ObjBlockPtr<physical::ObjSet>>();
+  if (!objset) {
+    std::fprintf(stderr, "Could not read the root objset!\n");
+    return 1;
+  }
+
+  IndirectObjBlock<physical::DNode> mos{reader, objset->metadnode};
+
+  SpaceMaps maps;
+  if (!loadSpaceMaps(reader, mos, OUT & maps)) {
+    std::fprintf(stderr, "Could not load the space maps!\n");
+    return 1;
+  }
+
+  const std::vector<Extent> extents = opts.carveSpace == CarveSpace::Free
+                                          ? maps.freeExtents()
+                                          : maps.allocatedExtents();
+  std::fprintf(stderr, "%lu metaslabs, %.1f MB allocated, %zu extents to "
+                       "scan\n",
+               maps.metaslabs,
+               static_cast<double>(maps.allocated.bytes()) / MB,
+               extents.size());
+
+  static char buffer[4 * MB];
+  std::setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+  const CarveResult result = carveImage(
+      reader, stdout, std::thread::hardware_concurrency(), &extents);
+  std::fflush(stdout);
+  printCarveReport(stderr, result);
+  return 0;
+}
+
+// UBS is sorted the newest first, so the first one is the active uberblock.
+static void list_ubs(const std::vector<UberblockEntry> &ubs) {
+  for (const UberblockEntry &entry : ubs) {
+    if (&entry == &ubs.front()) {
       std::fprintf(stderr, "[ACTIVE] ");
     }
 
-    std::fprintf(stderr, "Uberblock[%zu]: ", i);
-    ub.dump(stderr);
-    i++;
+    std::fprintf(stderr, "L%u Uberblock[%u]: ", entry.label, entry.index);
+    entry.ub.dump(stderr);
+  }
+
+  std::fprintf(stderr, "Active Uberblock at index %u (label L%u)\n",
+               ubs.front().index, ubs.front().label);
+}
+
+// The uberblock at the given index of the ring, taken from whichever label has
+// the newest valid one there, or the active uberblock if UBINDEX < 0.
+static const UberblockEntry *
+selectUberblock(const std::vector<UberblockEntry> &ubs, long ubIndex) {
+  if (ubIndex < 0)
+    return &ubs.front();
+
+  for (const UberblockEntry &entry : ubs) {
+    if (static_cast<long>(entry.index) == ubIndex)
+      return &entry;
+  }
+
+  return nullptr;
+}
+
+// Throughput of FN, called on blocks of BLOCK_SIZE bytes until about TOTAL
+// bytes have been processed, in GB/s.
+template <typename TFn>
+static double measureThroughput(std::size_t blockSize, TFn fn,
+                                std::size_t total = GB) {
+  const std::size_t iterations = std::max<std::size_t>(1, total / blockSize);
+
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; i++)
+    fn();
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return static_cast<double>(iterations * blockSize) / GB / elapsed.count();
+}
+
+// Compares the checksum implementations the CPU supports on 128K blocks, the
+// default record size.
+static void benchChecksums() {
+  const std::size_t blockSize = KB * 128;
+
+  std::vector<std::unique_ptr<u8[]>> blocks;
+  const void *                       data[8];
+  for (unsigned i = 0; i < 8; i++) {
+    blocks.emplace_back(new u8[blockSize]);
+    for (std::size_t j = 0; j < blockSize; j++)
+      blocks[i][j] = static_cast<u8>(j * 31 + i);
+
+    data[i] = blocks[i].get();
+  }
+
+  // volatile, so that the calls cannot be optimised away
+  volatile u64 sink = 0;
+
+  for (const Fletcher4Impl &impl : fletcher4Implementations()) {
+    const double gbps = measureThroughput(blockSize, [&] {
+      u64 cksum[4];
+      impl.fn(data[0], blockSize, OUT cksum);
+      sink = sink + cksum[3];
+    });
+
+    std::printf("fletcher4 %-10s %6.2f GB/s\n", impl.name, gbps);
+  }
+
+  for (const Sha256Impl &impl : sha256Implementations()) {
+    const double gbps = measureThroughput(blockSize, [&] {
+      u8 digest[32];
+      impl.fn(data[0], blockSize, OUT digest);
+      sink = sink + digest[0];
+    });
+
+    std::printf("sha256    %-10s %6.2f GB/s\n", impl.name, gbps);
+  }
+
+  if (haveSha256x8()) {
+    const double gbps = measureThroughput(8 * blockSize, [&] {
+      u8 digests[8][32];
+      sha256x8AVX2(data, blockSize, OUT digests);
+      sink = sink + digests[7][0];
+    });
+
+    std::printf("sha256    %-10s %6.2f GB/s\n", "avx2-x8", gbps);
+  }
+}
+
+// Fills SIZE bytes of DATA with something that compresses like typical file
+// contents: text made of a small vocabulary, with the odd run of zeros.
+static void fillBenchData(OUT u8 *data, std::size_t size) {
+  static const char *const words[] = {
+      "the ",   "zpool ",  "block ",    "of ",     "dataset ", "0x1f2e ",
+      "error ", "\n",      "indirect ", "read ",   "and ",     "object ",
+      "to ",    "2048 ",   "checksum ", "ext4 ",   "a ",       "snapshot "};
+
+  u32         state = 12345;
+  std::size_t i     = 0;
+  while (i < size) {
+    state = state * 1103515245 + 12345;
+
+    if ((state >> 16) % 64 == 0) {
+      const std::size_t n = std::min<std::size_t>(size - i, (state >> 8) % 512);
+      std::memset(data + i, 0, n);
+      i += n;
+      continue;
+    }
+
+    const char *word = words[(state >> 16) % (sizeof(words) / sizeof(*words))];
+    for (; *word && i < size; word++)
+      data[i++] = static_cast<u8>(*word);
+  }
+}
+
+// Measures the decompression throughput of every codec that is built in, on
+// blocks of the sizes that are common on disk.
+static void benchCodecs() {
+  static const std::size_t blockSizes[] = {KB * 4, KB * 16, KB * 128, MB};
+
+  for (const Codec *codec : availableCodecs()) {
+    for (const std::size_t blockSize : blockSizes) {
+      std::unique_ptr<u8[]> data{new u8[blockSize]};
+      std::unique_ptr<u8[]> compressed{new u8[2 * blockSize]};
+      std::unique_ptr<u8[]> decompressed{new u8[blockSize]};
+      fillBenchData(OUT data.get(), blockSize);
+
+      const std::size_t psize = codec->compress(
+          data.get(), blockSize, OUT compressed.get(), 2 * blockSize);
+      if (psize == 0 ||
+          !codec->decompress(compressed.get(), psize, OUT decompressed.get(),
+                             blockSize) ||
+          std::memcmp(data.get(), decompressed.get(), blockSize) != 0) {
+        std::printf("%-7s %5zuK  round trip failed\n", codec->name,
+                    blockSize / KB);
+        continue;
+      }
+
+      // volatile, so that the calls cannot be optimised away
+      volatile bool ok   = true;
+      const double  gbps = measureThroughput(
+          blockSize,
+          [&] {
+            ok = codec->decompress(compressed.get(), psize,
+                                   OUT decompressed.get(), blockSize);
+          },
+          GB / 4);
+
+      std::printf("%-7s %5zuK  ratio %5.2f  %8.1f MB/s\n", codec->name,
+                  blockSize / KB, static_cast<double>(blockSize) / psize,
+                  gbps * GB / MB);
+    }
+  }
+}
+
+static void usage(const char *argv0) {
+  std::fprintf(stderr,
+               "Usage: %s <zpool-file-path> <mode> [options]\n"
+               "Modes:\n"
+               "  --list-uberblocks         list the valid uberblocks of all "
+               "labels\n"
+               "  --extract [<ub index>]    extract the dataset into the "
+               "current directory\n"
+               "  --extract-tar <path|->    stream the dataset as a tar "
+               "archive instead\n"
+               "  --list [<ub index>]       list the objects of the dataset on "
+               "stdout, without reading any file data\n"
+               "  --verify [<ub index>]     read and checksum every block of "
+               "the pool without writing anything, and report the damaged "
+               "objects on stdout\n"
+               "  --carve [free|allocated]  scan the whole device for dnode "
+               "blocks, micro ZAPs and objsets, also inside LZ4 compressed "
+               "blocks, and write a catalog of them on stdout; does not need "
+               "any uberblocks, unless only the free or the allocated space "
+               "is scanned, as the space maps of the pool tell\n"
+               "  --grep <pattern>          print the path and offset of every "
+               "occurrence of the literal pattern in the files of the "
+               "dataset, without extracting anything; may be repeated\n"
+               "Options:\n"
+               "  --uberblock <ub index>    use the given uberblock instead of "
+               "the active one\n"
+               "  --auto-uberblock          use the newest uberblock whose "
+               "critical metadata can be read, instead of the newest one\n"
+               "  --batch-size <MB>         size of the batched output writes "
+               "(default: 8)\n"
+               "  --direct-io <MB>          write files at least this large "
+               "with O_DIRECT (default: off)\n"
+               "  --sync-interval <MB>      start background writeback every "
+               "this many bytes, 0 disables writeback and the final sync "
+               "(default: 64)\n"
+               "  --dirty-limit <MB>        maximum amount of written but not "
+               "yet written back data (default: 512)\n"
+               "  --dedup-blocks            clone repeated data blocks from "
+               "the output instead of reading them again; only blocks with "
+               "a cryptographic checksum (e.g. sha256) are recognised\n"
+               "  --manifest <path|->       write the SHA-256 digest of every "
+               "extracted file, in the format of sha256sum\n"
+               "  --incremental <txg>       update an earlier extraction as of "
+               "the given txg in the current directory: only the blocks "
+               "born since then are read, and unchanged files are left "
+               "alone\n"
+               "  --format <tsv|ndjson>     format of --list (default: tsv)\n"
+               "  --path <path>             only extract the given path, "
+               "relative to the dataset root; may contain glob patterns and "
+               "be repeated\n"
+               "\n"
+               "       %s --bench-checksums\n"
+               "Measures the throughput of the checksum implementations the "
+               "CPU supports.\n"
+               "       %s --bench-codecs\n"
+               "Measures the decompression throughput of the compression "
+               "methods, on blocks of 4K to 1M.\n",
+               argv0, argv0, argv0);
+}
+
+static bool parseUberblockIndex(const char *arg, OUT long *ubIndex) {
+  char *end;
+  *ubIndex = std::strtol(arg, &end, 10);
+  return *end == '\0' && *ubIndex >= 0 && *ubIndex < VDEV_LABEL_NUBERBLOCKS;
+}
+
+static bool parseMegabytes(const char *arg, OUT size_t *size) {
+  char *              end;
+  const unsigned long value = std::strtoul(arg, &end, 10);
+  *size                     = value * MB;
+  return *end == '\0';
+}
+
+static bool parseOptions(int argc, const char **argv, OUT Options *opts) {
+  for (int i = 2; i < argc; i++) {
+    const char *arg     = argv[i];
+    const bool  hasNext = i + 1 < argc;
+
+    if (std::strcmp(arg, "--list-uberblocks") == 0) {
+      opts->mode = Mode::ListUberblocks;
+    } else if (std::strcmp(arg, "--extract") == 0) {
+      opts->mode = Mode::Extract;
+
+      // the uberblock index is optional here for backwards compatibility
+      if (hasNext && argv[i + 1][0] != '-') {
+        if (!parseUberblockIndex(argv[++i], OUT & opts->ubIndex)) {
+          std::fprintf(stderr, "Invalid uberblock index!\n");
+          return false;
+        }
+      }
+    } else if (std::strcmp(arg, "--verify") == 0) {
+      opts->mode = Mode::Verify;
+
+      if (hasNext && argv[i + 1][0] != '-') {
+        if (!parseUberblockIndex(argv[++i], OUT & opts->ubIndex)) {
+          std::fprintf(stderr, "Invalid uberblock index!\n");
+          return false;
+        }
+      }
+    } else if (std::strcmp(arg, "--list") == 0) {
+      opts->mode = Mode::List;
+
+      if (hasNext && argv[i + 1][0] != '-') {
+        if (!parseUberblockIndex(argv[++i], OUT & opts->ubIndex)) {
+          std::fprintf(stderr, "Invalid uberblock index!\n");
+          return false;
+        }
+      }
+    } else if (std::strcmp(arg, "--carve") == 0) {
+      opts->mode = Mode::Carve;
+
+      if (hasNext && argv[i + 1][0] != '-') {
+        const char *space = argv[++i];
+        if (std::strcmp(space, "free") == 0) {
+          opts->carveSpace = CarveSpace::Free;
+        } else if (std::strcmp(space, "allocated") == 0) {
+          opts->carveSpace = CarveSpace::Allocated;
+        } else {
+          std::fprintf(stderr, "Invalid space to carve: %s\n", space);
+          return false;
+        }
+      }
+    } else if (std::strcmp(arg, "--grep") == 0 && hasNext) {
+      opts->mode = Mode::Grep;
+
+      const char *pattern = argv[++i];
+      if (pattern[0] == '\0') {
+        std::fprintf(stderr, "Empty search pattern!\n");
+        return false;
+      }
+
+      opts->patterns.push_back(pattern);
+    } else if (std::strcmp(arg, "--format") == 0 && hasNext) {
+      const char *format = argv[++i];
+      if (std::strcmp(format, "tsv") == 0) {
+        opts->listFormat = ListingFormat::Tsv;
+      } else if (std::strcmp(format, "ndjson") == 0) {
+        opts->listFormat = ListingFormat::NdJson;
+      } else {
+        std::fprintf(stderr, "Invalid listing format: %s\n", format);
+        return false;
+      }
+    } else if (std::strcmp(arg, "--extract-tar") == 0 && hasNext) {
+      opts->mode    = Mode::Extract;
+      opts->tarPath = argv[++i];
+    } else if (std::strcmp(arg, "--uberblock") == 0 && hasNext) {
+      if (!parseUberblockIndex(argv[++i], OUT & opts->ubIndex)) {
+        std::fprintf(stderr, "Invalid uberblock index!\n");
+        return false;
+      }
+    } else if (std::strcmp(arg, "--path") == 0 && hasNext) {
+      opts->paths.push_back(argv[++i]);
+    } else if (std::strcmp(arg, "--auto-uberblock") == 0) {
+      opts->autoUb = true;
+    } else if (std::strcmp(arg, "--dedup-blocks") == 0) {
+      opts->dedupBlocks = true;
+    } else if (std::strcmp(arg, "--manifest") == 0 && hasNext) {
+      opts->manifestPath = argv[++i];
+    } else if (std::strcmp(arg, "--incremental") == 0 && hasNext) {
+      char *end;
+      opts->sinceTxg = std::strtoull(argv[++i], &end, 10);
+      if (*end != '\0' || opts->sinceTxg == 0) {
+        std::fprintf(stderr, "Invalid txg!\n");
+        return false;
+      }
+    } else if (std::strcmp(arg, "--batch-size") == 0 && hasNext) {
+      if (!parseMegabytes(argv[++i], OUT & opts->writer.batchSize) ||
+          opts->writer.batchSize == 0) {
+        std::fprintf(stderr, "Invalid batch size!\n");
+        return false;
+      }
+    } else if (std::strcmp(arg, "--direct-io") == 0 && hasNext) {
+      if (!parseMegabytes(argv[++i], OUT & opts->writer.directThreshold)) {
+        std::fprintf(stderr, "Invalid direct I/O threshold!\n");
+        return false;
+      }
+    } else if (std::strcmp(arg, "--sync-interval") == 0 && hasNext) {
+      if (!parseMegabytes(argv[++i], OUT & opts->writer.syncInterval)) {
+        std::fprintf(stderr, "Invalid sync interval!\n");
+        return false;
+      }
+    } else if (std::strcmp(arg, "--dirty-limit") == 0 && hasNext) {
+      if (!parseMegabytes(argv[++i], OUT & opts->writer.dirtyBudget)) {
+        std::fprintf(stderr, "Invalid dirty limit!\n");
+        return false;
+      }
+    } else {
+      std::fprintf(stderr, "Unrecognised or incomplete option: %s\n", arg);
+      return false;
+    }
   }
 
-  std::fprintf(stderr, "Active Uberblock at index %zu\n", maxTxgIndex);
+  return true;
 }
 
 int main(int argc, const char **argv) {
-  ASSERT(argc > 1, "Usage: %s <zpool-file-path>\n", argv[0]);
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (std::strcmp(argv[1], "--bench-checksums") == 0) {
+    benchChecksums();
+    return 0;
+  }
+
+  if (std::strcmp(argv[1], "--bench-codecs") == 0) {
+    benchCodecs();
+    return 0;
+  }
+
+  Options opts;
+  if (!parseOptions(argc, argv, OUT & opts)) {
+    usage(argv[0]);
+    return 1;
+  }
 
   const char *                 path  = argv[1];
   std::unique_ptr<ZPoolReader> zpool = ZPoolReader::open(path);
   ASSERT(zpool, "Unable to open zpool file '%s'!\n", path);
 
-  std::vector<physical::Uberblock> ubs(VDEV_LABEL_NUBERBLOCKS);
-  ssize_t                          max_txg_index = -1;
-
-  for (u32 i = 0; i < VDEV_LABEL_NUBERBLOCKS; i++) {
-    physical::Uberblock &ub = ubs[i];
+  // carving is for when the uberblocks are gone
+  if (opts.mode == Mode::Carve && opts.carveSpace == CarveSpace::All) {
+    static char buffer[4 * MB];
+    std::setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
 
-    if (zpool->readUberblock(/*label_index=*/0, i, OUT & ub)) {
-      if (max_txg_index == -1 || ubs[max_txg_index].txg < ub.txg)
-        max_txg_index = i;
-    }
+    const CarveResult result =
+        carveImage(*zpool, stdout, std::thread::hardware_concurrency());
+    std::fflush(stdout);
+    printCarveReport(stderr, result);
+    return 0;
   }
 
-  if (max_txg_index == -1) {
+  const std::vector<UberblockEntry> ubs = zpool->scanUberblocks();
+  if (ubs.empty()) {
     std::fprintf(stderr, "No valid uberblocks found!\n");
     return 1;
   }
 
-  if (argc >= 3 && std::strcmp(argv[2], "--list-uberblocks") == 0) {
-    list_ubs(*zpool, ubs, max_txg_index);
+  const UberblockEntry *selectedUb = selectUberblock(ubs, opts.ubIndex);
+  if (!selectedUb) {
+    std::fprintf(stderr, "Uberblock %ld is not valid in any label!\n",
+                 opts.ubIndex);
+    return 1;
+  }
+
+  if (opts.autoUb && opts.ubIndex < 0) {
+    selectedUb = findUsableUberblock(*zpool, ubs);
+    if (!selectedUb) {
+      std::fprintf(stderr,
+                   "None of the uberblocks leads to usable metadata!\n");
+      return 1;
+    }
+
+    std::fprintf(stderr, "Using uberblock %u of label L%u (txg %lu)\n",
+                 selectedUb->index, selectedUb->label, selectedUb->ub.txg);
+  }
+
+  switch (opts.mode) {
+  case Mode::ListUberblocks:
+    list_ubs(ubs);
     return 0;
-  } else if (argc >= 3 && std::strcmp(argv[2], "--extract") == 0) {
-    long ubIndex = max_txg_index;
-    if (argc >= 4) {
-      ubIndex = std::atol(argv[3]);
 
-      if (ubIndex >= VDEV_LABEL_NUBERBLOCKS) {
-        std::fprintf(stderr, "Invalid uberblock index!\n");
+  case Mode::Extract: {
+    if (opts.sinceTxg != 0) {
+      // neither can do without the data of the unchanged files
+      if (opts.tarPath || opts.manifestPath) {
+        std::fprintf(stderr, "--incremental cannot be combined with "
+                             "--extract-tar or --manifest!\n");
         return 1;
       }
+
+      if (opts.sinceTxg > selectedUb->ub.txg)
+        std::fprintf(stderr, "Warning: the earlier extraction (txg %lu) is "
+                             "newer than the uberblock (txg %lu)\n",
+                     opts.sinceTxg, selectedUb->ub.txg);
     }
 
-    handle_ub(*zpool, ubs[ubIndex]);
-  } else {
+    std::unique_ptr<Output> output;
+    if (opts.tarPath) {
+      output = TarOutput::open(opts.tarPath);
+      if (!output) {
+        std::fprintf(stderr, "Unable to open tar output '%s'!\n",
+                     opts.tarPath);
+        return 1;
+      }
+
+      if (opts.dedupBlocks) {
+        std::fprintf(stderr, "Note: --dedup-blocks has no effect when writing "
+                             "a tar archive\n");
+        opts.dedupBlocks = false;
+      }
+    } else {
+      output = FsOutput::open(".", opts.writer);
+      if (!output) {
+        std::fprintf(stderr, "Unable to open the output directory!\n");
+        return 1;
+      }
+    }
+
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> manifest{nullptr,
+                                                              std::fclose};
+    if (opts.manifestPath) {
+      if (std::strcmp(opts.manifestPath, "-") == 0) {
+        if (opts.tarPath && std::strcmp(opts.tarPath, "-") == 0) {
+          std::fprintf(stderr, "The tar archive and the manifest cannot both "
+                               "go to stdout!\n");
+          return 1;
+        }
+
+        opts.manifest = stdout;
+      } else {
+        manifest.reset(std::fopen(opts.manifestPath, "w"));
+        if (!manifest) {
+          std::fprintf(stderr, "Unable to open the manifest '%s'!\n",
+                       opts.manifestPath);
+          return 1;
+        }
+
+        opts.manifest = manifest.get();
+      }
+    }
+
+    handle_ub(*zpool, selectedUb->ub, output.get(), opts);
+
+    if (!output->finish()) {
+      std::fprintf(stderr, "Failed to finish writing the output!\n");
+      return 1;
+    }
+
+    if (opts.manifest && std::fflush(opts.manifest) != 0) {
+      std::fprintf(stderr, "Failed to write the manifest!\n");
+      return 1;
+    }
+
+    return 0;
+  }
+
+  case Mode::List:
+  case Mode::Grep:
+    handle_ub(*zpool, selectedUb->ub, /*output=*/nullptr, opts);
+    return 0;
+
+  case Mode::Carve:
+    return carveSpace(*zpool, selectedUb->ub, opts);
+
+  case Mode::Verify: {
+    const ScrubResult result = scrubPool(
+        *zpool, selectedUb->ub.rootbp, std::thread::hardware_concurrency());
+    printScrubReport(stdout, result);
+    return result.damaged == 0 ? 0 : 2;
+  }
+
+  default:
     std::fprintf(stderr, "Please specify either --list-uberblocks or --extract "
                          "<uberblock index>\n");
+    return 0;
   }
-
-  return 0;
 }
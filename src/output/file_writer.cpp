@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits> // IOV_MAX
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h> // FICLONERANGE
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "utils/log.h"
+
+#include "output/file_writer.h"
+
+// O_DIRECT requires the buffer, the file offset and the length to be aligned
+#define DIRECT_IO_ALIGNMENT (4 * KB)
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Writes back the given range and waits for it to hit the disk.
+static void writeback(int fd, off_t offset, off_t length) {
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (::sync_file_range(fd, offset, length,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+    return;
+#else
+  (void)offset;
+  (void)length;
+#endif
+
+  if (::fdatasync(fd) != 0)
+    LOG("Failed to write back output file: %s\n", std::strerror(errno));
+}
+
+// ---- WritebackQueue ----
+
+WritebackQueue::WritebackQueue(const WriterConfig &config) : m_config{config} {
+  if (enabled())
+    m_thread = std::thread{&WritebackQueue::run, this};
+}
+
+WritebackQueue::~WritebackQueue() {
+  if (!m_thread.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_stopping = true;
+  }
+
+  m_cond.notify_all();
+  m_thread.join();
+}
+
+void WritebackQueue::addDirty(size_t size) {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  m_dirty += size;
+}
+
+bool WritebackQueue::overBudget() {
+  std::lock_guard<std::mutex> lock{m_mutex};
+  return m_dirty > m_config.dirtyBudget;
+}
+
+void WritebackQueue::submit(int fd, off_t offset, off_t length, bool close) {
+  ASSERT0(enabled());
+
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+    m_ranges.push_back(Range{fd, offset, length, close});
+  }
+
+  m_cond.notify_all();
+}
+
+void WritebackQueue::throttle() {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  m_cond.wait(lock, [this] {
+    return m_dirty <= m_config.dirtyBudget || (m_ranges.empty() && !m_busy);
+  });
+}
+
+void WritebackQueue::drain() {
+  std::unique_lock<std::mutex> lock{m_mutex};
+  m_cond.wait(lock, [this] { return m_ranges.empty() && !m_busy; });
+}
+
+void WritebackQueue::run() {
+  std::unique_lock<std::mutex> lock{m_mutex};
+
+  for (;;) {
+    m_cond.wait(lock, [this] { return m_stopping || !m_ranges.empty(); });
+
+    if (m_ranges.empty())
+      return; // stopping, and everything has been written back
+
+    const Range range = m_ranges.front();
+    m_ranges.pop_front();
+    m_busy = true;
+
+    lock.unlock();
+
+    // empty ranges only close the file; sync_file_range() would take a length
+    // of 0 as up to the end of the file
+    if (range.length > 0)
+      writeback(range.fd, range.offset, range.length);
+    if (range.close)
+      ::close(range.fd);
+
+    lock.lock();
+
+    m_dirty -= std::min(m_dirty, static_cast<size_t>(range.length));
+    m_busy = false;
+    m_cond.notify_all();
+  }
+}
+
+// ---- FileWriter ----
+
+FileWriter::~FileWriter() {
+  if (isOpen())
+    ::close(m_fd);
+}
+
+void FileWriter::open(int fd, u64 expectedSize) {
+  ASSERT0(!isOpen());
+
+  m_fd            = fd;
+  m_offset        = 0;
+  m_unsyncedStart = 0;
+  m_pending       = 0;
+  m_stagingUsed   = 0;
+  m_iovecs.clear();
+
+  m_direct = false;
+  if (m_config->directThreshold != 0 &&
+      expectedSize >= m_config->directThreshold) {
+    const int flags = ::fcntl(fd, F_GETFL);
+    m_direct = flags >= 0 && ::fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+
+    if (m_direct && !m_staging) {
+      void *staging = nullptr;
+      if (::posix_memalign(&staging, DIRECT_IO_ALIGNMENT,
+                           alignUp(m_config->batchSize, DIRECT_IO_ALIGNMENT)) !=
+          0)
+        staging = nullptr;
+
+      m_staging = std::unique_ptr<char, void (*)(void *)>{
+          static_cast<char *>(staging), &std::free};
+    }
+
+    if (m_direct && !m_staging) {
+      ::fcntl(fd, F_SETFL, flags);
+      m_direct = false;
+    }
+  }
+}
+
+bool FileWriter::writeAll(const struct iovec *iov, int iovcnt, size_t size) {
+  std::vector<struct iovec> remaining{iov, iov + iovcnt};
+  struct iovec *            cur    = remaining.data();
+  off_t                     offset = m_offset;
+
+  while (size > 0) {
+    const ssize_t nwritten = ::pwritev(m_fd, cur, iovcnt, offset);
+    if (nwritten < 0) {
+      if (errno == EINTR)
+        continue;
+
+      LOG("Failed to write output file: %s\n", std::strerror(errno));
+      return false;
+    }
+
+    size -= static_cast<size_t>(nwritten);
+    offset += nwritten;
+
+    // skip over what has been written completely, trim what was written
+    // partially
+    size_t skip = static_cast<size_t>(nwritten);
+    while (iovcnt > 0 && skip >= cur->iov_len) {
+      skip -= cur->iov_len;
+      cur++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      cur->iov_base = static_cast<char *>(cur->iov_base) + skip;
+      cur->iov_len -= skip;
+    }
+  }
+
+  return true;
+}
+
+void FileWriter::written(size_t size) {
+  m_offset += size;
+
+  // direct I/O does not leave anything dirty in the page cache
+  if (!m_queue->enabled() || m_direct)
+    return;
+
+  m_queue->addDirty(size);
+
+  // when over budget, submit what we have right away: other files have
+  // submitted all of theirs already, so this is what the throttle waits for
+  const off_t unsynced = m_offset - m_unsyncedStart;
+  if (unsynced >= static_cast<off_t>(m_config->syncInterval) ||
+      m_queue->overBudget()) {
+    m_queue->submit(m_fd, m_unsyncedStart, unsynced, /*close=*/false);
+    m_unsyncedStart = m_offset;
+  }
+
+  m_queue->throttle();
+}
+
+bool FileWriter::flushBuffered() {
+  if (m_iovecs.empty())
+    return true;
+
+  const bool ok =
+      writeAll(m_iovecs.data(), static_cast<int>(m_iovecs.size()), m_pending);
+  if (ok)
+    written(m_pending);
+
+  m_iovecs.clear();
+  m_pending = 0;
+  return ok;
+}
+
+bool FileWriter::flushDirect(bool final) {
+  if (m_stagingUsed == 0)
+    return true;
+
+  const size_t size      = m_stagingUsed;
+  size_t       writeSize = size;
+
+  // the last piece has to be padded, the file is truncated back afterwards
+  if (final && size % DIRECT_IO_ALIGNMENT != 0) {
+    writeSize = alignUp(size, DIRECT_IO_ALIGNMENT);
+    std::memset(m_staging.get() + size, 0, writeSize - size);
+  }
+
+  struct iovec iov = {m_staging.get(), writeSize};
+  bool         ok  = writeAll(&iov, 1, writeSize);
+
+  if (!ok && errno == EINVAL) {
+    // the destination filesystem does not support O_DIRECT after all
+    LOG("Direct I/O not supported, falling back to buffered writes\n");
+    const int flags = ::fcntl(m_fd, F_GETFL);
+    ::fcntl(m_fd, F_SETFL, flags & ~O_DIRECT);
+
+    iov.iov_len = size;
+    ok          = writeAll(&iov, 1, size);
+    writeSize   = size;
+  }
+
+  if (ok && writeSize != size)
+    ok = ::ftruncate(m_fd, m_offset + static_cast<off_t>(size)) == 0;
+
+  if (ok)
+    written(size);
+
+  m_stagingUsed = 0;
+  return ok;
+}
+
+bool FileWriter::append(const void *data, size_t size) {
+  ASSERT0(isOpen());
+
+  if (!m_direct) {
+    if (size == 0)
+      return true;
+
+    m_iovecs.push_back(iovec{const_cast<void *>(data), size});
+    m_pending += size;
+
+    if (m_pending >= m_config->batchSize || m_iovecs.size() >= IOV_MAX)
+      return flushBuffered();
+
+    return true;
+  }
+
+  const size_t capacity = alignUp(m_config->batchSize, DIRECT_IO_ALIGNMENT);
+  const char * ptr      = static_cast<const char *>(data);
+
+  while (size > 0) {
+    const size_t copySize = std::min(size, capacity - m_stagingUsed);
+    std::memcpy(m_staging.get() + m_stagingUsed, ptr, copySize);
+
+    m_stagingUsed += copySize;
+    ptr += copySize;
+    size -= copySize;
+
+    if (m_stagingUsed == capacity && !flushDirect(/*final=*/false))
+      return false;
+  }
+
+  return true;
+}
+
+bool FileWriter::clone(int srcFd, off_t srcOffset, size_t size) {
+  ASSERT0(isOpen());
+
+  // the clone has to go after everything that was appended before
+  if (m_direct || !flushBuffered())
+    return false;
+
+  struct file_clone_range range = {};
+  range.src_fd      = srcFd;
+  range.src_offset  = static_cast<u64>(srcOffset);
+  range.src_length  = size;
+  range.dest_offset = static_cast<u64>(m_offset);
+
+  // shared extents are not dirty, no need to account for them
+  if (::ioctl(m_fd, FICLONERANGE, &range) == 0) {
+    m_offset += static_cast<off_t>(size);
+    return true;
+  }
+
+  // not a reflink-capable filesystem, or the range is not block aligned
+  loff_t inOffset  = srcOffset;
+  loff_t outOffset = m_offset;
+  size_t remaining = size;
+
+  while (remaining > 0) {
+    const ssize_t ncopied = ::copy_file_range(srcFd, &inOffset, m_fd,
+                                              &outOffset, remaining, 0);
+    if (ncopied < 0 && errno == EINTR)
+      continue;
+
+    if (ncopied <= 0) {
+      LOG("Failed to copy from the already written output: %s\n",
+          ncopied < 0 ? std::strerror(errno) : "unexpected end of file");
+
+      // the offset is not advanced, so the caller's fallback write simply
+      // overwrites whatever has been copied so far
+      return false;
+    }
+
+    remaining -= static_cast<size_t>(ncopied);
+  }
+
+  written(size);
+  return true;
+}
+
+bool FileWriter::finish() {
+  ASSERT0(isOpen());
+  return m_direct ? flushDirect(/*final=*/true) : flushBuffered();
+}
+
+void FileWriter::close() {
+  ASSERT0(isOpen());
+
+  // earlier ranges of the file may still be queued or being written back, so
+  // the queue closes it after them, even if there is nothing left to submit
+  if (m_queue->enabled() && !m_direct)
+    m_queue->submit(m_fd, m_unsyncedStart, m_offset - m_unsyncedStart,
+                    /*close=*/true);
+  else
+    ::close(m_fd);
+
+  m_fd = -1;
+}
@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/xattr.h>
+#endif
+
+#include "utils/log.h"
+
+#include "output/fs_output.h"
+
+std::unique_ptr<FsOutput> FsOutput::open(const std::string & baseDir,
+                                         const WriterConfig &config) {
+  const int fd = ::open(baseDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+
+  return std::make_unique<FsOutput>(fd, config);
+}
+
+FsOutput::FsOutput(int baseDirFd, const WriterConfig &config)
+    : m_config{config}, m_writeback{m_config}, m_file{m_writeback, m_config} {
+  // the base directory is not ours, so its metadata is never touched
+  m_dirs.push_back(OpenNode{baseDirFd, {}});
+}
+
+FsOutput::~FsOutput() {
+  closeCloneSource();
+
+  if (m_updateFd >= 0)
+    ::close(m_updateFd);
+
+  for (const OpenNode &dir : m_dirs)
+    ::close(dir.fd);
+}
+
+// the extended attribute naming the object a file was extracted from, as
+// "<object ID>:<generation>": object IDs of deleted files get reused
+#define OBJECT_XATTR "user.zfs.objid"
+
+static std::string objectTag(u64 objid, const zfs::physical::ZNode &znode) {
+  char tag[48];
+  std::snprintf(tag, sizeof(tag), "%lu:%lu", objid, znode.gen);
+  return tag;
+}
+
+// Records the object the file open as FD is extracted from, see
+// isObjectFile().
+static void tagObjectFile(int fd, u64 objid,
+                          const zfs::physical::ZNode &znode) {
+#ifdef __linux__
+  const std::string tag = objectTag(objid, znode);
+  if (::fsetxattr(fd, OBJECT_XATTR, tag.data(), tag.size(), 0) != 0)
+    LOG("Failed to record the object of a file: %s\n", std::strerror(errno));
+#else
+  (void)fd;
+  (void)objid;
+  (void)znode;
+#endif
+}
+
+// Whether the file open as FD was extracted from the given object. Without
+// extended attributes, no file ever is.
+static bool isObjectFile(int fd, u64 objid,
+                         const zfs::physical::ZNode &znode) {
+#ifdef __linux__
+  const std::string tag = objectTag(objid, znode);
+
+  char          value[48];
+  const ssize_t n = ::fgetxattr(fd, OBJECT_XATTR, value, sizeof(value));
+  return n == static_cast<ssize_t>(tag.size()) &&
+         std::memcmp(value, tag.data(), tag.size()) == 0;
+#else
+  (void)fd;
+  (void)objid;
+  (void)znode;
+  return false;
+#endif
+}
+
+// Gives the owner the permissions PERMS on NAME in DIRFD, after opening it has
+// failed with EACCES. Files and directories of an earlier extraction have their
+// original mode, which may not let a non-root user write them anymore; the mode
+// is put back by restoreMetadata() once they are done. Returns false if there
+// was nothing to grant, i.e. the error lies elsewhere.
+static bool grantOwner(int dirFd, const std::string &name, mode_t perms) {
+  struct stat st;
+  if (::fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+      S_ISLNK(st.st_mode) || (st.st_mode & perms) == perms)
+    return false;
+
+  if (::fchmodat(dirFd, name.c_str(), (st.st_mode & 07777) | perms, 0) != 0) {
+    LOG("Failed to make '%s' writable: %s\n", name.c_str(),
+        std::strerror(errno));
+    return false;
+  }
+
+  return true;
+}
+
+void FsOutput::restoreMetadata(const OpenNode &node) {
+  const zfs::physical::ZNode &znode = node.znode;
+
+  // changing the owner is only possible as root, that's fine
+  if (::fchown(node.fd, static_cast<uid_t>(znode.uid),
+               static_cast<gid_t>(znode.gid)) != 0 &&
+      errno != EPERM) {
+    LOG("Failed to restore ownership: %s\n", std::strerror(errno));
+  }
+
+  // after fchown(), since that may clear the setuid and setgid bits
+  if (::fchmod(node.fd, static_cast<mode_t>(znode.mode & 07777)) != 0)
+    LOG("Failed to restore mode: %s\n", std::strerror(errno));
+
+  const struct timespec times[2] = {
+      {static_cast<time_t>(znode.atime.seconds),
+       static_cast<long>(znode.atime.nanoseconds)},
+      {static_cast<time_t>(znode.mtime.seconds),
+       static_cast<long>(znode.mtime.nanoseconds)},
+  };
+
+  if (::futimens(node.fd, times) != 0)
+    LOG("Failed to restore timestamps: %s\n", std::strerror(errno));
+}
+
+bool FsOutput::enterDirectory(const std::string &         name,
+                              const zfs::physical::ZNode &znode) {
+  const int parentFd = currentDirFd();
+
+  if (::mkdirat(parentFd, name.c_str(), S_IRWXU) != 0 && errno != EEXIST) {
+    LOG("Failed to create directory '%s': %s\n", name.c_str(),
+        std::strerror(errno));
+    return false;
+  }
+
+  const int flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+
+  int fd = ::openat(parentFd, name.c_str(), flags);
+  if (fd < 0 && errno == EACCES && grantOwner(parentFd, name, S_IRWXU))
+    fd = ::openat(parentFd, name.c_str(), flags);
+
+  if (fd < 0) {
+    LOG("Failed to open directory '%s': %s\n", name.c_str(),
+        std::strerror(errno));
+    return false;
+  }
+
+  // a directory left behind by an earlier extraction may be read-only, but
+  // its entries still have to be created
+  struct stat st;
+  if (::fstat(fd, &st) == 0 && (st.st_mode & S_IRWXU) != S_IRWXU &&
+      ::fchmod(fd, (st.st_mode & 07777) | S_IRWXU) != 0)
+    LOG("Failed to make directory '%s' writable: %s\n", name.c_str(),
+        std::strerror(errno));
+
+  m_dirs.push_back(OpenNode{fd, znode});
+
+  m_pathLengths.push_back(m_path.size());
+  m_path = pathOf(name);
+  return true;
+}
+
+void FsOutput::leaveDirectory() {
+  ASSERT0(m_dirs.size() > 1);
+
+  const OpenNode &dir = m_dirs.back();
+  restoreMetadata(dir);
+  ::close(dir.fd);
+
+  m_dirs.pop_back();
+
+  m_path.resize(m_pathLengths.back());
+  m_pathLengths.pop_back();
+}
+
+bool FsOutput::beginFile(const std::string &name, u64 objid,
+                         const zfs::physical::ZNode &znode) {
+  ASSERT0(!m_file.isOpen());
+
+  const int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+
+  int fd = ::openat(currentDirFd(), name.c_str(), flags, S_IRUSR | S_IWUSR);
+  if (fd < 0 && errno == EACCES && grantOwner(currentDirFd(), name, S_IWUSR))
+    fd = ::openat(currentDirFd(), name.c_str(), flags, S_IRUSR | S_IWUSR);
+
+  if (fd < 0) {
+    LOG("Failed to open output file '%s': %s\n", name.c_str(),
+        std::strerror(errno));
+    return false;
+  }
+
+  tagObjectFile(fd, objid, znode);
+
+  m_file.open(fd, znode.size);
+  m_fileZNode = znode;
+  m_filePath  = pathOf(name);
+  return true;
+}
+
+bool FsOutput::writeFileData(const void *data, size_t size) {
+  ASSERT0(m_file.isOpen());
+  return m_file.append(data, size);
+}
+
+bool FsOutput::endFile() {
+  if (m_updateFd >= 0) {
+    // the file may have shrunk, or grown by a hole
+    bool ok = true;
+    if (::ftruncate(m_updateFd, static_cast<off_t>(m_fileZNode.size)) != 0) {
+      LOG("Failed to resize '%s': %s\n", m_filePath.c_str(),
+          std::strerror(errno));
+      ok = false;
+    }
+
+    restoreMetadata(OpenNode{m_updateFd, m_fileZNode});
+    ::close(m_updateFd);
+    m_updateFd = -1;
+    return ok;
+  }
+
+  ASSERT0(m_file.isOpen());
+
+  // all data has to be written before the timestamps can be restored
+  const bool ok = m_file.finish();
+  restoreMetadata(OpenNode{m_file.fd(), m_fileZNode});
+
+  m_file.close();
+  return ok;
+}
+
+void FsOutput::closeCloneSource() {
+  if (m_cloneSourceFd >= 0)
+    ::close(m_cloneSourceFd);
+
+  m_cloneSourceFd = -1;
+  m_cloneSourcePath.clear();
+}
+
+bool FsOutput::cloneFileData(const std::string &source, u64 offset,
+                             size_t size) {
+  ASSERT0(m_file.isOpen());
+
+  // consecutive clones tend to come from the same file, so keep it open
+  if (m_cloneSourceFd < 0 || source != m_cloneSourcePath) {
+    closeCloneSource();
+
+    m_cloneSourceFd = ::openat(m_dirs.front().fd, source.c_str(),
+                               O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (m_cloneSourceFd < 0) {
+      LOG("Failed to open clone source '%s': %s\n", source.c_str(),
+          std::strerror(errno));
+      return false;
+    }
+
+    m_cloneSourcePath = source;
+  }
+
+  return m_file.clone(m_cloneSourceFd, static_cast<off_t>(offset), size);
+}
+
+bool FsOutput::isFileCurrent(const std::string &name, u64 objid,
+                             const zfs::physical::ZNode &znode) const {
+  // non-blocking, in case something else than a regular file is in the way
+  const int fd = ::openat(currentDirFd(), name.c_str(),
+                          O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  const bool  current = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+                       isObjectFile(fd, objid, znode);
+  ::close(fd);
+
+  if (!current)
+    return false;
+
+  // the ownership can only have been restored as root
+  if (::geteuid() == 0 && (st.st_uid != static_cast<uid_t>(znode.uid) ||
+                           st.st_gid != static_cast<gid_t>(znode.gid)))
+    return false;
+
+  return static_cast<u64>(st.st_size) == znode.size &&
+         (st.st_mode & 07777) == (znode.mode & 07777) &&
+         static_cast<u64>(st.st_mtim.tv_sec) == znode.mtime.seconds &&
+         static_cast<u64>(st.st_mtim.tv_nsec) == znode.mtime.nanoseconds;
+}
+
+bool FsOutput::beginFileUpdate(const std::string &name, u64 objid,
+                               const zfs::physical::ZNode &znode) {
+  ASSERT0(!m_file.isOpen() && m_updateFd < 0);
+
+  const int flags = O_WRONLY | O_NOFOLLOW | O_CLOEXEC;
+
+  int fd = ::openat(currentDirFd(), name.c_str(), flags);
+  if (fd < 0 && errno == EACCES && grantOwner(currentDirFd(), name, S_IWUSR))
+    fd = ::openat(currentDirFd(), name.c_str(), flags);
+
+  if (fd < 0) {
+    if (errno != ENOENT)
+      LOG("Failed to open '%s' for updating: %s\n", name.c_str(),
+          std::strerror(errno));
+    return false;
+  }
+
+  // a different file may have been renamed to NAME since
+  if (!isObjectFile(fd, objid, znode)) {
+    LOG("'%s' was extracted from a different object, rewriting it\n",
+        name.c_str());
+    ::close(fd);
+    return false;
+  }
+
+  m_updateFd  = fd;
+  m_fileZNode = znode;
+  m_filePath  = pathOf(name);
+  return true;
+}
+
+bool FsOutput::patchFileData(u64 offset, const void *data, size_t size) {
+  ASSERT0(m_updateFd >= 0);
+
+  static const u8 zeros[64 * KB] = {};
+
+#ifdef __linux__
+  // zeros are better left as a hole, where the filesystem can do that
+  if (!data &&
+      ::fallocate(m_updateFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  static_cast<off_t>(offset), static_cast<off_t>(size)) == 0)
+    return true;
+#endif
+
+  while (size > 0) {
+    const size_t  chunk = data ? size : std::min(size, sizeof(zeros));
+    const ssize_t written =
+        ::pwrite(m_updateFd, data ? data : zeros, chunk,
+                 static_cast<off_t>(offset));
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+
+      LOG("Failed to update '%s': %s\n", m_filePath.c_str(),
+          std::strerror(errno));
+      return false;
+    }
+
+    offset += static_cast<u64>(written);
+    size -= static_cast<size_t>(written);
+    if (data)
+      data = static_cast<const u8 *>(data) + written;
+  }
+
+  return true;
+}
+
+bool FsOutput::linkFile(const std::string &name,
+                        const zfs::physical::ZNode & /*znode*/,
+                        const std::string &target) {
+  ASSERT0(!m_file.isOpen());
+
+  const int baseFd = m_dirs.front().fd;
+  const int dirFd  = currentDirFd();
+
+  if (::linkat(baseFd, target.c_str(), dirFd, name.c_str(), 0) == 0)
+    return true;
+
+  // same as opening with O_TRUNC: replace whatever was there
+  if (errno == EEXIST && ::unlinkat(dirFd, name.c_str(), 0) == 0 &&
+      ::linkat(baseFd, target.c_str(), dirFd, name.c_str(), 0) == 0)
+    return true;
+
+  LOG("Failed to link '%s' to '%s': %s\n", name.c_str(), target.c_str(),
+      std::strerror(errno));
+  return false;
+}
+
+bool FsOutput::finish() {
+  closeCloneSource();
+
+  if (!m_writeback.enabled())
+    return true;
+
+  m_writeback.drain();
+
+#ifdef __linux__
+  if (::syncfs(m_dirs.front().fd) == 0)
+    return true;
+#endif
+
+  ::sync();
+  return true;
+}
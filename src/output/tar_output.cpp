@@ -0,0 +1,277 @@
+#include <algorithm>
+#include <cstring>
+
+#include "utils/log.h"
+
+#include "output/tar_output.h"
+
+#define TAR_OUTPUT_BUFFER_SIZE (MB * 4)
+
+namespace {
+
+// POSIX ustar header, see the description of the pax utility in POSIX.1-2008.
+struct TarHeader {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char chksum[8];
+  char typeflag;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  PADDING(12);
+} __attribute__((packed));
+
+static_assert(sizeof(TarHeader) == TAR_BLOCK_SIZE, "TarHeader invalid!");
+
+} // end anonymous namespace
+
+// Writes VALUE as a NUL-terminated octal number into a header field of the
+// given width. Returns false if it does not fit, in which case the field is
+// left zeroed and the value has to go into a pax record instead.
+static bool setOctal(char *field, std::size_t width, u64 value) {
+  if (value >> (3 * (width - 1)) != 0)
+    return false;
+
+  std::snprintf(field, width, "%0*lo", static_cast<int>(width - 1), value);
+  return true;
+}
+
+// A pax record is "<length> <key>=<value>\n", where the length includes the
+// length field itself.
+static void addPaxRecord(std::string &records, const char *key,
+                         const std::string &value) {
+  const std::size_t baseLength = std::strlen(key) + value.size() + 3;
+
+  std::size_t length = baseLength + 1;
+  while (std::to_string(length).size() + baseLength != length)
+    length++;
+
+  records += std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
+// Tries to fit PATH into the name and prefix fields of a ustar header.
+static bool splitPath(const std::string &path, OUT TarHeader *header) {
+  if (path.size() <= sizeof(header->name)) {
+    std::memcpy(header->name, path.data(), path.size());
+    return true;
+  }
+
+  // the prefix and name are joined by an implicit '/'
+  for (std::size_t pos = std::min(path.size() - 1, sizeof(header->prefix));
+       pos > 0; pos--) {
+    if (path[pos] != '/')
+      continue;
+
+    if (path.size() - pos - 1 > sizeof(header->name))
+      return false;
+
+    std::memcpy(header->prefix, path.data(), pos);
+    std::memcpy(header->name, path.data() + pos + 1, path.size() - pos - 1);
+    return true;
+  }
+
+  return false;
+}
+
+std::unique_ptr<TarOutput> TarOutput::open(const std::string &path) {
+  if (path == "-")
+    return std::make_unique<TarOutput>(stdout);
+
+  std::FILE *fp = std::fopen(path.c_str(), "wb");
+  if (!fp)
+    return nullptr;
+
+  return std::make_unique<TarOutput>(fp, true);
+}
+
+TarOutput::TarOutput(std::FILE *fp, bool own)
+    : m_fp{fp}, m_own{own}, m_buffer{new char[TAR_OUTPUT_BUFFER_SIZE]} {
+  std::setvbuf(m_fp, m_buffer.get(), _IOFBF, TAR_OUTPUT_BUFFER_SIZE);
+}
+
+TarOutput::~TarOutput() {
+  finish();
+
+  if (m_own)
+    std::fclose(m_fp);
+}
+
+bool TarOutput::writeHeader(const std::string &path, char typeflag,
+                            const zfs::physical::ZNode &znode, u64 size,
+                            const std::string &linkTarget) {
+  TarHeader   header{};
+  std::string pax;
+
+  if (!splitPath(path, OUT & header))
+    addPaxRecord(pax, "path", path);
+
+  setOctal(header.mode, sizeof(header.mode), znode.mode & 07777);
+
+  if (!setOctal(header.uid, sizeof(header.uid), znode.uid))
+    addPaxRecord(pax, "uid", std::to_string(znode.uid));
+
+  if (!setOctal(header.gid, sizeof(header.gid), znode.gid))
+    addPaxRecord(pax, "gid", std::to_string(znode.gid));
+
+  if (!setOctal(header.size, sizeof(header.size), size))
+    addPaxRecord(pax, "size", std::to_string(size));
+
+  if (!setOctal(header.mtime, sizeof(header.mtime), znode.mtime.seconds))
+    addPaxRecord(pax, "mtime", std::to_string(znode.mtime.seconds));
+
+  if (linkTarget.size() <= sizeof(header.linkname))
+    std::memcpy(header.linkname, linkTarget.data(), linkTarget.size());
+  else
+    addPaxRecord(pax, "linkpath", linkTarget);
+
+  header.typeflag = typeflag;
+  std::memcpy(header.magic, "ustar", 6);
+  std::memcpy(header.version, "00", 2);
+
+  if (!pax.empty()) {
+    // the extended header itself gets only neutral values, so that it never
+    // needs a pax record of its own
+    zfs::physical::ZNode paxNode{};
+    paxNode.mode = 0644;
+
+    const std::string paxName =
+        "PaxHeaders/" + path.substr(0, sizeof(header.name) - 11);
+    if (!writeHeader(paxName, 'x', paxNode, pax.size()))
+      return false;
+
+    if (std::fwrite(pax.data(), pax.size(), 1, m_fp) != 1 ||
+        !writePadding(pax.size()))
+      return false;
+  }
+
+  // the checksum is computed with the checksum field set to spaces
+  std::memset(header.chksum, ' ', sizeof(header.chksum));
+
+  unsigned    chksum = 0;
+  const auto *bytes  = reinterpret_cast<const unsigned char *>(&header);
+  for (std::size_t i = 0; i < sizeof(header); i++)
+    chksum += bytes[i];
+
+  std::snprintf(header.chksum, sizeof(header.chksum), "%06o", chksum);
+
+  return std::fwrite(&header, sizeof(header), 1, m_fp) == 1;
+}
+
+bool TarOutput::writePadding(u64 size) {
+  static const char zeros[TAR_BLOCK_SIZE] = {};
+
+  const std::size_t remainder = size % TAR_BLOCK_SIZE;
+  if (remainder == 0)
+    return true;
+
+  return std::fwrite(zeros, TAR_BLOCK_SIZE - remainder, 1, m_fp) == 1;
+}
+
+bool TarOutput::enterDirectory(const std::string &         name,
+                               const zfs::physical::ZNode &znode) {
+  ASSERT0(!m_inFile);
+
+  const std::string dirPath = pathOf(name);
+  if (!writeHeader(dirPath + "/", '5', znode, 0)) {
+    LOG("Failed to write tar header for directory '%s'!\n", dirPath.c_str());
+    return false;
+  }
+
+  m_pathLengths.push_back(m_path.size());
+  m_path = dirPath;
+  return true;
+}
+
+void TarOutput::leaveDirectory() {
+  ASSERT0(!m_pathLengths.empty());
+
+  m_path.resize(m_pathLengths.back());
+  m_pathLengths.pop_back();
+}
+
+bool TarOutput::beginFile(const std::string &name, u64 /*objid*/,
+                          const zfs::physical::ZNode &znode) {
+  ASSERT0(!m_inFile);
+
+  const std::string filePath = pathOf(name);
+  if (!writeHeader(filePath, '0', znode, znode.size)) {
+    LOG("Failed to write tar header for file '%s'!\n", filePath.c_str());
+    return false;
+  }
+
+  m_inFile      = true;
+  m_fileSize    = znode.size;
+  m_fileWritten = 0;
+  return true;
+}
+
+bool TarOutput::writeFileData(const void *data, size_t size) {
+  ASSERT0(m_inFile);
+
+  // the size has already been committed to in the header, so never write more
+  const std::size_t writeSize =
+      std::min<u64>(size, m_fileSize - m_fileWritten);
+  if (writeSize == 0)
+    return true;
+
+  if (std::fwrite(data, writeSize, 1, m_fp) != 1)
+    return false;
+
+  m_fileWritten += writeSize;
+  return true;
+}
+
+bool TarOutput::endFile() {
+  ASSERT0(m_inFile);
+  m_inFile = false;
+
+  // if the file could not be read completely, fill up the rest with zeros so
+  // that the archive stays consistent
+  static const char zeros[TAR_BLOCK_SIZE] = {};
+  while (m_fileWritten < m_fileSize) {
+    const std::size_t writeSize =
+        std::min<u64>(sizeof(zeros), m_fileSize - m_fileWritten);
+    if (std::fwrite(zeros, writeSize, 1, m_fp) != 1)
+      return false;
+
+    m_fileWritten += writeSize;
+  }
+
+  return writePadding(m_fileSize);
+}
+
+bool TarOutput::linkFile(const std::string &         name,
+                         const zfs::physical::ZNode &znode,
+                         const std::string &         target) {
+  ASSERT0(!m_inFile);
+
+  // hard link entries carry no data
+  const std::string filePath = pathOf(name);
+  if (!writeHeader(filePath, '1', znode, 0, target)) {
+    LOG("Failed to write tar header for hard link '%s'!\n", filePath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+bool TarOutput::finish() {
+  if (m_finished)
+    return true;
+
+  m_finished = true;
+
+  // the end of the archive is marked by two zero blocks
+  static const char zeros[2 * TAR_BLOCK_SIZE] = {};
+  return std::fwrite(zeros, sizeof(zeros), 1, m_fp) == 1 &&
+         std::fflush(m_fp) == 0;
+}
@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+#include <mutex>
+#include <sys/stat.h>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "zfs/physical/znode.h"
+#include "zfs/zap.h"
+
+#include "utils/common.h"
+#include "utils/log.h"
+
+#include "listing.h"
+#include "search.h"
+
+using namespace zfs;
+
+// the number of data blocks of a file read and verified at once
+#define SEARCH_BATCH 16
+
+namespace {
+
+// A file to search, found by the walk of the directory tree.
+struct SearchFile {
+  std::string            path;
+  const physical::DNode *dnode; // stays in ctx.dslBlock
+  u64                    size;
+};
+
+struct SearchMatch {
+  u64         offset;
+  std::size_t pattern; // index into ctx.patterns
+};
+
+} // end anonymous namespace
+
+// ---- literal matching ----
+
+// The position of the first occurrence of NEEDLE in HAY[FROM, SIZE), or SIZE
+// if there is none.
+using FindFn = std::size_t (*)(const u8 *hay, std::size_t size,
+                               const std::string &needle, std::size_t from);
+
+static std::size_t findScalar(const u8 *hay, std::size_t size,
+                              const std::string &needle, std::size_t from) {
+  if (from >= size)
+    return size;
+
+  const void *match =
+      ::memmem(hay + from, size - from, needle.data(), needle.size());
+  return match ? static_cast<const u8 *>(match) - hay : size;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Compares the first and the last byte of NEEDLE at 32 positions at once, and
+// only the candidates that have both go on to a full comparison. Rare bytes
+// are not needed to filter well, two of them are already selective.
+__attribute__((target("avx2"))) static std::size_t
+findAVX2(const u8 *hay, std::size_t size, const std::string &needle,
+         std::size_t from) {
+  const std::size_t n = needle.size();
+  if (n < 2)
+    return findScalar(hay, size, needle, from);
+
+  const u8 *const p     = reinterpret_cast<const u8 *>(needle.data());
+  const __m256i   first = _mm256_set1_epi8(static_cast<char>(p[0]));
+  const __m256i   last  = _mm256_set1_epi8(static_cast<char>(p[n - 1]));
+
+  std::size_t i = from;
+  for (; i + n - 1 + 32 <= size; i += 32) {
+    const __m256i blockFirst =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i));
+    const __m256i blockLast =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(hay + i + n - 1));
+
+    u32 mask = static_cast<u32>(_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+                         _mm256_cmpeq_epi8(last, blockLast))));
+
+    for (; mask != 0; mask &= mask - 1) {
+      const std::size_t pos = i + static_cast<std::size_t>(__builtin_ctz(mask));
+      if (std::memcmp(hay + pos + 1, p + 1, n - 2) == 0)
+        return pos;
+    }
+  }
+
+  return findScalar(hay, size, needle, i);
+}
+
+#endif // HAVE_X86_KERNELS
+
+static FindFn findLiteral() {
+  static const FindFn fastest = [] {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return static_cast<FindFn>(findAVX2);
+#endif
+
+    return static_cast<FindFn>(findScalar);
+  }();
+
+  return fastest;
+}
+
+// Finds the patterns in a file that arrives one block at a time. The last
+// bytes of each block are kept, so that matches spanning two blocks are found
+// as well.
+class StreamMatcher {
+public:
+  explicit StreamMatcher(const std::vector<std::string> &patterns)
+      : m_patterns{patterns} {
+    for (const std::string &pattern : patterns)
+      m_maxLength = std::max(m_maxLength, pattern.size());
+  }
+
+  // Searches the SIZE bytes of DATA, which come right after everything passed
+  // so far.
+  void update(const u8 *data, std::size_t size,
+              INOUT std::vector<SearchMatch> *matches) {
+    const FindFn find = findLiteral();
+
+    // the matches that start in the previous bytes and end in DATA
+    if (!m_carry.empty()) {
+      const std::size_t carried = m_carry.size();
+      m_carry.insert(m_carry.end(), data,
+                     data + std::min(size, m_maxLength - 1));
+
+      for (std::size_t p = 0; p < m_patterns.size(); p++) {
+        const std::string &pattern = m_patterns[p];
+        for (std::size_t pos = find(m_carry.data(), m_carry.size(), pattern, 0);
+             pos < carried; pos = find(m_carry.data(), m_carry.size(), pattern,
+                                       pos + 1)) {
+          if (pos + pattern.size() > carried)
+            matches->push_back(SearchMatch{m_offset - carried + pos, p});
+        }
+      }
+
+      m_carry.resize(carried);
+    }
+
+    for (std::size_t p = 0; p < m_patterns.size(); p++) {
+      const std::string &pattern = m_patterns[p];
+      for (std::size_t pos = find(data, size, pattern, 0); pos < size;
+           pos = find(data, size, pattern, pos + 1))
+        matches->push_back(SearchMatch{m_offset + pos, p});
+    }
+
+    // keep the bytes a match could still start in
+    const std::size_t keep = m_maxLength - 1;
+    if (size >= keep) {
+      m_carry.assign(data + size - keep, data + size);
+    } else {
+      m_carry.insert(m_carry.end(), data, data + size);
+      if (m_carry.size() > keep)
+        m_carry.erase(m_carry.begin(), m_carry.end() - keep);
+    }
+
+    m_offset += size;
+  }
+
+  // Skips SIZE bytes that could not be read: nothing spans them.
+  void skip(std::size_t size) {
+    m_carry.clear();
+    m_offset += size;
+  }
+
+private:
+  const std::vector<std::string> &m_patterns;
+  std::size_t                     m_maxLength = 1;
+  std::vector<u8>                 m_carry;
+  u64                             m_offset = 0;
+};
+
+// ---- the walk of the directory tree ----
+
+static void collectDirContents(SearchContext &ctx, u64 objid,
+                               const std::string &       path,
+                               INOUT std::vector<SearchFile> *files);
+
+// Adds the searchable files among a batch of entries of the directory PATH,
+// descending into subdirectories.
+static void collectDirEntries(SearchContext &ctx, const std::string &path,
+                              const std::vector<ZapEntry> &  entries,
+                              INOUT std::vector<SearchFile> *files) {
+  for (const ZapEntry &entry : entries) {
+    const u64         childID   = ZFS_DIRENT_OBJ(entry.value);
+    const std::string childPath = path + "/" + entry.name;
+
+    try {
+      const physical::DNode &child = ctx.dslBlock.objectByID(childID);
+
+      if (child.type == DNodeType::DirContents) {
+        collectDirContents(ctx, childID, childPath, INOUT files);
+        continue;
+      }
+
+      if (child.type != DNodeType::FileContents)
+        continue;
+
+      // symlinks and device nodes have no contents worth searching
+      const physical::ZNode znode = ctx.sa.znode(child);
+      if ((znode.mode & S_IFMT) != 0 && (znode.mode & S_IFMT) != S_IFREG)
+        continue;
+
+      files->push_back(SearchFile{childPath, &child, znode.size});
+    } catch (const std::exception &ex) {
+      LOG("Error: cannot search %s: %s\n", childPath.c_str(), ex.what());
+    }
+  }
+}
+
+static void collectDirContents(SearchContext &ctx, u64 objid,
+                               const std::string &       path,
+                               INOUT std::vector<SearchFile> *files) {
+  const physical::DNode &dnode = ctx.dslBlock.objectByID(objid);
+  if (dnode.type != DNodeType::DirContents) {
+    LOG("Object %lu is not a directory, cannot search it!\n", objid);
+    return;
+  }
+
+  if (!ctx.visitedDirs.insert(objid).second) {
+    LOG("Directory %lu has been visited already, skipping!\n", objid);
+    return;
+  }
+
+  if (!forEachDirEntryBatch(
+          ctx.reader, ctx.dslBlock, dnode,
+          [&ctx, &path, files](const std::vector<ZapEntry> &entries) {
+            collectDirEntries(ctx, path, entries, INOUT files);
+          }))
+    LOG("Failed to read the ZAP of directory %lu, skipping!\n", objid);
+}
+
+// ---- searching the files ----
+
+// Streams the data blocks of FILE through a matcher. The blocks are read in
+// batches with ZPoolReader::readBatch() rather than through the IndirectBlock,
+// so that only the indirect blocks stay in memory, not the whole file.
+static void searchFile(SearchContext &ctx, const SearchFile &file,
+                       OUT std::vector<SearchMatch> *matches) {
+  IndirectBlock     indirectBlock{ctx.reader, *file.dnode};
+  StreamMatcher     matcher{ctx.patterns};
+  const std::size_t blockSize = indirectBlock.dataBlockSize();
+  std::vector<u8>   zeros;
+
+  const u64 numBlocks =
+      std::min<u64>(indirectBlock.numDataBlocks(),
+                    (file.size + blockSize - 1) / blockSize);
+
+  for (u64 first = 0; first < numBlocks; first += SEARCH_BATCH) {
+    const u64 end = std::min<u64>(numBlocks, first + SEARCH_BATCH);
+
+    std::vector<const physical::Blkptr *> bps;
+    for (u64 blockid = first; blockid < end; blockid++) {
+      const physical::Blkptr *bp = indirectBlock.blkptrByID(blockid);
+
+      // holes read as zeros, see below
+      if (bp && bp->isValid() && (bp->embedded || bp->numCopies() > 0))
+        ctx.reader.prefetch(*bp, /*dva=*/0);
+      else
+        bp = nullptr;
+
+      bps.push_back(bp);
+    }
+
+    std::vector<const physical::Blkptr *> toRead;
+    for (const physical::Blkptr *bp : bps) {
+      if (bp)
+        toRead.push_back(bp);
+    }
+
+    const std::vector<BlockPtr> blocks = ctx.reader.readBatch(toRead);
+
+    std::size_t next = 0;
+    for (u64 blockid = first; blockid < end; blockid++) {
+      const u64         offset = blockid * blockSize;
+      const std::size_t size = static_cast<std::size_t>(
+          std::min<u64>(blockSize, file.size - offset));
+
+      if (!bps[blockid - first]) {
+        zeros.resize(blockSize);
+        matcher.update(zeros.data(), size, INOUT matches);
+        continue;
+      }
+
+      const BlockPtr &block = blocks[next++];
+      if (!block) {
+        std::fprintf(stderr,
+                     "Warning: cannot read block %lu of %s, skipping it\n",
+                     blockid, file.path.c_str());
+        matcher.skip(size);
+        continue;
+      }
+
+      matcher.update(static_cast<const u8 *>(block.data()),
+                     std::min(size, block.size()), INOUT matches);
+    }
+  }
+
+  std::sort(matches->begin(), matches->end(),
+            [](const SearchMatch &lhs, const SearchMatch &rhs) {
+              return lhs.offset < rhs.offset ||
+                     (lhs.offset == rhs.offset && lhs.pattern < rhs.pattern);
+            });
+}
+
+std::size_t searchDirContents(SearchContext &ctx, u64 objid,
+                              unsigned numThreads) {
+  std::vector<SearchFile> files;
+  collectDirContents(ctx, objid, "", INOUT & files);
+  LOG("Searching %zu files\n", files.size());
+
+  const std::size_t threads =
+      std::max<std::size_t>(1, std::min<std::size_t>(numThreads, files.size()));
+
+  std::atomic<std::size_t> nextFile{0};
+  std::atomic<std::size_t> nmatches{0};
+  std::mutex               outMutex; // guards ctx.out
+
+  const auto worker = [&] {
+    std::vector<SearchMatch> matches;
+    std::string              lines;
+
+    for (std::size_t i; (i = nextFile++) < files.size();) {
+      const SearchFile &file = files[i];
+
+      matches.clear();
+      try {
+        searchFile(ctx, file, OUT & matches);
+      } catch (const std::exception &ex) {
+        std::fprintf(stderr, "Warning: cannot search %s: %s\n",
+                     file.path.c_str(), ex.what());
+      }
+
+      if (matches.empty())
+        continue;
+
+      // the lines of a file are written together
+      lines.clear();
+      for (const SearchMatch &match : matches) {
+        char offset[32];
+        std::snprintf(offset, sizeof(offset), "\t%" PRIu64 "\t", match.offset);
+
+        appendPath(ListingFormat::Tsv, file.path, INOUT & lines);
+        lines += offset;
+        appendPath(ListingFormat::Tsv, ctx.patterns[match.pattern],
+                   INOUT & lines);
+        lines += '\n';
+      }
+
+      nmatches += matches.size();
+
+      std::lock_guard<std::mutex> lock{outMutex};
+      std::fwrite(lines.data(), 1, lines.size(), ctx.out);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (std::size_t t = 1; t < threads; t++)
+    pool.emplace_back(worker);
+
+  worker();
+
+  for (std::thread &thread : pool)
+    thread.join();
+
+  return nmatches;
+}
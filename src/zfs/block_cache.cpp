@@ -0,0 +1,70 @@
+#include "utils/log.h"
+
+#include "zfs/block_cache.h"
+
+namespace zfs {
+
+std::shared_ptr<const BlockPtr>
+BlockCache::readUncached(const physical::Blkptr &bp) {
+  BlockPtr block = m_reader->readAnyCopy(bp);
+  if (!block)
+    return nullptr;
+
+  return std::make_shared<const BlockPtr>(std::move(block));
+}
+
+std::shared_ptr<const BlockPtr> BlockCache::read(const physical::Blkptr &bp) {
+  if (!bp.isValid() || bp.numCopies() == 0)
+    return nullptr;
+
+  // decoding these is cheaper than looking them up, and they have no address
+  if (bp.embedded)
+    return readUncached(bp);
+
+  const Key key{bp.dva[0].vdev, bp.dva[0].getAddress(), bp.birth_txg};
+
+  std::promise<std::shared_ptr<const BlockPtr>> promise;
+  Future                                        future;
+  bool                                          owner = false;
+  {
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    auto it = m_blocks.find(key);
+    if (it != m_blocks.end()) {
+      future = it->second;
+    } else {
+      future = promise.get_future().share();
+      m_blocks.emplace(key, future);
+      owner = true;
+    }
+  }
+
+  // whoever inserted the entry reads the block, the others wait for it
+  if (owner)
+    promise.set_value(readUncached(bp));
+
+  return future.get();
+}
+
+std::shared_ptr<const BlockPtr>
+BlockCache::readFirstDataBlock(const physical::DNode &dnode) {
+  if (!dnode.isValid())
+    return nullptr;
+
+  const physical::Blkptr *bp = &dnode.bps[0];
+  for (u8 level = dnode.nlevels; level > 1; level--) {
+    std::shared_ptr<const BlockPtr> indirect = read(*bp);
+    if (!indirect || indirect->size() < sizeof(physical::Blkptr))
+      return nullptr;
+
+    bp = reinterpret_cast<const physical::Blkptr *>(indirect->data());
+    if (!bp->isValid())
+      return nullptr;
+
+    // the parent stays alive in the cache, so BP remains valid
+  }
+
+  return read(*bp);
+}
+
+} // end namespace zfs
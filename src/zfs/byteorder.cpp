@@ -1,36 +1,144 @@
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
 #include "zfs/byteorder.h"
 #include "utils/log.h"
+#include "zfs/physical.h"
 
-namespace zfs {
+// dnode_phys_t::dn_flags
+#define DNODE_FLAG_SPILL_BLKPTR (1u << 2)
 
-void byteswap_uint64_array(void *vbuf, size_t size) {
-  u64 *  buf   = static_cast<u64 *>(vbuf);
-  size_t count = size >> 3;
+namespace zfs {
 
-  ASSERT0((size & 7) == 0);
+static inline u16 bswap(u16 x) { return __builtin_bswap16(x); }
+static inline u32 bswap(u32 x) { return __builtin_bswap32(x); }
+static inline u64 bswap(u64 x) { return __builtin_bswap64(x); }
 
+template <typename T>
+static void byteswapScalar(T *buf, size_t count) {
   for (size_t i = 0; i < count; i++)
-    buf[i]      = BSWAP_64(buf[i]);
+    buf[i] = bswap(buf[i]);
 }
 
-void byteswap_uint32_array(void *vbuf, size_t size) {
-  u32 *  buf   = static_cast<u32 *>(vbuf);
-  size_t count = size >> 2;
+#ifdef HAVE_X86_KERNELS
 
-  ASSERT0((size & 3) == 0);
+// The pshufb mask that reverses the bytes of every T in a 16 byte lane.
+template <typename T>
+static __m128i byteswapMask() {
+  alignas(16) u8 mask[16];
+  for (unsigned i = 0; i < 16; i++) {
+    const unsigned first = i - i % sizeof(T);
+    mask[i] = static_cast<u8>(first + sizeof(T) - 1 - i % sizeof(T));
+  }
 
-  for (size_t i = 0; i < count; i++)
-    buf[i]      = BSWAP_32(buf[i]);
+  return _mm_load_si128(reinterpret_cast<const __m128i *>(mask));
 }
 
-void byteswap_uint16_array(void *vbuf, size_t size) {
-  u16 *  buf   = static_cast<u16 *>(vbuf);
-  size_t count = size >> 1;
+template <typename T>
+__attribute__((target("ssse3"))) static void byteswapSSSE3(T *buf,
+                                                           size_t count) {
+  const __m128i mask   = byteswapMask<T>();
+  const size_t  perVec = sizeof(__m128i) / sizeof(T);
 
-  ASSERT0((size & 1) == 0);
+  u8 *   bytes = reinterpret_cast<u8 *>(buf);
+  size_t i     = 0;
+  for (; i + perVec <= count; i += perVec) {
+    __m128i *p = reinterpret_cast<__m128i *>(bytes + i * sizeof(T));
+    _mm_storeu_si128(p, _mm_shuffle_epi8(_mm_loadu_si128(p), mask));
+  }
 
-  for (size_t i = 0; i < count; i++)
-    buf[i]      = BSWAP_16(buf[i]);
+  byteswapScalar(buf + i, count - i);
+}
+
+template <typename T>
+__attribute__((target("avx2"))) static void byteswapAVX2(T *buf, size_t count) {
+  // vpshufb shuffles within each 16 byte half
+  const __m256i mask   = _mm256_broadcastsi128_si256(byteswapMask<T>());
+  const size_t  perVec = sizeof(__m256i) / sizeof(T);
+
+  u8 *   bytes = reinterpret_cast<u8 *>(buf);
+  size_t i     = 0;
+
+  // 4 vectors at a time, blocks are large
+  for (; i + 4 * perVec <= count; i += 4 * perVec) {
+    __m256i *p = reinterpret_cast<__m256i *>(bytes + i * sizeof(T));
+
+    const __m256i v0 = _mm256_loadu_si256(p);
+    const __m256i v1 = _mm256_loadu_si256(p + 1);
+    const __m256i v2 = _mm256_loadu_si256(p + 2);
+    const __m256i v3 = _mm256_loadu_si256(p + 3);
+    _mm256_storeu_si256(p, _mm256_shuffle_epi8(v0, mask));
+    _mm256_storeu_si256(p + 1, _mm256_shuffle_epi8(v1, mask));
+    _mm256_storeu_si256(p + 2, _mm256_shuffle_epi8(v2, mask));
+    _mm256_storeu_si256(p + 3, _mm256_shuffle_epi8(v3, mask));
+  }
+
+  for (; i + perVec <= count; i += perVec) {
+    __m256i *p = reinterpret_cast<__m256i *>(bytes + i * sizeof(T));
+    _mm256_storeu_si256(p, _mm256_shuffle_epi8(_mm256_loadu_si256(p), mask));
+  }
+
+  byteswapScalar(buf + i, count - i);
+}
+
+#endif // HAVE_X86_KERNELS
+
+enum class SimdLevel { Scalar, SSSE3, AVX2 };
+
+static SimdLevel simdLevel() {
+  static const SimdLevel level = [] {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+      return SimdLevel::SSSE3;
+#endif
+
+    return SimdLevel::Scalar;
+  }();
+
+  return level;
+}
+
+template <typename T>
+static void byteswapArray(void *vbuf, size_t size) {
+  ASSERT0(size % sizeof(T) == 0);
+
+  T *          buf   = static_cast<T *>(vbuf);
+  const size_t count = size / sizeof(T);
+
+  switch (simdLevel()) {
+#ifdef HAVE_X86_KERNELS
+  case SimdLevel::AVX2:
+    byteswapAVX2(buf, count);
+    return;
+
+  case SimdLevel::SSSE3:
+    byteswapSSSE3(buf, count);
+    return;
+#endif
+
+  default:
+    byteswapScalar(buf, count);
+    return;
+  }
+}
+
+void byteswap_uint64_array(void *vbuf, size_t size) {
+  byteswapArray<u64>(vbuf, size);
+}
+
+void byteswap_uint32_array(void *vbuf, size_t size) {
+  byteswapArray<u32>(vbuf, size);
+}
+
+void byteswap_uint16_array(void *vbuf, size_t size) {
+  byteswapArray<u16>(vbuf, size);
 }
 
 void byteswap_uint8_array(void *vbuf, size_t size) {}
@@ -42,4 +150,183 @@ void byteswap_obj(void *obj, size_t obj_size) {
   byteswap_uint64_array(obj, obj_size);
 }
 
+// dnode_byteswap() in dnode.c
+static void byteswapDNode(INOUT physical::DNode *dnode) {
+  if (dnode->type == DNodeType::Invalid)
+    return;
+
+  dnode->datablksecsize = bswap(dnode->datablksecsize);
+  dnode->bonuslen       = bswap(dnode->bonuslen);
+  dnode->max_block_id   = bswap(dnode->max_block_id);
+  dnode->secphys_used   = bswap(dnode->secphys_used);
+
+  // a damaged dnode is left alone after this, it is not going to be used
+  if (dnode->nblkptr == 0 || dnode->nblkptr > 3)
+    return;
+
+  byteswap_uint64_array(dnode->bps, dnode->nblkptr * sizeof(physical::Blkptr));
+
+  const bool hasSpill = dnode->flags & DNODE_FLAG_SPILL_BLKPTR;
+  if (hasSpill)
+    byteswap_uint64_array(&dnode->spill, sizeof(dnode->spill));
+
+  // system attributes are swapped once their layout is known, every other
+  // bonus buffer consists of 64-bit integers
+  if (dnode->bonustype == 0 ||
+      dnode->bonustype == static_cast<u8>(DNodeType::SystemAttributes))
+    return;
+
+  u8 *const bonus = reinterpret_cast<u8 *>(&dnode->bps[dnode->nblkptr]);
+  u8 *const end   = hasSpill ? reinterpret_cast<u8 *>(&dnode->spill)
+                           : reinterpret_cast<u8 *>(dnode + 1);
+  if (bonus < end)
+    byteswap_uint64_array(bonus, static_cast<size_t>(end - bonus));
+}
+
+void byteswap_dnode_array(void *vbuf, size_t size) {
+  auto *dnodes = static_cast<physical::DNode *>(vbuf);
+  for (size_t i = 0; i < size / sizeof(physical::DNode); i++)
+    byteswapDNode(INOUT & dnodes[i]);
+}
+
+// objset_byteswap() in dmu_objset.c
+void byteswap_objset(void *vbuf, size_t size) {
+  auto *objset = static_cast<physical::ObjSet *>(vbuf);
+  if (size < 2 * sizeof(physical::DNode))
+    return;
+
+  // the ZIL header, type and flags are 64-bit integers
+  byteswapDNode(INOUT & objset->metadnode);
+  byteswap_uint64_array(&objset->metadnode + 1, sizeof(physical::DNode));
+
+  // only newer objsets have the user accounting dnodes
+  if (size >= sizeof(physical::ObjSet)) {
+    byteswapDNode(INOUT & objset->userused_dnode);
+    byteswapDNode(INOUT & objset->groupused_dnode);
+  }
+}
+
+// mzap_byteswap() in zap_micro.c
+static void byteswapMicroZap(void *vbuf, size_t size) {
+  auto *header = static_cast<physical::MZapHeader *>(vbuf);
+  byteswap_uint64_array(header, sizeof(physical::MZapHeader));
+
+  for (size_t i = 0; i < physical::MZapHeader::getNumChunks(size); i++) {
+    physical::MZapEntry &entry = header->entries[i];
+    entry.value                = bswap(entry.value);
+    entry.cd                   = bswap(entry.cd);
+  }
+}
+
+// zap_leaf_byteswap() in zap_leaf.c. The integers of names and values are big
+// endian in any case.
+static void byteswapZapLeaf(void *vbuf, size_t size) {
+  auto *header = static_cast<physical::ZapLeafHeader *>(vbuf);
+
+  header->block_type = static_cast<physical::ZapBlockType>(
+      bswap(static_cast<u64>(header->block_type)));
+  header->prefix     = bswap(header->prefix);
+  header->magic      = bswap(header->magic);
+  header->nfree      = bswap(header->nfree);
+  header->nentries   = bswap(header->nentries);
+  header->prefix_len = bswap(header->prefix_len);
+  header->freelist   = bswap(header->freelist);
+
+  // the hash table, then the chunks
+  u8 *const    hash        = static_cast<u8 *>(vbuf) + sizeof(*header);
+  const size_t hashEntries = size / 32;
+  byteswap_uint16_array(hash, hashEntries * sizeof(u16));
+
+  auto *chunks = reinterpret_cast<physical::ZapLeafChunk *>(
+      hash + hashEntries * sizeof(u16));
+  const size_t numChunks =
+      (size - 2 * hashEntries) / ZAP_LEAF_CHUNKSIZE - 2;
+
+  for (size_t i = 0; i < numChunks; i++) {
+    physical::ZapLeafChunk &chunk = chunks[i];
+
+    switch (chunk.type) {
+    case physical::ZapChunkType::Entry:
+      chunk.entry.next          = bswap(chunk.entry.next);
+      chunk.entry.name_chunk    = bswap(chunk.entry.name_chunk);
+      chunk.entry.name_numints  = bswap(chunk.entry.name_numints);
+      chunk.entry.value_chunk   = bswap(chunk.entry.value_chunk);
+      chunk.entry.value_numints = bswap(chunk.entry.value_numints);
+      chunk.entry.cd            = bswap(chunk.entry.cd);
+      chunk.entry.hash          = bswap(chunk.entry.hash);
+      break;
+
+    case physical::ZapChunkType::Array:
+    case physical::ZapChunkType::Free:
+      // the free chunks have their next in the same place
+      chunk.array.next = bswap(chunk.array.next);
+      break;
+
+    default:
+      break;
+    }
+  }
+}
+
+// zap_byteswap() in zap.c
+void byteswap_zap(void *vbuf, size_t size) {
+  if (size < sizeof(u64))
+    return;
+
+  switch (bswap(*static_cast<const u64 *>(vbuf))) {
+  case physical::ZapBlockType::Micro:
+    byteswapMicroZap(vbuf, size);
+    break;
+
+  case physical::ZapBlockType::Leaf:
+    byteswapZapLeaf(vbuf, size);
+    break;
+
+  default:
+    // the header block, with the embedded pointer table, and the blocks of an
+    // external pointer table are 64-bit integers only
+    byteswap_uint64_array(vbuf, size - size % sizeof(u64));
+    break;
+  }
+}
+
+void byteswap_block(DNodeType type, u8 level, void *vbuf, size_t size) {
+  // indirect blocks are block pointers, whatever the type of their object
+  if (level > 0) {
+    byteswap_uint64_array(vbuf, size - size % sizeof(u64));
+    return;
+  }
+
+  switch (type) {
+  case DNodeType::DNode:
+    byteswap_dnode_array(vbuf, size);
+    break;
+
+  case DNodeType::ObjSet:
+    byteswap_objset(vbuf, size);
+    break;
+
+  case DNodeType::ObjDirectory:
+  case DNodeType::DSLDirChildMap:
+  case DNodeType::DSLDataSetSnapMap:
+  case DNodeType::DSLProps:
+  case DNodeType::DirContents:
+  case DNodeType::MasterNode:
+  case DNodeType::SaMasterNode:
+  case DNodeType::SaRegistry:
+  case DNodeType::SaLayouts:
+    byteswap_zap(vbuf, size);
+    break;
+
+  case DNodeType::ObjectArray:
+  case DNodeType::SpaceMap:
+    byteswap_uint64_array(vbuf, size - size % sizeof(u64));
+    break;
+
+  default:
+    // file contents and everything unknown are left as they are
+    break;
+  }
+}
+
 } // end namespace zfs
@@ -0,0 +1,570 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "lz4.h"
+
+#include "utils/log.h"
+
+#include "zfs/carve.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/physical/mzap.h"
+#include "zfs/physical/objset.h"
+
+// the amount of the device a thread scans at once, a multiple of
+// DNODE_BLOCK_SIZE
+#define CARVE_CHUNK (MB * 16)
+
+// what is read past the end of a chunk, so that the blocks starting near its
+// end can be checked whole
+#define CARVE_OVERLAP (KB * 128 + SECTOR_SIZE)
+
+// dnode arrays are made of blocks of this size, see DNODE_BLOCK_SHIFT
+#define DNODE_BLOCK_SIZE (KB * 16)
+
+// the largest block, see SPA_OLD_MAXBLOCKSIZE
+#define CARVE_MAX_BLOCK_SIZE (KB * 128)
+
+// what is decompressed of an LZ4 candidate before it is checked, enough for an
+// objset
+#define CARVE_LZ4_PEEK sizeof(physical::ObjSet)
+
+// the sector flags
+#define SECTOR_MZAP 1u
+#define SECTOR_DNODE 2u
+#define SECTOR_LZ4 4u
+
+namespace zfs {
+
+namespace {
+
+enum class CarveKind { MicroZap, DNodes, ObjSet };
+
+struct CarveHit {
+  u64       offset;
+  CarveKind kind;
+  u32       lz4Size; // the compressed size, 0 if not compressed
+  u64       count;   // entries of a micro ZAP, dnodes of a run
+  u64       detail;  // the type of the first dnode, or of the objset
+};
+
+} // end anonymous namespace
+
+// ---- the vectorised test of the first 8 bytes of every sector ----
+
+// The byte ranges a dnode starts with: type, indblkshift, nlevels and nblkptr.
+static const u8 DNODE_LOW[8]   = {1, 12, 1, 1, 0, 0, 0, 0};
+static const u8 DNODE_RANGE[8] = {62, 5, 5, 2, 255, 255, 255, 255};
+
+// An LZ4 block starts with its big endian compressed size, which is below
+// CARVE_MAX_BLOCK_SIZE and not 0.
+static const u8 LZ4_LOW[8]   = {0, 0, 0, 0, 0, 0, 0, 0};
+static const u8 LZ4_RANGE[8] = {0, 1, 255, 255, 255, 255, 255, 255};
+
+static bool inRanges(u64 word, const u8 low[8], const u8 range[8]) {
+  for (unsigned i = 0; i < 8; i++) {
+    const u8 byte = static_cast<u8>(word >> (8 * i));
+    if (static_cast<u8>(byte - low[i]) > range[i])
+      return false;
+  }
+
+  return true;
+}
+
+static u8 sectorFlags(u64 word) {
+  u8 flags = 0;
+  if (word == physical::ZapBlockType::Micro)
+    flags |= SECTOR_MZAP;
+  if (inRanges(word, DNODE_LOW, DNODE_RANGE))
+    flags |= SECTOR_DNODE;
+  if ((word & 0xffffffff) != 0 && inRanges(word, LZ4_LOW, LZ4_RANGE))
+    flags |= SECTOR_LZ4;
+
+  return flags;
+}
+
+// Sets the flags of the NUM sectors at DATA.
+using SectorFlagsFn = void (*)(const u8 *data, std::size_t num, OUT u8 *flags);
+
+static void sectorFlagsScalar(const u8 *data, std::size_t num, OUT u8 *flags) {
+  for (std::size_t i = 0; i < num; i++) {
+    u64 word;
+    std::memcpy(&word, data + i * SECTOR_SIZE, sizeof(word));
+    flags[i] = sectorFlags(word);
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Whether every byte of the 64-bit lanes of X is in its range, as a lane mask.
+__attribute__((target("avx2"))) static __m256i
+inRangesAVX2(__m256i x, const u8 low[8], const u8 range[8]) {
+  u64 lowWord, rangeWord;
+  std::memcpy(&lowWord, low, sizeof(lowWord));
+  std::memcpy(&rangeWord, range, sizeof(rangeWord));
+
+  const __m256i rangeVec =
+      _mm256_set1_epi64x(static_cast<long long>(rangeWord));
+  const __m256i t =
+      _mm256_sub_epi8(x, _mm256_set1_epi64x(static_cast<long long>(lowWord)));
+
+  // unsigned t <= range, for every byte
+  const __m256i ok = _mm256_cmpeq_epi8(_mm256_min_epu8(t, rangeVec), t);
+  return _mm256_cmpeq_epi64(ok, _mm256_set1_epi64x(-1));
+}
+
+// Tests 4 sectors at a time, gathering their first words.
+__attribute__((target("avx2"))) static void
+sectorFlagsAVX2(const u8 *data, std::size_t num, OUT u8 *flags) {
+  const __m256i offsets =
+      _mm256_set_epi64x(3 * SECTOR_SIZE, 2 * SECTOR_SIZE, SECTOR_SIZE, 0);
+  const __m256i micro = _mm256_set1_epi64x(
+      static_cast<long long>(physical::ZapBlockType::Micro));
+  const __m256i low32 = _mm256_set1_epi64x(0xffffffff);
+  const __m256i zero  = _mm256_setzero_si256();
+
+  std::size_t i = 0;
+  for (; i + 4 <= num; i += 4) {
+    const __m256i words = _mm256_i64gather_epi64(
+        reinterpret_cast<const long long *>(data + i * SECTOR_SIZE), offsets,
+        1);
+
+    const __m256i mzap  = _mm256_cmpeq_epi64(words, micro);
+    const __m256i dnode = inRangesAVX2(words, DNODE_LOW, DNODE_RANGE);
+    const __m256i lz4   = _mm256_andnot_si256(
+        _mm256_cmpeq_epi64(_mm256_and_si256(words, low32), zero),
+        inRangesAVX2(words, LZ4_LOW, LZ4_RANGE));
+
+    const int mzapBits  = _mm256_movemask_pd(_mm256_castsi256_pd(mzap));
+    const int dnodeBits = _mm256_movemask_pd(_mm256_castsi256_pd(dnode));
+    const int lz4Bits   = _mm256_movemask_pd(_mm256_castsi256_pd(lz4));
+
+    for (unsigned j = 0; j < 4; j++) {
+      flags[i + j] = static_cast<u8>((((mzapBits >> j) & 1) * SECTOR_MZAP) |
+                                     (((dnodeBits >> j) & 1) * SECTOR_DNODE) |
+                                     (((lz4Bits >> j) & 1) * SECTOR_LZ4));
+    }
+  }
+
+  sectorFlagsScalar(data + i * SECTOR_SIZE, num - i, OUT flags + i);
+}
+
+#endif // HAVE_X86_KERNELS
+
+static SectorFlagsFn sectorFlagsFn() {
+  static const SectorFlagsFn fastest = [] {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return static_cast<SectorFlagsFn>(sectorFlagsAVX2);
+#endif
+
+    return static_cast<SectorFlagsFn>(sectorFlagsScalar);
+  }();
+
+  return fastest;
+}
+
+// ---- the checks of the candidates ----
+
+static bool isZeroSector(const u8 *data) {
+  static const u8 zeros[SECTOR_SIZE] = {};
+  return std::memcmp(data, zeros, SECTOR_SIZE) == 0;
+}
+
+static bool isDNode(const u8 *data) {
+  const auto &dnode = *reinterpret_cast<const physical::DNode *>(data);
+  return dnode.isValid() && dnode.indblkshift >= 12 &&
+         dnode.indblkshift <= 17 && dnode.nlevels >= 1 && dnode.nlevels <= 6 &&
+         dnode.datablksecsize != 0 &&
+         dnode.bonuslen <= sizeof(physical::DNode::bonus);
+}
+
+// SIZE bytes are available at DATA.
+static bool isObjSet(const u8 *data, std::size_t size) {
+  if (size < 2 * SECTOR_SIZE || !isDNode(data))
+    return false;
+
+  const auto &objset = *reinterpret_cast<const physical::ObjSet *>(data);
+  if (!objset.isValid() || objset.metadnode.type != DNodeType::DNode ||
+      objset.type == 0 || objset.type > 3 || objset.flags > 0xff)
+    return false;
+
+  // the padding after the flags and the two MACs of encrypted datasets
+  const u8 *pad = data + offsetof(physical::ObjSet, flags) + sizeof(u64) + 64;
+  return std::all_of(pad, data + 2 * SECTOR_SIZE,
+                     [](u8 byte) { return byte == 0; });
+}
+
+// Returns the number of entries of the micro ZAP at DATA, or -1 if it is not
+// one.
+static long microZapEntries(const u8 *data, std::size_t size) {
+  const auto &header = *reinterpret_cast<const physical::MZapHeader *>(data);
+  if (size < SECTOR_SIZE || !header.isValid() || header.salt == 0 ||
+      header.normflags > 0xf)
+    return -1;
+
+  const u8 *pad = data + offsetof(physical::MZapHeader, normflags) + 8;
+  if (!std::all_of(pad, data + sizeof(physical::MZapHeader),
+                   [](u8 byte) { return byte == 0; }))
+    return -1;
+
+  // the block size is not known, so entries are counted as long as they look
+  // like entries
+  const std::size_t maxChunks = physical::MZapHeader::getNumChunks(
+      std::min<std::size_t>(size, CARVE_MAX_BLOCK_SIZE));
+
+  long count = 0;
+  for (std::size_t i = 0; i < maxChunks; i++) {
+    const physical::MZapEntry &entry = header.entries[i];
+    if (!std::memchr(entry.name, '\0', sizeof(entry.name)))
+      break;
+
+    if (entry.isValid())
+      count++;
+  }
+
+  return count;
+}
+
+// Checks a block that has been decompressed, SIZE bytes at DATA.
+static bool carveDecompressed(const u8 *data, std::size_t size, u64 offset,
+                              u32 lz4Size, OUT CarveHit *hit) {
+  if (isObjSet(data, size)) {
+    const auto &objset = *reinterpret_cast<const physical::ObjSet *>(data);
+    *hit = CarveHit{offset, CarveKind::ObjSet, lz4Size, 1, objset.type};
+    return true;
+  }
+
+  const long entries = microZapEntries(data, size);
+  if (entries >= 0) {
+    *hit = CarveHit{offset, CarveKind::MicroZap, lz4Size,
+                    static_cast<u64>(entries), 0};
+    return true;
+  }
+
+  u64 count = 0;
+  u64 type  = 0;
+  for (std::size_t i = 0; i + SECTOR_SIZE <= size; i += SECTOR_SIZE) {
+    if (isDNode(data + i)) {
+      if (count++ == 0)
+        type = data[i];
+    } else if (!isZeroSector(data + i)) {
+      return false;
+    }
+  }
+
+  if (count == 0)
+    return false;
+
+  *hit = CarveHit{offset, CarveKind::DNodes, lz4Size, count, type};
+  return true;
+}
+
+// Checks whether DATA, with SIZE bytes available, is an LZ4 compressed block
+// holding one of the structures. Only the beginning is decompressed until that
+// looks right.
+static bool carveLZ4(const u8 *data, std::size_t size, u64 offset,
+                     OUT CarveHit *hit) {
+  const u32 compressedSize = (static_cast<u32>(data[0]) << 24) |
+                             (static_cast<u32>(data[1]) << 16) |
+                             (static_cast<u32>(data[2]) << 8) | data[3];
+  if (compressedSize < 16 ||
+      compressedSize + sizeof(u32) > std::min<std::size_t>(
+                                         size, CARVE_MAX_BLOCK_SIZE))
+    return false;
+
+  thread_local std::vector<u8> buffer(CARVE_MAX_BLOCK_SIZE);
+
+  const char *src = reinterpret_cast<const char *>(data + sizeof(u32));
+  char *      dst = reinterpret_cast<char *>(buffer.data());
+
+  const int peeked = LZ4_decompress_safe_partial(
+      src, dst, static_cast<int>(compressedSize),
+      static_cast<int>(CARVE_LZ4_PEEK), CARVE_MAX_BLOCK_SIZE);
+  if (peeked < static_cast<int>(SECTOR_SIZE))
+    return false;
+
+  // the first dnode of a dnode array is often free, hence zero
+  bool plausible = false;
+  for (int i = 0; i + static_cast<int>(SECTOR_SIZE) <= peeked;
+       i += SECTOR_SIZE) {
+    const u8 *sector = buffer.data() + i;
+    u64       word;
+    std::memcpy(&word, sector, sizeof(word));
+
+    plausible = sectorFlags(word) & (SECTOR_MZAP | SECTOR_DNODE);
+    if (plausible || !isZeroSector(sector))
+      break;
+  }
+
+  if (!plausible)
+    return false;
+
+  // the whole block has to decompress, and be made of whole sectors
+  const int lsize = LZ4_decompress_safe(
+      src, dst, static_cast<int>(compressedSize), CARVE_MAX_BLOCK_SIZE);
+  if (lsize <= 0 || lsize % SECTOR_SIZE != 0)
+    return false;
+
+  return carveDecompressed(buffer.data(), static_cast<std::size_t>(lsize),
+                           offset, compressedSize, OUT hit);
+}
+
+// ---- scanning ----
+
+// Scans the chunk at OFFSET. DATA holds SIZE bytes of the chunk itself followed
+// by what could be read of the overlap.
+static void carveChunk(const u8 *data, std::size_t size, std::size_t available,
+                       u64 offset, INOUT std::vector<u8> *flags,
+                       OUT std::vector<CarveHit> *hits) {
+  const std::size_t numSectors = size / SECTOR_SIZE;
+  flags->resize(numSectors);
+  sectorFlagsFn()(data, numSectors, OUT flags->data());
+
+  // the run of dnodes being collected, if COUNT > 0
+  CarveHit run{0, CarveKind::DNodes, 0, 0, 0};
+
+  const auto closeRun = [&] {
+    if (run.count > 0)
+      hits->push_back(run);
+    run.count = 0;
+  };
+
+  for (std::size_t i = 0; i < numSectors; i++) {
+    const u8 *const sector       = data + i * SECTOR_SIZE;
+    const u64       sectorOffset = offset + i * SECTOR_SIZE;
+    const u8        sectorFlags  = (*flags)[i];
+
+    // runs do not span dnode blocks, so that where they end does not depend
+    // on where the chunks start
+    if (sectorOffset % DNODE_BLOCK_SIZE == 0)
+      closeRun();
+
+    if (sectorFlags & SECTOR_DNODE) {
+      if (isObjSet(sector, available - i * SECTOR_SIZE)) {
+        closeRun();
+        const auto &objset =
+            *reinterpret_cast<const physical::ObjSet *>(sector);
+        hits->push_back(
+            CarveHit{sectorOffset, CarveKind::ObjSet, 0, 1, objset.type});
+        continue;
+      }
+
+      if (isDNode(sector)) {
+        if (run.count++ == 0) {
+          run.offset = sectorOffset;
+          run.detail = sector[0];
+        }
+        continue;
+      }
+    }
+
+    // free dnodes are zeroed
+    if (run.count > 0 && sectorFlags == 0 && isZeroSector(sector))
+      continue;
+
+    closeRun();
+
+    if (sectorFlags & SECTOR_MZAP) {
+      const long entries =
+          microZapEntries(sector, available - i * SECTOR_SIZE);
+      if (entries >= 0) {
+        hits->push_back(CarveHit{sectorOffset, CarveKind::MicroZap, 0,
+                                 static_cast<u64>(entries), 0});
+        continue;
+      }
+    }
+
+    CarveHit hit;
+    if ((sectorFlags & SECTOR_LZ4) &&
+        carveLZ4(sector, available - i * SECTOR_SIZE, sectorOffset,
+                 OUT & hit)) {
+      hits->push_back(hit);
+
+      // the rest of the compressed block cannot hold anything else
+      i += (sizeof(u32) + hit.lz4Size - 1) / SECTOR_SIZE;
+    }
+  }
+
+  closeRun();
+}
+
+static const char *carveKindName(CarveKind kind) {
+  switch (kind) {
+  case CarveKind::MicroZap:
+    return "mzap";
+  case CarveKind::DNodes:
+    return "dnodes";
+  case CarveKind::ObjSet:
+    return "objset";
+  }
+
+  return "?";
+}
+
+static void formatHits(const std::vector<CarveHit> &hits,
+                       INOUT std::string *lines, INOUT CarveResult *result) {
+  for (const CarveHit &hit : hits) {
+    char line[128];
+    if (hit.lz4Size)
+      std::snprintf(line, sizeof(line), "0x%lx\t%s\tlz4:%u\t%lu\t%lu\n",
+                    hit.offset, carveKindName(hit.kind), hit.lz4Size,
+                    hit.count, hit.detail);
+    else
+      std::snprintf(line, sizeof(line), "0x%lx\t%s\tplain\t%lu\t%lu\n",
+                    hit.offset, carveKindName(hit.kind), hit.count,
+                    hit.detail);
+    *lines += line;
+
+    switch (hit.kind) {
+    case CarveKind::MicroZap:
+      result->microZaps++;
+      break;
+    case CarveKind::DNodes:
+      result->dnodes++;
+      break;
+    case CarveKind::ObjSet:
+      result->objsets++;
+      break;
+    }
+
+    if (hit.lz4Size)
+      result->lz4++;
+  }
+}
+
+// A part of the device that is scanned at once.
+struct CarveChunk {
+  u64         offset;
+  std::size_t size;     // at most CARVE_CHUNK
+  std::size_t readSize; // with the overlap, if the extent goes on
+};
+
+// Splits EXTENTS into chunks, in order. The extents are shrunk to whole
+// sectors.
+static std::vector<CarveChunk> carveChunks(const std::vector<Extent> &extents,
+                                           OUT u64 *bytes) {
+  std::vector<CarveChunk> chunks;
+  *bytes = 0;
+
+  for (const Extent &extent : extents) {
+    const u64 start = (extent.start + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+    const u64 end   = extent.end & ~(SECTOR_SIZE - 1);
+    if (start >= end)
+      continue;
+
+    *bytes += end - start;
+
+    for (u64 offset = start; offset < end; offset += CARVE_CHUNK) {
+      const u64 left = end - offset;
+      chunks.push_back(CarveChunk{
+          offset, static_cast<std::size_t>(std::min<u64>(left, CARVE_CHUNK)),
+          static_cast<std::size_t>(
+              std::min<u64>(left, CARVE_CHUNK + CARVE_OVERLAP))});
+    }
+  }
+
+  return chunks;
+}
+
+CarveResult carveImage(ZPoolReader &reader, std::FILE *catalog,
+                       unsigned                   numThreads,
+                       const std::vector<Extent> *extents) {
+  const auto start = std::chrono::steady_clock::now();
+
+  CarveResult                   result;
+  const std::vector<CarveChunk> chunks =
+      carveChunks(extents ? *extents
+                          : std::vector<Extent>{{0, reader.deviceSize()}},
+                  OUT & result.bytes);
+
+  const std::size_t numChunks = chunks.size();
+  const std::size_t threads   = std::max<std::size_t>(
+      1, std::min<std::size_t>(numThreads, numChunks));
+
+  // the chunks are handed out in order, and their lines written in order:
+  // the ones finished early wait in PENDING
+  std::atomic<std::size_t>           nextChunk{0};
+  std::mutex                         mutex; // guards the rest
+  std::size_t                        nextWrite = 0;
+  std::map<std::size_t, std::string> pending;
+
+  const auto worker = [&] {
+    std::vector<u8>       buffer(CARVE_CHUNK + CARVE_OVERLAP);
+    std::vector<u8>       flags;
+    std::vector<CarveHit> hits;
+    CarveResult           counts;
+
+    for (std::size_t chunk; (chunk = nextChunk++) < numChunks;) {
+      const u64         offset = chunks[chunk].offset;
+      const std::size_t available =
+          reader.readRaw(offset, chunks[chunk].readSize, OUT buffer.data());
+      const std::size_t size =
+          std::min(available, chunks[chunk].size) & ~(SECTOR_SIZE - 1);
+
+      if (size < chunks[chunk].size)
+        std::fprintf(stderr, "Warning: could only read %zu bytes at 0x%lx\n",
+                     size, offset);
+
+      hits.clear();
+      carveChunk(buffer.data(), size, available, offset, INOUT & flags,
+                 OUT & hits);
+
+      std::string lines;
+      formatHits(hits, INOUT & lines, INOUT & counts);
+
+      std::lock_guard<std::mutex> lock{mutex};
+      pending.emplace(chunk, std::move(lines));
+      for (auto it = pending.begin();
+           it != pending.end() && it->first == nextWrite;
+           it = pending.erase(it), nextWrite++)
+        std::fwrite(it->second.data(), 1, it->second.size(), catalog);
+    }
+
+    std::lock_guard<std::mutex> lock{mutex};
+    result.microZaps += counts.microZaps;
+    result.dnodes += counts.dnodes;
+    result.objsets += counts.objsets;
+    result.lz4 += counts.lz4;
+  };
+
+  std::vector<std::thread> pool;
+  for (std::size_t t = 1; t < threads; t++)
+    pool.emplace_back(worker);
+
+  worker();
+
+  for (std::thread &thread : pool)
+    thread.join();
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  result.seconds = elapsed.count();
+
+  return result;
+}
+
+void printCarveReport(std::FILE *fp, const CarveResult &result) {
+  const double mb = static_cast<double>(result.bytes) / MB;
+
+  std::fprintf(fp, "Scanned %.1f MB in %.1f s (%.1f MB/s)\n", mb,
+               result.seconds, result.seconds > 0 ? mb / result.seconds : 0.0);
+  std::fprintf(fp, "  %lu micro ZAPs\n", result.microZaps);
+  std::fprintf(fp, "  %lu runs of dnodes\n", result.dnodes);
+  std::fprintf(fp, "  %lu objsets\n", result.objsets);
+  std::fprintf(fp, "  %lu of them LZ4 compressed\n", result.lz4);
+}
+
+} // end namespace zfs
@@ -0,0 +1,746 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "utils/log.h"
+
+#include "zfs/byteorder.h"
+#include "zfs/checksum.h"
+
+namespace zfs {
+
+// Continues a fletcher4 checksum over NWORDS more words.
+static void fletcher4Update(const u32 *words, std::size_t nwords,
+                            INOUT u64 cksum[4]) {
+  u64 a = cksum[0], b = cksum[1], c = cksum[2], d = cksum[3];
+
+  for (std::size_t i = 0; i < nwords; i++) {
+    a += words[i];
+    b += a;
+    c += b;
+    d += c;
+  }
+
+  cksum[0] = a;
+  cksum[1] = b;
+  cksum[2] = c;
+  cksum[3] = d;
+}
+
+void fletcher4Scalar(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  ASSERT(size % sizeof(u32) == 0, "Invalid fletcher4 size: %zu", size);
+
+  cksum[0] = cksum[1] = cksum[2] = cksum[3] = 0;
+  fletcher4Update(static_cast<const u32 *>(data), size / sizeof(u32),
+                  INOUT cksum);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Combines the sums of LANES lanes, where lane j has summed up the words j,
+// j + LANES, j + 2 * LANES, ..., into the checksum of all the words.
+// Word k is weighted by 1, m, m(m+1)/2 and m(m+1)(m+2)/6 in the four sums,
+// m being the number of words from k to the end, and these weights are
+// polynomials in the position within the lane, which lets the lane sums be
+// reweighted (like fletcher_4_avx2_fini() does for 4 lanes).
+static void fletcher4Combine(u64 lanes, const u64 *a, const u64 *b,
+                             const u64 *c, const u64 *d, OUT u64 cksum[4]) {
+  const u64 n = lanes;
+
+  cksum[0] = cksum[1] = cksum[2] = cksum[3] = 0;
+  for (u64 j = 0; j < n; j++) {
+    cksum[0] += a[j];
+    cksum[1] += n * b[j] - j * a[j];
+    cksum[2] += n * n * c[j] - n * (n + 2 * j - 1) / 2 * b[j] +
+                j * (j - 1) / 2 * a[j];
+    cksum[3] += n * n * n * d[j] - n * n * (n + j - 1) * c[j] +
+                (n * (n - 1) * (n - 2) / 6 + n * j * (n + j - 2) / 2) * b[j] -
+                j * (j - 1) * (j - 2) / 6 * a[j];
+  }
+}
+
+__attribute__((target("sse2"))) void
+fletcher4SSE2(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  ASSERT(size % sizeof(u32) == 0, "Invalid fletcher4 size: %zu", size);
+
+  const u32 *       words  = static_cast<const u32 *>(data);
+  const std::size_t nwords = size / sizeof(u32);
+  const std::size_t nvec   = nwords / 4;
+
+  // 2 lanes, fed from the low and the high half of each 4 word load
+  const __m128i zero = _mm_setzero_si128();
+  __m128i       a = zero, b = zero, c = zero, d = zero;
+
+  for (std::size_t i = 0; i < nvec; i++) {
+    const __m128i w =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + 4 * i));
+
+    const __m128i lo = _mm_unpacklo_epi32(w, zero);
+    a                = _mm_add_epi64(a, lo);
+    b                = _mm_add_epi64(b, a);
+    c                = _mm_add_epi64(c, b);
+    d                = _mm_add_epi64(d, c);
+
+    const __m128i hi = _mm_unpackhi_epi32(w, zero);
+    a                = _mm_add_epi64(a, hi);
+    b                = _mm_add_epi64(b, a);
+    c                = _mm_add_epi64(c, b);
+    d                = _mm_add_epi64(d, c);
+  }
+
+  alignas(16) u64 la[2], lb[2], lc[2], ld[2];
+  _mm_store_si128(reinterpret_cast<__m128i *>(la), a);
+  _mm_store_si128(reinterpret_cast<__m128i *>(lb), b);
+  _mm_store_si128(reinterpret_cast<__m128i *>(lc), c);
+  _mm_store_si128(reinterpret_cast<__m128i *>(ld), d);
+
+  fletcher4Combine(2, la, lb, lc, ld, OUT cksum);
+  fletcher4Update(words + 4 * nvec, nwords - 4 * nvec, INOUT cksum);
+}
+
+__attribute__((target("avx2"))) void
+fletcher4AVX2(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  ASSERT(size % sizeof(u32) == 0, "Invalid fletcher4 size: %zu", size);
+
+  const u32 *       words  = static_cast<const u32 *>(data);
+  const std::size_t nwords = size / sizeof(u32);
+  const std::size_t nvec   = nwords / 4;
+
+  __m256i a = _mm256_setzero_si256(), b = a, c = a, d = a;
+
+  for (std::size_t i = 0; i < nvec; i++) {
+    const __m256i w = _mm256_cvtepu32_epi64(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(words + 4 * i)));
+
+    a = _mm256_add_epi64(a, w);
+    b = _mm256_add_epi64(b, a);
+    c = _mm256_add_epi64(c, b);
+    d = _mm256_add_epi64(d, c);
+  }
+
+  alignas(32) u64 la[4], lb[4], lc[4], ld[4];
+  _mm256_store_si256(reinterpret_cast<__m256i *>(la), a);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lb), b);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(lc), c);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(ld), d);
+
+  fletcher4Combine(4, la, lb, lc, ld, OUT cksum);
+  fletcher4Update(words + 4 * nvec, nwords - 4 * nvec, INOUT cksum);
+}
+
+__attribute__((target("avx512f"))) void
+fletcher4AVX512(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  ASSERT(size % sizeof(u32) == 0, "Invalid fletcher4 size: %zu", size);
+
+  const u32 *       words  = static_cast<const u32 *>(data);
+  const std::size_t nwords = size / sizeof(u32);
+  const std::size_t nvec   = nwords / 8;
+
+  __m512i a = _mm512_setzero_si512(), b = a, c = a, d = a;
+
+  for (std::size_t i = 0; i < nvec; i++) {
+    const __m512i w = _mm512_cvtepu32_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + 8 * i)));
+
+    a = _mm512_add_epi64(a, w);
+    b = _mm512_add_epi64(b, a);
+    c = _mm512_add_epi64(c, b);
+    d = _mm512_add_epi64(d, c);
+  }
+
+  alignas(64) u64 la[8], lb[8], lc[8], ld[8];
+  _mm512_store_si512(la, a);
+  _mm512_store_si512(lb, b);
+  _mm512_store_si512(lc, c);
+  _mm512_store_si512(ld, d);
+
+  fletcher4Combine(8, la, lb, lc, ld, OUT cksum);
+  fletcher4Update(words + 8 * nvec, nwords - 8 * nvec, INOUT cksum);
+}
+
+#else // !HAVE_X86_KERNELS
+
+void fletcher4SSE2(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  fletcher4Scalar(data, size, OUT cksum);
+}
+
+void fletcher4AVX2(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  fletcher4Scalar(data, size, OUT cksum);
+}
+
+void fletcher4AVX512(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  fletcher4Scalar(data, size, OUT cksum);
+}
+
+#endif // HAVE_X86_KERNELS
+
+const std::vector<Fletcher4Impl> &fletcher4Implementations() {
+  static const std::vector<Fletcher4Impl> impls = [] {
+    std::vector<Fletcher4Impl> result;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+      result.push_back(Fletcher4Impl{"avx512", fletcher4AVX512});
+    if (__builtin_cpu_supports("avx2"))
+      result.push_back(Fletcher4Impl{"avx2", fletcher4AVX2});
+    if (__builtin_cpu_supports("sse2"))
+      result.push_back(Fletcher4Impl{"sse2", fletcher4SSE2});
+#endif
+
+    result.push_back(Fletcher4Impl{"scalar", fletcher4Scalar});
+    return result;
+  }();
+
+  return impls;
+}
+
+void fletcher4(const void *data, std::size_t size, OUT u64 cksum[4]) {
+  static const Fletcher4Fn fastest = fletcher4Implementations().front().fn;
+  fastest(data, size, OUT cksum);
+}
+
+// ---- SHA-256 ----
+
+#define SHA256_BLOCK_SIZE 64
+
+static const u32 SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static const u32 SHA256_H0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+
+// Processes NBLOCKS whole 64 byte blocks of DATA.
+using Sha256BlocksFn = void (*)(INOUT u32 state[8], const u8 *data,
+                                std::size_t nblocks);
+
+static inline u32 loadBE32(const u8 *p) {
+  return (static_cast<u32>(p[0]) << 24) | (static_cast<u32>(p[1]) << 16) |
+         (static_cast<u32>(p[2]) << 8) | p[3];
+}
+
+static inline void storeBE32(u32 value, OUT u8 *p) {
+  p[0] = static_cast<u8>(value >> 24);
+  p[1] = static_cast<u8>(value >> 16);
+  p[2] = static_cast<u8>(value >> 8);
+  p[3] = static_cast<u8>(value);
+}
+
+static inline u32 rotr32(u32 x, unsigned n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256BlocksScalar(INOUT u32 state[8], const u8 *data,
+                               std::size_t nblocks) {
+  for (; nblocks > 0; nblocks--, data += SHA256_BLOCK_SIZE) {
+    u32 w[64];
+    for (unsigned t = 0; t < 16; t++)
+      w[t] = loadBE32(data + 4 * t);
+
+    for (unsigned t = 16; t < 64; t++) {
+      const u32 s0 =
+          rotr32(w[t - 15], 7) ^ rotr32(w[t - 15], 18) ^ (w[t - 15] >> 3);
+      const u32 s1 =
+          rotr32(w[t - 2], 17) ^ rotr32(w[t - 2], 19) ^ (w[t - 2] >> 10);
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+
+    u32 a = state[0], b = state[1], c = state[2], d = state[3];
+    u32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (unsigned t = 0; t < 64; t++) {
+      const u32 s1  = rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25);
+      const u32 ch  = (e & f) ^ (~e & g);
+      const u32 t1  = h + s1 + ch + SHA256_K[t] + w[t];
+      const u32 s0  = rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22);
+      const u32 maj = (a & b) ^ (a & c) ^ (b & c);
+      const u32 t2  = s0 + maj;
+
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+// Pads the end of a SIZE byte message the way SHA-256 requires, into one or
+// two blocks in TAIL. REST is the incomplete block at the end of the message,
+// SIZE % 64 bytes long. Returns the number of blocks.
+static std::size_t sha256Tail(const u8 *rest, u64 size,
+                              OUT u8 tail[2 * SHA256_BLOCK_SIZE]) {
+  const std::size_t restSize = size % SHA256_BLOCK_SIZE;
+  const std::size_t nblocks =
+      restSize + 1 + sizeof(u64) <= SHA256_BLOCK_SIZE ? 1 : 2;
+
+  std::memset(tail, 0, nblocks * SHA256_BLOCK_SIZE);
+  std::memcpy(tail, rest, restSize);
+  tail[restSize] = 0x80;
+
+  const u64 bits = static_cast<u64>(size) * 8;
+  u8 *      end  = tail + nblocks * SHA256_BLOCK_SIZE;
+  storeBE32(static_cast<u32>(bits >> 32), OUT end - 8);
+  storeBE32(static_cast<u32>(bits), OUT end - 4);
+
+  return nblocks;
+}
+
+static void sha256With(Sha256BlocksFn blocks, const void *data,
+                       std::size_t size, OUT u8 digest[32]) {
+  const u8 *bytes = static_cast<const u8 *>(data);
+
+  u32 state[8];
+  std::memcpy(state, SHA256_H0, sizeof(state));
+  blocks(INOUT state, bytes, size / SHA256_BLOCK_SIZE);
+
+  u8 tail[2 * SHA256_BLOCK_SIZE];
+  blocks(INOUT state, tail,
+         sha256Tail(bytes + size - size % SHA256_BLOCK_SIZE, size, OUT tail));
+
+  for (unsigned i = 0; i < 8; i++)
+    storeBE32(state[i], OUT digest + 4 * i);
+}
+
+void sha256Scalar(const void *data, std::size_t size, OUT u8 digest[32]) {
+  sha256With(sha256BlocksScalar, data, size, OUT digest);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// The SHA extensions do two rounds at a time, on the state split into ABEF and
+// CDGH, and help with the message schedule.
+__attribute__((target("sha,sse4.1"))) static void
+sha256BlocksSHANI(INOUT u32 state[8], const u8 *data, std::size_t nblocks) {
+  const __m128i byteSwap =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+  tmp            = _mm_shuffle_epi32(tmp, 0xb1);        // CDAB
+  state1         = _mm_shuffle_epi32(state1, 0x1b);     // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);     // ABEF
+  state1         = _mm_blend_epi16(state1, tmp, 0xf0);  // CDGH
+
+  for (; nblocks > 0; nblocks--, data += SHA256_BLOCK_SIZE) {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+
+    // message words 4k to 4k + 3, in slot k % 4
+    __m128i msg[4];
+    for (unsigned k = 0; k < 16; k++) {
+      if (k < 4) {
+        msg[k] = _mm_shuffle_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + 16 * k)),
+            byteSwap);
+      } else {
+        const __m128i w7 =
+            _mm_alignr_epi8(msg[(k - 1) % 4], msg[(k - 2) % 4], 4);
+        msg[k % 4] = _mm_sha256msg2_epu32(
+            _mm_add_epi32(_mm_sha256msg1_epu32(msg[k % 4], msg[(k - 3) % 4]),
+                          w7),
+            msg[(k - 1) % 4]);
+      }
+
+      __m128i wk = _mm_add_epi32(
+          msg[k % 4],
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(SHA256_K + 4 * k)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+      wk     = _mm_shuffle_epi32(wk, 0x0e);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp    = _mm_shuffle_epi32(state0, 0x1b);     // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xb1);     // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xf0);  // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);     // ABEF
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+
+void sha256SHANI(const void *data, std::size_t size, OUT u8 digest[32]) {
+  sha256With(sha256BlocksSHANI, data, size, OUT digest);
+}
+
+#define ROTR8X32(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+// Processes NBLOCKS blocks of each of the 8 messages, with STATE transposed:
+// STATE[i] holds word i of all 8 states.
+__attribute__((target("avx2"))) static void
+sha256BlocksAVX2x8(INOUT __m256i state[8], const u8 *const data[8],
+                   std::size_t nblocks) {
+  const __m256i byteSwap = _mm256_set_epi8(
+      12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8,
+      9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+
+  for (std::size_t block = 0; block < nblocks; block++) {
+    // transpose 8 words of the 8 messages at a time, so that lane j of w[t]
+    // is word t of message j
+    __m256i w[64];
+    for (unsigned half = 0; half < 2; half++) {
+      __m256i r[8];
+      for (unsigned j = 0; j < 8; j++)
+        r[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(
+            data[j] + block * SHA256_BLOCK_SIZE + 32 * half));
+
+      const __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+      const __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+      const __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+      const __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+      const __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+      const __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+      const __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+      const __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+      const __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+      const __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+      const __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+      const __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+      const __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+      const __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+      const __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+      const __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+      __m256i *out = w + 8 * half;
+      out[0]       = _mm256_permute2x128_si256(u0, u4, 0x20);
+      out[1]       = _mm256_permute2x128_si256(u1, u5, 0x20);
+      out[2]       = _mm256_permute2x128_si256(u2, u6, 0x20);
+      out[3]       = _mm256_permute2x128_si256(u3, u7, 0x20);
+      out[4]       = _mm256_permute2x128_si256(u0, u4, 0x31);
+      out[5]       = _mm256_permute2x128_si256(u1, u5, 0x31);
+      out[6]       = _mm256_permute2x128_si256(u2, u6, 0x31);
+      out[7]       = _mm256_permute2x128_si256(u3, u7, 0x31);
+
+      for (unsigned t = 0; t < 8; t++)
+        out[t] = _mm256_shuffle_epi8(out[t], byteSwap);
+    }
+
+    for (unsigned t = 16; t < 64; t++) {
+      const __m256i s0 = _mm256_xor_si256(
+          _mm256_xor_si256(ROTR8X32(w[t - 15], 7), ROTR8X32(w[t - 15], 18)),
+          _mm256_srli_epi32(w[t - 15], 3));
+      const __m256i s1 = _mm256_xor_si256(
+          _mm256_xor_si256(ROTR8X32(w[t - 2], 17), ROTR8X32(w[t - 2], 19)),
+          _mm256_srli_epi32(w[t - 2], 10));
+      w[t] = _mm256_add_epi32(_mm256_add_epi32(w[t - 16], s0),
+                              _mm256_add_epi32(w[t - 7], s1));
+    }
+
+    __m256i a = state[0], b = state[1], c = state[2], d = state[3];
+    __m256i e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (unsigned t = 0; t < 64; t++) {
+      const __m256i s1 = _mm256_xor_si256(
+          _mm256_xor_si256(ROTR8X32(e, 6), ROTR8X32(e, 11)), ROTR8X32(e, 25));
+      const __m256i ch =
+          _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+      const __m256i t1 = _mm256_add_epi32(
+          _mm256_add_epi32(_mm256_add_epi32(h, s1), ch),
+          _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(SHA256_K[t])),
+                           w[t]));
+      const __m256i s0 = _mm256_xor_si256(
+          _mm256_xor_si256(ROTR8X32(a, 2), ROTR8X32(a, 13)), ROTR8X32(a, 22));
+      const __m256i maj = _mm256_xor_si256(
+          _mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)),
+          _mm256_and_si256(b, c));
+
+      h = g;
+      g = f;
+      f = e;
+      e = _mm256_add_epi32(d, t1);
+      d = c;
+      c = b;
+      b = a;
+      a = _mm256_add_epi32(t1, _mm256_add_epi32(s0, maj));
+    }
+
+    state[0] = _mm256_add_epi32(state[0], a);
+    state[1] = _mm256_add_epi32(state[1], b);
+    state[2] = _mm256_add_epi32(state[2], c);
+    state[3] = _mm256_add_epi32(state[3], d);
+    state[4] = _mm256_add_epi32(state[4], e);
+    state[5] = _mm256_add_epi32(state[5], f);
+    state[6] = _mm256_add_epi32(state[6], g);
+    state[7] = _mm256_add_epi32(state[7], h);
+  }
+}
+
+#undef ROTR8X32
+
+__attribute__((target("avx2"))) void
+sha256x8AVX2(const void *const data[8], std::size_t size,
+             OUT u8 digests[8][32]) {
+  __m256i state[8];
+  for (unsigned i = 0; i < 8; i++)
+    state[i] = _mm256_set1_epi32(static_cast<int>(SHA256_H0[i]));
+
+  const u8 *messages[8];
+  for (unsigned j = 0; j < 8; j++)
+    messages[j] = static_cast<const u8 *>(data[j]);
+
+  sha256BlocksAVX2x8(INOUT state, messages, size / SHA256_BLOCK_SIZE);
+
+  // the messages have the same size, so their tails have the same length
+  u8          tails[8][2 * SHA256_BLOCK_SIZE];
+  const u8 *  tailPtrs[8];
+  std::size_t ntail = 0;
+  for (unsigned j = 0; j < 8; j++) {
+    ntail = sha256Tail(messages[j] + size - size % SHA256_BLOCK_SIZE, size,
+                       OUT tails[j]);
+    tailPtrs[j] = tails[j];
+  }
+
+  sha256BlocksAVX2x8(INOUT state, tailPtrs, ntail);
+
+  alignas(32) u32 words[8][8]; // word i of lane j in words[i][j]
+  for (unsigned i = 0; i < 8; i++)
+    _mm256_store_si256(reinterpret_cast<__m256i *>(words[i]), state[i]);
+
+  for (unsigned j = 0; j < 8; j++) {
+    for (unsigned i = 0; i < 8; i++)
+      storeBE32(words[i][j], OUT digests[j] + 4 * i);
+  }
+}
+
+#else // !HAVE_X86_KERNELS
+
+void sha256SHANI(const void *data, std::size_t size, OUT u8 digest[32]) {
+  sha256Scalar(data, size, OUT digest);
+}
+
+void sha256x8AVX2(const void *const data[8], std::size_t size,
+                  OUT u8 digests[8][32]) {
+  for (unsigned j = 0; j < 8; j++)
+    sha256Scalar(data[j], size, OUT digests[j]);
+}
+
+#endif // HAVE_X86_KERNELS
+
+const std::vector<Sha256Impl> &sha256Implementations() {
+  static const std::vector<Sha256Impl> impls = [] {
+    std::vector<Sha256Impl> result;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+      result.push_back(Sha256Impl{"sha-ni", sha256SHANI});
+#endif
+
+    result.push_back(Sha256Impl{"scalar", sha256Scalar});
+    return result;
+  }();
+
+  return impls;
+}
+
+void sha256(const void *data, std::size_t size, OUT u8 digest[32]) {
+  static const Sha256Fn fastest = sha256Implementations().front().fn;
+  fastest(data, size, OUT digest);
+}
+
+// The block function of the fastest implementation, for Sha256Stream.
+static Sha256BlocksFn sha256Blocks() {
+  static const Sha256BlocksFn fastest = [] {
+#ifdef HAVE_X86_KERNELS
+    if (sha256Implementations().front().fn == sha256SHANI)
+      return static_cast<Sha256BlocksFn>(sha256BlocksSHANI);
+#endif
+
+    return static_cast<Sha256BlocksFn>(sha256BlocksScalar);
+  }();
+
+  return fastest;
+}
+
+Sha256Stream::Sha256Stream() {
+  std::memcpy(m_state, SHA256_H0, sizeof(m_state));
+}
+
+void Sha256Stream::update(const void *data, std::size_t size) {
+  const u8 *bytes = static_cast<const u8 *>(data);
+  m_size += size;
+
+  if (m_buffered > 0) {
+    const std::size_t n = std::min(size, SHA256_BLOCK_SIZE - m_buffered);
+    std::memcpy(m_buffer + m_buffered, bytes, n);
+    m_buffered += n;
+    bytes += n;
+    size -= n;
+
+    if (m_buffered < SHA256_BLOCK_SIZE)
+      return;
+
+    sha256Blocks()(INOUT m_state, m_buffer, 1);
+    m_buffered = 0;
+  }
+
+  // whole blocks straight from DATA, which is where almost all of it goes
+  const std::size_t nblocks = size / SHA256_BLOCK_SIZE;
+  sha256Blocks()(INOUT m_state, bytes, nblocks);
+  bytes += nblocks * SHA256_BLOCK_SIZE;
+  size -= nblocks * SHA256_BLOCK_SIZE;
+
+  std::memcpy(m_buffer, bytes, size);
+  m_buffered = size;
+}
+
+void Sha256Stream::finish(OUT u8 digest[32]) {
+  u8                tail[2 * SHA256_BLOCK_SIZE];
+  const std::size_t ntail = sha256Tail(m_buffer, m_size, OUT tail);
+  sha256Blocks()(INOUT m_state, tail, ntail);
+
+  for (unsigned i = 0; i < 8; i++)
+    storeBE32(m_state[i], OUT digest + 4 * i);
+}
+
+bool haveSha256x8() {
+#ifdef HAVE_X86_KERNELS
+  static const bool avx2 = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+  }();
+
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+// ---- verification ----
+
+// ZFS stores the digest as 4 big endian 64-bit words, in the byte order of the
+// block pointer.
+static bool sha256Matches(const physical::Blkptr &bp, const u8 digest[32]) {
+  for (unsigned i = 0; i < 4; i++) {
+    u64 stored;
+    std::memcpy(&stored, bp.checksum + 8 * i, sizeof(stored));
+
+    const u64 expected =
+        (static_cast<u64>(loadBE32(digest + 8 * i)) << 32) |
+        loadBE32(digest + 8 * i + 4);
+    if (stored != expected)
+      return false;
+  }
+
+  return true;
+}
+
+bool canVerifyChecksum(const physical::Blkptr &bp) {
+  if (bp.embedded)
+    return false;
+
+  switch (bp.cksum) {
+  case Checksum::On:
+  case Checksum::Fletcher4:
+  case Checksum::SHA256:
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+bool verifyChecksum(const physical::Blkptr &bp, const void *data,
+                    std::size_t size) {
+  if (!canVerifyChecksum(bp))
+    return true;
+
+  if (bp.cksum == Checksum::SHA256) {
+    u8 digest[32];
+    sha256(data, size, OUT digest);
+    return sha256Matches(bp, digest);
+  }
+
+  u64 cksum[4];
+  if (bp.endian == SYSTEM_ENDIAN) {
+    fletcher4(data, size, OUT cksum);
+  } else {
+    // the writer summed up its own native words (fletcher_4_byteswap())
+    std::unique_ptr<u8[]> swapped{new u8[size]};
+    std::memcpy(swapped.get(), data, size);
+    byteswap_uint32_array(swapped.get(), size - size % sizeof(u32));
+    fletcher4(swapped.get(), size, OUT cksum);
+  }
+
+  return std::memcmp(cksum, bp.checksum, sizeof(cksum)) == 0;
+}
+
+void verifyChecksums(INOUT std::vector<ChecksumJob> *jobs) {
+  // with the SHA extensions, a single stream is faster than 8 AVX2 lanes
+  const bool multiBuffer =
+      haveSha256x8() && std::strcmp(sha256Implementations().front().name,
+                                    "sha-ni") != 0;
+
+  std::vector<ChecksumJob *> shaJobs;
+  for (ChecksumJob &job : *jobs) {
+    if (multiBuffer && job.bp->cksum == Checksum::SHA256 &&
+        canVerifyChecksum(*job.bp))
+      shaJobs.push_back(&job);
+    else
+      job.matches = verifyChecksum(*job.bp, job.data, job.size);
+  }
+
+  // hash groups of 8 blocks of the same size, the rest one by one
+  std::stable_sort(shaJobs.begin(), shaJobs.end(),
+                   [](const ChecksumJob *lhs, const ChecksumJob *rhs) {
+                     return lhs->size < rhs->size;
+                   });
+
+  std::size_t i = 0;
+  while (i < shaJobs.size()) {
+    if (i + 8 <= shaJobs.size() && shaJobs[i]->size == shaJobs[i + 7]->size) {
+      const void *data[8];
+      for (unsigned j = 0; j < 8; j++)
+        data[j] = shaJobs[i + j]->data;
+
+      u8 digests[8][32];
+      sha256x8AVX2(data, shaJobs[i]->size, OUT digests);
+
+      for (unsigned j = 0; j < 8; j++)
+        shaJobs[i + j]->matches =
+            sha256Matches(*shaJobs[i + j]->bp, digests[j]);
+
+      i += 8;
+    } else {
+      ChecksumJob &job = *shaJobs[i++];
+      job.matches      = verifyChecksum(*job.bp, job.data, job.size);
+    }
+  }
+}
+
+} // end namespace zfs
@@ -0,0 +1,427 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "lz4.h"
+
+#include "utils/log.h"
+#include "zfs/compression.h"
+
+// blatantly stolen from byteorder.h in linux-on-zfs source tree
+#define BE_IN8(xa) *((u8 *)(xa))
+#define BE_IN16(xa) (((u16)BE_IN8(xa) << 8) | BE_IN8((u8 *)(xa) + 1))
+#define BE_IN32(xa) (((u32)BE_IN16(xa) << 16) | BE_IN16((u8 *)(xa) + 2))
+
+// lzjb.c
+#define LZJB_NBBY 8
+#define LZJB_MATCH_BITS 6
+#define LZJB_MATCH_MIN 3
+#define LZJB_MATCH_MAX ((1 << LZJB_MATCH_BITS) + (LZJB_MATCH_MIN - 1))
+#define LZJB_OFFSET_MASK ((1 << (16 - LZJB_MATCH_BITS)) - 1)
+#define LZJB_LEMPEL_SIZE 1024
+
+// the longest literal run of zle.c, its table entry passes 64
+#define ZLE_N 64
+
+namespace zfs {
+
+static void storeBE32(u32 value, OUT u8 *p) {
+  p[0] = static_cast<u8>(value >> 24);
+  p[1] = static_cast<u8>(value >> 16);
+  p[2] = static_cast<u8>(value >> 8);
+  p[3] = static_cast<u8>(value);
+}
+
+// ---- LZ4: a big endian 32-bit length, followed by the LZ4 stream ----
+
+static bool decompressLZ4(const u8 *src, std::size_t psize, OUT u8 *dst,
+                          std::size_t lsize) {
+  const u32 compressed_size = BE_IN32(src);
+
+  if (psize < compressed_size + sizeof(compressed_size)) {
+    LOG("Cannot LZ4 decompress: invalid compressed size %u for psize = %zu\n",
+        compressed_size, psize);
+    return false;
+  }
+
+  if (lsize <= compressed_size + sizeof(compressed_size)) {
+    LOG("Cannot LZ4 decompress: lnvalid logical size %zu: lower than the "
+        "compressed size %u\n",
+        lsize, compressed_size);
+    return false;
+  }
+
+  const int decompress_result = LZ4_decompress_safe(
+      reinterpret_cast<const char *>(src + sizeof(compressed_size)),
+      OUT reinterpret_cast<char *>(dst), static_cast<int>(compressed_size),
+      static_cast<int>(lsize));
+
+  LOG("LZ4_decompress_safe => %d (compressed_size = %u, lsize = %zu, psize = "
+      "%zu)\n",
+      decompress_result, compressed_size, lsize, psize);
+
+  return decompress_result >= 0;
+}
+
+static std::size_t compressLZ4(const u8 *src, std::size_t size, OUT u8 *dst,
+                               std::size_t capacity) {
+  if (capacity <= sizeof(u32))
+    return 0;
+
+  const int n = LZ4_compress_default(
+      reinterpret_cast<const char *>(src),
+      OUT reinterpret_cast<char *>(dst + sizeof(u32)), static_cast<int>(size),
+      static_cast<int>(capacity - sizeof(u32)));
+  if (n <= 0)
+    return 0;
+
+  storeBE32(static_cast<u32>(n), OUT dst);
+  return n + sizeof(u32);
+}
+
+// ---- gzip: a zlib stream (gzip.c uses uncompress()) ----
+
+namespace {
+
+// An inflate stream per thread, reset for every block instead of set up anew,
+// so that its window is only allocated once.
+struct InflateContext {
+  InflateContext() {
+    std::memset(&stream, 0, sizeof(stream));
+    ok = inflateInit(&stream) == Z_OK;
+  }
+
+  ~InflateContext() {
+    if (ok)
+      inflateEnd(&stream);
+  }
+
+  InflateContext(const InflateContext &other) = delete;
+  InflateContext &operator=(const InflateContext &other) = delete;
+
+  z_stream stream;
+  bool     ok;
+};
+
+} // end anonymous namespace
+
+static bool decompressGzip(const u8 *src, std::size_t psize, OUT u8 *dst,
+                           std::size_t lsize) {
+  thread_local InflateContext ctx;
+  if (!ctx.ok || inflateReset(&ctx.stream) != Z_OK)
+    return false;
+
+  ctx.stream.next_in   = const_cast<Bytef *>(src);
+  ctx.stream.avail_in  = static_cast<uInt>(psize);
+  ctx.stream.next_out  = dst;
+  ctx.stream.avail_out = static_cast<uInt>(lsize);
+
+  const int ret = inflate(&ctx.stream, Z_FINISH);
+  if (ret != Z_STREAM_END) {
+    LOG("Cannot gzip decompress: inflate() => %d\n", ret);
+    return false;
+  }
+
+  return true;
+}
+
+template <int Level>
+static std::size_t compressGzip(const u8 *src, std::size_t size, OUT u8 *dst,
+                                std::size_t capacity) {
+  uLongf n = capacity;
+  if (compress2(dst, &n, src, size, Level) != Z_OK)
+    return 0;
+
+  return n;
+}
+
+// ---- LZJB ----
+
+static bool decompressLZJB(const u8 *src, std::size_t psize, OUT u8 *dst,
+                           std::size_t lsize) {
+  const u8 *const srcEnd   = src + psize;
+  u8 *const       dstStart = dst;
+  u8 *const       dstEnd   = dst + lsize;
+
+  u8  copymap  = 0;
+  int copymask = 1 << (LZJB_NBBY - 1);
+
+  while (dst < dstEnd) {
+    if ((copymask <<= 1) == (1 << LZJB_NBBY)) {
+      if (src >= srcEnd)
+        return false;
+
+      copymask = 1;
+      copymap  = *src++;
+    }
+
+    if (copymap & copymask) {
+      if (src + 2 > srcEnd)
+        return false;
+
+      std::ptrdiff_t mlen =
+          (src[0] >> (LZJB_NBBY - LZJB_MATCH_BITS)) + LZJB_MATCH_MIN;
+      const int offset = ((src[0] << LZJB_NBBY) | src[1]) & LZJB_OFFSET_MASK;
+      src += 2;
+
+      const u8 *cpy = dst - offset;
+      if (cpy < dstStart)
+        return false;
+
+      mlen = std::min(mlen, dstEnd - dst);
+
+      // overlapping copies repeat the last bytes, so byte by byte
+      while (--mlen >= 0)
+        *dst++ = *cpy++;
+    } else {
+      if (src >= srcEnd)
+        return false;
+
+      *dst++ = *src++;
+    }
+  }
+
+  return true;
+}
+
+static std::size_t compressLZJB(const u8 *src, std::size_t size, OUT u8 *dst,
+                                std::size_t capacity) {
+  const u8 *const srcStart = src;
+  const u8 *const srcEnd   = src + size;
+  u8 *const       dstStart = dst;
+
+  u8 *copymap  = nullptr;
+  int copymask = 1 << (LZJB_NBBY - 1);
+  u16 lempel[LZJB_LEMPEL_SIZE] = {0};
+
+  while (src < srcEnd) {
+    if ((copymask <<= 1) == (1 << LZJB_NBBY)) {
+      if (dst + 1 + 2 * LZJB_NBBY >= dstStart + capacity)
+        return 0;
+
+      copymask = 1;
+      copymap  = dst;
+      *dst++   = 0;
+    }
+
+    if (src > srcEnd - LZJB_MATCH_MAX) {
+      *dst++ = *src++;
+      continue;
+    }
+
+    int hash = (src[0] << 16) + (src[1] << 8) + src[2];
+    hash += hash >> 9;
+    hash += hash >> 5;
+
+    u16 *const hp = &lempel[hash & (LZJB_LEMPEL_SIZE - 1)];
+    const int  offset =
+        static_cast<int>(reinterpret_cast<uintptr_t>(src) - *hp) &
+        LZJB_OFFSET_MASK;
+    *hp = static_cast<u16>(reinterpret_cast<uintptr_t>(src));
+
+    const u8 *cpy = src - offset;
+    if (cpy >= srcStart && cpy != src && src[0] == cpy[0] &&
+        src[1] == cpy[1] && src[2] == cpy[2]) {
+      *copymap |= copymask;
+
+      int mlen = LZJB_MATCH_MIN;
+      while (mlen < LZJB_MATCH_MAX && src[mlen] == cpy[mlen])
+        mlen++;
+
+      *dst++ = static_cast<u8>(
+          ((mlen - LZJB_MATCH_MIN) << (LZJB_NBBY - LZJB_MATCH_BITS)) |
+          (offset >> LZJB_NBBY));
+      *dst++ = static_cast<u8>(offset);
+      src += mlen;
+    } else {
+      *dst++ = *src++;
+    }
+  }
+
+  return dst - dstStart;
+}
+
+// ---- ZLE: runs of zeros, and literal runs of up to ZLE_N bytes ----
+
+static bool decompressZLE(const u8 *src, std::size_t psize, OUT u8 *dst,
+                          std::size_t lsize) {
+  const u8 *const srcEnd = src + psize;
+  u8 *const       dstEnd = dst + lsize;
+
+  while (src < srcEnd && dst < dstEnd) {
+    std::size_t len = 1 + *src++;
+    if (len <= ZLE_N) {
+      if (src + len > srcEnd || dst + len > dstEnd)
+        return false;
+
+      std::memcpy(dst, src, len);
+      src += len;
+      dst += len;
+    } else {
+      len -= ZLE_N;
+      if (dst + len > dstEnd)
+        return false;
+
+      std::memset(dst, 0, len);
+      dst += len;
+    }
+  }
+
+  return dst == dstEnd;
+}
+
+static std::size_t compressZLE(const u8 *src, std::size_t size, OUT u8 *dst,
+                               std::size_t capacity) {
+  const u8 *const srcEnd   = src + size;
+  u8 *const       dstStart = dst;
+  u8 *const       dstEnd   = dst + capacity;
+
+  while (src < srcEnd && dst < dstEnd - 1) {
+    const u8 *first = src;
+    u8 *      len   = dst++;
+
+    if (src[0] == 0) {
+      const u8 *last = std::min(src + (256 - ZLE_N), srcEnd);
+      while (src < last && src[0] == 0)
+        src++;
+
+      *len = static_cast<u8>(src - first - 1 + ZLE_N);
+    } else {
+      if (dstEnd - dst < ZLE_N)
+        break;
+
+      const u8 *last = std::min(src + ZLE_N, srcEnd);
+      while (src < last - 1 && (src[0] | src[1]))
+        *dst++ = *src++;
+
+      if (src[0])
+        *dst++ = *src++;
+
+      *len = static_cast<u8>(src - first - 1);
+    }
+  }
+
+  return src == srcEnd ? dst - dstStart : 0;
+}
+
+// ---- zstd: a header with the big endian compressed size and the version and
+// level, followed by the zstd frame (zfs_zstd.c) ----
+
+#define ZFS_ZSTD_HEADER_SIZE (2 * sizeof(u32))
+#define ZFS_ZSTD_LEVEL 3
+
+#ifdef HAVE_ZSTD
+
+namespace {
+
+// A decompression context per thread, see InflateContext.
+struct ZStdContext {
+  ZStdContext() : dctx{ZSTD_createDCtx()} {}
+  ~ZStdContext() { ZSTD_freeDCtx(dctx); }
+
+  ZStdContext(const ZStdContext &other) = delete;
+  ZStdContext &operator=(const ZStdContext &other) = delete;
+
+  ZSTD_DCtx *dctx;
+};
+
+} // end anonymous namespace
+
+static bool decompressZStd(const u8 *src, std::size_t psize, OUT u8 *dst,
+                           std::size_t lsize) {
+  thread_local ZStdContext ctx;
+  if (!ctx.dctx || psize < ZFS_ZSTD_HEADER_SIZE)
+    return false;
+
+  const u32 compressed_size = BE_IN32(src);
+  if (psize < compressed_size + ZFS_ZSTD_HEADER_SIZE) {
+    LOG("Cannot zstd decompress: invalid compressed size %u for psize = %zu\n",
+        compressed_size, psize);
+    return false;
+  }
+
+  const std::size_t n = ZSTD_decompressDCtx(
+      ctx.dctx, dst, lsize, src + ZFS_ZSTD_HEADER_SIZE, compressed_size);
+  if (ZSTD_isError(n)) {
+    LOG("Cannot zstd decompress: %s\n", ZSTD_getErrorName(n));
+    return false;
+  }
+
+  return true;
+}
+
+static std::size_t compressZStd(const u8 *src, std::size_t size, OUT u8 *dst,
+                                std::size_t capacity) {
+  if (capacity <= ZFS_ZSTD_HEADER_SIZE)
+    return 0;
+
+  const std::size_t n =
+      ZSTD_compress(dst + ZFS_ZSTD_HEADER_SIZE, capacity - ZFS_ZSTD_HEADER_SIZE,
+                    src, size, ZFS_ZSTD_LEVEL);
+  if (ZSTD_isError(n))
+    return 0;
+
+  storeBE32(static_cast<u32>(n), OUT dst);
+  storeBE32(ZFS_ZSTD_LEVEL, OUT dst + sizeof(u32));
+  return n + ZFS_ZSTD_HEADER_SIZE;
+}
+
+#else // !HAVE_ZSTD
+
+static const DecompressFn decompressZStd = nullptr;
+static const CompressFn   compressZStd   = nullptr;
+
+#endif // HAVE_ZSTD
+
+// by the on-disk value, up to Compress::ZStd
+static const Codec CODECS[] = {
+    {Compress::Inherit, "inherit", nullptr, nullptr},
+    {Compress::On, "on", nullptr, nullptr},
+    {Compress::Off, "off", nullptr, nullptr},
+    {Compress::LZJB, "lzjb", decompressLZJB, compressLZJB},
+    {Compress::Empty, "empty", nullptr, nullptr},
+    {Compress::Gzip1, "gzip-1", decompressGzip, compressGzip<1>},
+    {Compress::Gzip2, "gzip-2", decompressGzip, compressGzip<2>},
+    {Compress::Gzip3, "gzip-3", decompressGzip, compressGzip<3>},
+    {Compress::Gzip4, "gzip-4", decompressGzip, compressGzip<4>},
+    {Compress::Gzip5, "gzip-5", decompressGzip, compressGzip<5>},
+    {Compress::Gzip6, "gzip-6", decompressGzip, compressGzip<6>},
+    {Compress::Gzip7, "gzip-7", decompressGzip, compressGzip<7>},
+    {Compress::Gzip8, "gzip-8", decompressGzip, compressGzip<8>},
+    {Compress::Gzip9, "gzip-9", decompressGzip, compressGzip<9>},
+    {Compress::ZLE, "zle", decompressZLE, compressZLE},
+    {Compress::LZ4, "lz4", decompressLZ4, compressLZ4},
+    {Compress::ZStd, "zstd", decompressZStd, compressZStd},
+};
+
+const Codec *findCodec(Compress comp) {
+  const std::size_t index = static_cast<std::size_t>(comp);
+  if (index >= sizeof(CODECS) / sizeof(CODECS[0]))
+    return nullptr;
+
+  // inherit, on and empty are settings, blocks never have them
+  const Codec &codec = CODECS[index];
+  if (comp == Compress::Inherit || comp == Compress::On ||
+      comp == Compress::Empty)
+    return nullptr;
+
+  return &codec;
+}
+
+std::vector<const Codec *> availableCodecs() {
+  std::vector<const Codec *> result;
+  for (const Codec &codec : CODECS) {
+    if (codec.decompress)
+      result.push_back(&codec);
+  }
+
+  return result;
+}
+
+} // end namespace zfs
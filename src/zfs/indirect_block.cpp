@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <utility>
+
 #include "utils/log.h"
 
 #include "zfs/indirect_block.h"
 
+// the number of data blocks read together by IndirectBlockBase::prefetch()
+#define PREFETCH_BATCH 64
+
 namespace zfs {
 
 namespace detail {
@@ -10,8 +16,14 @@ BlockRef IndirectBlockNode::readBlock(ZPoolReader &reader, bool allowRead) {
   ASSERT0(m_blkptr);
 
   if (!m_ptr && allowRead) {
-    m_ptr = reader.read(*m_blkptr, /*dva=*/0);
-    ASSERT0(m_ptr); // TODO: throw an exception
+    // try the other copies if one cannot be read or is corrupt
+    for (u32 dva = 0; !m_ptr && dva < m_blkptr->numCopies(); dva++)
+      m_ptr = reader.read(*m_blkptr, dva);
+
+    if (!m_ptr)
+      throw ZPoolReaderException{m_blkptr, nullptr,
+                                 "None of the copies of the block could be "
+                                 "read!"};
   }
 
   return m_ptr;
@@ -50,6 +62,58 @@ IndirectBlockBase::IndirectBlockBase(ZPoolReader &          reader,
   }
 }
 
+void IndirectBlockBase::prefetch(std::vector<u64> blockids) {
+  std::sort(blockids.begin(), blockids.end());
+  blockids.erase(std::unique(blockids.begin(), blockids.end()),
+                 blockids.end());
+
+  // only the indirect blocks are read here, they are needed either way
+  std::vector<std::pair<u64, u64>> byAddress;
+  for (u64 blockid : blockids) {
+    if (blockid >= numDataBlocks())
+      continue;
+
+    try {
+      const physical::Blkptr *bp = blkptrByID(blockid);
+      if (!bp || !bp->isValid())
+        continue;
+
+      m_reader->prefetch(*bp, /*dva=*/0);
+      byAddress.emplace_back(bp->embedded ? 0 : bp->dva[0].getAddress(),
+                             blockid);
+    } catch (const std::exception &ex) {
+      LOG("Cannot prefetch block %lu: %s\n", blockid, ex.what());
+    }
+  }
+
+  std::sort(byAddress.begin(), byAddress.end());
+
+  // read them in batches, so that their checksums are verified together
+  std::vector<IndirectBlockNode *>      nodes;
+  std::vector<const physical::Blkptr *> bps;
+  for (std::size_t i = 0; i < byAddress.size(); i++) {
+    IndirectBlockNode *node = _getChildNode(byAddress[i].second, true);
+    if (node && !node->isRead()) {
+      nodes.push_back(node);
+      bps.push_back(&node->blkptr());
+    }
+
+    if (bps.size() < PREFETCH_BATCH && i + 1 < byAddress.size())
+      continue;
+
+    std::vector<BlockPtr> blocks = m_reader->readBatch(bps);
+    for (std::size_t j = 0; j < blocks.size(); j++) {
+      if (blocks[j])
+        nodes[j]->setBlock(std::move(blocks[j]));
+      else
+        LOG("Cannot prefetch block at 0x%lx!\n", bps[j]->dva[0].getAddress());
+    }
+
+    nodes.clear();
+    bps.clear();
+  }
+}
+
 IndirectBlockNode *IndirectBlockBase::_getChildNode(u64  blockid,
                                                     bool allowRead) {
   ASSERT0(blockid < numDataBlocks());
@@ -2,11 +2,13 @@
 #include <type_traits>
 
 #include "zfs/physical.h"
+#include "zfs/zap.h"
 
 // ---- DSL magic, you do not want to be here ----
 
-static unsigned g_indent          = 0;
-static bool     g_suppress_indent = false;
+// per thread, blocks may be read (and dumped) from several threads at once
+static thread_local unsigned g_indent          = 0;
+static thread_local bool     g_suppress_indent = false;
 
 #define INDENT_LENGTH 4
 #define FMT64 "0x%016lx"
@@ -265,6 +267,39 @@ void MZapHeader::dump(std::FILE *fp, DumpFlags flags) const {
   }
 }
 
+void FatZapHeader::dump(std::FILE *fp, DumpFlags flags) const {
+  if (!isValid() && !flag_isset(flags, DumpFlags::AllowInvalid)) {
+    PRINT(fp, "FatZapHeader: invalid\n");
+    return;
+  }
+
+  OBJECT_HEADER(fp, *this, "FatZapHeader:") {
+    DUMP_FIELD(ptrtbl.blk);
+    DUMP_FIELD(ptrtbl.numblks);
+    DUMP_FIELD(ptrtbl.shift);
+    DUMP_FIELD(freeblk);
+    DUMP_FIELD(num_leafs);
+    DUMP_FIELD(num_entries);
+    DUMP_FIELD(salt);
+    DUMP_FIELD(normflags);
+    DUMP_FIELD(flags);
+  }
+}
+
+void ZapLeafHeader::dump(std::FILE *fp, DumpFlags flags) const {
+  if (!isValid() && !flag_isset(flags, DumpFlags::AllowInvalid)) {
+    PRINT(fp, "ZapLeafHeader: invalid\n");
+    return;
+  }
+
+  OBJECT_HEADER(fp, *this, "ZapLeafHeader:") {
+    DUMP_FIELD(prefix);
+    DUMP_FIELD(prefix_len);
+    DUMP_FIELD(nentries);
+    DUMP_FIELD(nfree);
+  }
+}
+
 void DSLDir::dump(std::FILE *fp, DumpFlags flags) const {
   if (!isValid() && !flag_isset(flags, DumpFlags::AllowInvalid)) {
     PRINT(fp, "DSLDir: invalid\n");
@@ -322,6 +357,44 @@ void ZNodeTime::dump(std::FILE *fp, DumpFlags flags) const {
   PRINT(fp, "ZNodeTime <%lu.%lu>\n", seconds, nanoseconds);
 }
 
+void ZNodePhys::dump(std::FILE *fp, DumpFlags flags) const {
+  if (!isValid() && !flag_isset(flags, DumpFlags::AllowInvalid)) {
+    PRINT(fp, "ZNodePhys: invalid\n");
+    return;
+  }
+
+  OBJECT_HEADER(fp, *this, "ZNodePhys:") {
+    DUMP_FIELD_REC(atime);
+    DUMP_FIELD_REC(mtime);
+    DUMP_FIELD_REC(ctime);
+    DUMP_FIELD_REC(crtime);
+
+    DUMP_FIELD(gen);
+    DUMP_FIELD(mode);
+    DUMP_FIELD(size);
+    DUMP_FIELD(parent);
+    DUMP_FIELD(links);
+    DUMP_FIELD(xattr);
+    DUMP_FIELD(rdev);
+    DUMP_FIELD(flags);
+    DUMP_FIELD(uid);
+    DUMP_FIELD(gid);
+    DUMP_FIELD(zap);
+  }
+}
+
+void SaHeader::dump(std::FILE *fp, DumpFlags flags) const {
+  if (!isValid() && !flag_isset(flags, DumpFlags::AllowInvalid)) {
+    PRINT(fp, "SaHeader: invalid\n");
+    return;
+  }
+
+  OBJECT_HEADER(fp, *this, "SaHeader <layout %hu>:", layout()) {
+    DUMP_FIELD(magic);
+    DUMP_FIELD(layout_info);
+  }
+}
+
 void ZNode::dump(std::FILE *fp, DumpFlags flags) const {
   if (!isValid() && !flag_isset(flags, DumpFlags::AllowInvalid)) {
     PRINT(fp, "ZNode: invalid\n");
@@ -386,4 +459,29 @@ void MZapBlockPtr::dump(std::FILE *fp, DumpFlags flags) const {
   }
 }
 
+void ZapObject::dump(std::FILE *fp, DumpFlags flags) {
+  if (isMicro()) {
+    m_micro.dump(fp, flags);
+    return;
+  }
+
+  if (!m_fat) {
+    PRINT(fp, "ZapObject: invalid\n");
+    return;
+  }
+
+  HEADER(fp, "FatZap:") {
+    INLINE_HEADER(fp, "header: ") {
+      reinterpret_cast<const physical::FatZapHeader *>(m_fat.data())
+          ->dump(fp, flags);
+    }
+
+    HEADER(fp, "entries: ") {
+      for (const ZapEntry &entry : *this) {
+        PRINT(fp, "%s = 0x%lx\n", entry.name.c_str(), entry.value);
+      }
+    }
+  }
+}
+
 } // end namespace zfs
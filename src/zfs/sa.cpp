@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include "utils/log.h"
+
+#include "zfs/byteorder.h"
+#include "zfs/sa.h"
+#include "zfs/zap.h"
+
+// attributes are aligned to 8 bytes in the bonus buffer
+#define SA_ALIGN(x) (((x) + 7) & ~static_cast<std::size_t>(7))
+
+// the number of bits of SaHeader::layout_info that hold the layout number
+#define SA_MAX_LAYOUTS 1024
+
+// the registry packs the attribute number and length into a single value
+#define SA_ATTR_NUM(x) ((x)&0xffff)
+#define SA_ATTR_LENGTH(x) (((x) >> 24) & 0xffff)
+
+namespace zfs {
+
+struct ZplAttr {
+  const char *name;
+  u16         number; // the default, if the dataset has no registry
+  u16         length; // ditto, 0 if variable
+  i32         field;  // offset in physical::ZNode, or -1
+  u16         fieldSize;
+};
+
+#define ZNODE_FIELD(NAME)                            \
+  static_cast<i32>(offsetof(physical::ZNode, NAME)), \
+      sizeof(physical::ZNode::NAME)
+
+// zfs_attr_table in zfs_sa.c
+static const ZplAttr ZPL_ATTRS[] = {
+    {"ZPL_ATIME", 0, 16, ZNODE_FIELD(atime)},
+    {"ZPL_MTIME", 1, 16, ZNODE_FIELD(mtime)},
+    {"ZPL_CTIME", 2, 16, ZNODE_FIELD(ctime)},
+    {"ZPL_CRTIME", 3, 16, ZNODE_FIELD(crtime)},
+    {"ZPL_GEN", 4, 8, ZNODE_FIELD(gen)},
+    {"ZPL_MODE", 5, 8, ZNODE_FIELD(mode)},
+    {"ZPL_SIZE", 6, 8, ZNODE_FIELD(size)},
+    {"ZPL_PARENT", 7, 8, ZNODE_FIELD(parent)},
+    {"ZPL_LINKS", 8, 8, ZNODE_FIELD(links)},
+    {"ZPL_XATTR", 9, 8, -1, 0},
+    {"ZPL_RDEV", 10, 8, -1, 0},
+    {"ZPL_FLAGS", 11, 8, ZNODE_FIELD(flags)},
+    {"ZPL_UID", 12, 8, ZNODE_FIELD(uid)},
+    {"ZPL_GID", 13, 8, ZNODE_FIELD(gid)},
+    {"ZPL_PAD", 14, 32, -1, 0},
+    {"ZPL_ZNODE_ACL", 15, 88, -1, 0},
+    {"ZPL_DACL_COUNT", 16, 8, -1, 0},
+    {"ZPL_SYMLINK", 17, 0, -1, 0},
+    {"ZPL_SCANSTAMP", 18, 32, -1, 0},
+    {"ZPL_DACL_ACES", 19, 0, -1, 0},
+    {"ZPL_DXATTR", 20, 0, -1, 0},
+    {"ZPL_PROJID", 21, 8, -1, 0},
+};
+
+#undef ZNODE_FIELD
+
+static void fromZNodePhys(const physical::ZNodePhys &phys,
+                          OUT physical::ZNode *znode) {
+  znode->atime  = phys.atime;
+  znode->mtime  = phys.mtime;
+  znode->ctime  = phys.ctime;
+  znode->crtime = phys.crtime;
+  znode->gen    = phys.gen;
+  znode->mode   = phys.mode;
+  znode->size   = phys.size;
+  znode->parent = phys.parent;
+  znode->links  = phys.links;
+  znode->flags  = phys.flags;
+  znode->uid    = phys.uid;
+  znode->gid    = phys.gid;
+}
+
+bool SaRegistry::load(ZPoolReader &                      reader,
+                      IndirectObjBlock<physical::DNode> &dslBlock,
+                      const physical::DNode &            masterNode) {
+  m_attrLengths.clear();
+  m_zplFields.clear();
+  m_layouts.clear();
+
+  ZapObject masterZap{reader, masterNode};
+  u64       saObjID;
+  if (!masterZap.isValid() || !masterZap.findEntry("SA_ATTRS", OUT & saObjID)) {
+    LOG("The dataset has no system attributes\n");
+    return false;
+  }
+
+  ZapObject saZap{reader, dslBlock.objectByID(saObjID)};
+  u64       registryObjID, layoutsObjID;
+  if (!saZap.isValid() || !saZap.findEntry("LAYOUTS", OUT & layoutsObjID)) {
+    LOG("The dataset has no SA layouts\n");
+    return false;
+  }
+
+  // attribute number -> name, length
+  auto registerAttr = [this](const std::string &name, u16 number, u16 length) {
+    if (m_attrLengths.size() <= number) {
+      m_attrLengths.resize(number + 1, 0);
+      m_zplFields.resize(number + 1, -1);
+    }
+
+    m_attrLengths[number] = length;
+    for (std::size_t i = 0; i < sizeof(ZPL_ATTRS) / sizeof(ZPL_ATTRS[0]); i++) {
+      if (name == ZPL_ATTRS[i].name && ZPL_ATTRS[i].field >= 0)
+        m_zplFields[number] = static_cast<i32>(i);
+    }
+  };
+
+  if (saZap.findEntry("REGISTRY", OUT & registryObjID)) {
+    ZapObject registryZap{reader, dslBlock.objectByID(registryObjID)};
+    if (registryZap.isValid()) {
+      for (const ZapEntry &entry : registryZap)
+        registerAttr(entry.name, SA_ATTR_NUM(entry.value),
+                     SA_ATTR_LENGTH(entry.value));
+    }
+  }
+
+  if (m_attrLengths.empty()) {
+    LOG("The dataset has no SA registry, assuming the default ZPL one\n");
+    for (const ZplAttr &attr : ZPL_ATTRS)
+      registerAttr(attr.name, attr.number, attr.length);
+  }
+
+  ZapObject layoutsZap{reader, dslBlock.objectByID(layoutsObjID)};
+  if (!layoutsZap.isValid()) {
+    LOG("Failed to read the SA layouts ZAP\n");
+    return false;
+  }
+
+  // the layouts are named by their number, and hold arrays of attribute
+  // numbers
+  for (const ZapEntry &entry : layoutsZap) {
+    const unsigned long number = std::strtoul(entry.name.c_str(), nullptr, 10);
+    if (number >= SA_MAX_LAYOUTS) {
+      LOG("Invalid SA layout '%s', skipping!\n", entry.name.c_str());
+      continue;
+    }
+
+    compileLayout(static_cast<u16>(number),
+                  entry.values.empty() ? std::vector<u64>{entry.value}
+                                       : entry.values);
+  }
+
+  return isLoaded();
+}
+
+void SaRegistry::compileLayout(u16 number, const std::vector<u64> &attrs) {
+  if (m_layouts.size() <= number)
+    m_layouts.resize(number + 1);
+
+  Layout &layout = m_layouts[number];
+  layout.attrs.assign(attrs.begin(), attrs.end());
+  layout.fixed.clear();
+
+  std::size_t offset = 0;
+  std::size_t i      = 0;
+  for (; i < layout.attrs.size(); i++) {
+    const u16 attr = layout.attrs[i];
+    if (attr >= m_attrLengths.size() || m_attrLengths[attr] == 0)
+      break;
+
+    const u16 length = m_attrLengths[attr];
+    if (m_zplFields[attr] >= 0) {
+      const ZplAttr &zplAttr = ZPL_ATTRS[m_zplFields[attr]];
+      layout.fixed.push_back(FieldCopy{
+          static_cast<u16>(offset), static_cast<u16>(zplAttr.field),
+          std::min(length, zplAttr.fieldSize)});
+    }
+
+    offset = SA_ALIGN(offset + length);
+  }
+
+  layout.firstVariable  = i;
+  layout.variableOffset = offset;
+}
+
+void SaRegistry::decodeVariable(const Layout &layout, const u8 *bonus,
+                                std::size_t              bonusLength,
+                                INOUT physical::ZNode *znode) const {
+  const auto &header =
+      *reinterpret_cast<const physical::SaHeader *>(bonus);
+  const std::size_t headerSize = header.headerSize();
+  const std::size_t numLengths =
+      (headerSize - sizeof(physical::SaHeader)) / sizeof(u16);
+
+  std::size_t offset      = headerSize + layout.variableOffset;
+  std::size_t lengthIndex = 0;
+  for (std::size_t i = layout.firstVariable; i < layout.attrs.size(); i++) {
+    const u16 attr = layout.attrs[i];
+    if (attr >= m_attrLengths.size()) {
+      LOG("SA attribute %hu is not registered, its length is unknown!\n",
+          attr);
+      return;
+    }
+
+    std::size_t length = m_attrLengths[attr];
+    if (length == 0) {
+      if (lengthIndex >= numLengths)
+        return;
+
+      length = header.lengths[lengthIndex++];
+    }
+
+    if (m_zplFields[attr] >= 0) {
+      const ZplAttr &   zplAttr = ZPL_ATTRS[m_zplFields[attr]];
+      const std::size_t n = std::min<std::size_t>(length, zplAttr.fieldSize);
+      if (offset + n <= bonusLength)
+        std::memcpy(reinterpret_cast<u8 *>(znode) + zplAttr.field,
+                    bonus + offset, n);
+    }
+
+    offset = SA_ALIGN(offset + length);
+  }
+}
+
+physical::ZNode SaRegistry::znode(const physical::DNode &dnode) const {
+  physical::ZNode znode{};
+  if (!dnode.isValid() || dnode.bonuslen == 0)
+    return znode;
+
+  // the bonus buffer follows the block pointers
+  const u8 *bonus = reinterpret_cast<const u8 *>(&dnode.bps[dnode.nblkptr]);
+  const std::size_t bonusLength = std::min<std::size_t>(
+      dnode.bonuslen,
+      reinterpret_cast<const u8 *>(&dnode) + sizeof(dnode) - bonus);
+
+  // system attributes written by a machine of the other byte order are left
+  // alone when the dnode is swapped (see byteswap_dnode_array()): swap the
+  // header of a copy here, and the decoded ZNode at the end, as every ZPL
+  // attribute decoded here consists of 64-bit integers
+  u8   swappedBonus[sizeof(physical::DNode)];
+  bool swapped = false;
+  if (static_cast<DNodeType>(dnode.bonustype) == DNodeType::SystemAttributes &&
+      bonusLength >= sizeof(physical::SaHeader) &&
+      reinterpret_cast<const physical::SaHeader *>(bonus)->magic ==
+          BSWAP_32(static_cast<u32>(SA_MAGIC))) {
+    std::memcpy(swappedBonus, bonus, bonusLength);
+
+    auto &header       = *reinterpret_cast<physical::SaHeader *>(swappedBonus);
+    header.magic       = BSWAP_32(header.magic);
+    header.layout_info = BSWAP_16(header.layout_info);
+
+    const std::size_t headerSize =
+        std::min<std::size_t>(header.headerSize(), bonusLength);
+    if (headerSize > sizeof(physical::SaHeader))
+      byteswap_uint16_array(swappedBonus + sizeof(physical::SaHeader),
+                            (headerSize - sizeof(physical::SaHeader)) &
+                                ~static_cast<std::size_t>(1));
+
+    bonus   = swappedBonus;
+    swapped = true;
+  }
+
+  switch (static_cast<DNodeType>(dnode.bonustype)) {
+  case DNodeType::ZNode:
+    if (bonusLength >= sizeof(physical::ZNodePhys))
+      fromZNodePhys(*reinterpret_cast<const physical::ZNodePhys *>(bonus),
+                    OUT & znode);
+    break;
+
+  case DNodeType::SystemAttributes: {
+    if (!isLoaded()) {
+      // no registry: assume the most common layout
+      if (bonusLength >= sizeof(physical::ZNode))
+        std::memcpy(&znode, bonus, sizeof(physical::ZNode));
+      break;
+    }
+
+    if (bonusLength < sizeof(physical::SaHeader))
+      break;
+
+    const auto &header = *reinterpret_cast<const physical::SaHeader *>(bonus);
+    if (!header.isValid() || header.headerSize() > bonusLength ||
+        header.layout() >= m_layouts.size() ||
+        m_layouts[header.layout()].attrs.empty()) {
+      LOG("Invalid SA header or unknown layout, ignoring the attributes!\n");
+      break;
+    }
+
+    const Layout &    layout      = m_layouts[header.layout()];
+    const u8 *        attrs       = bonus + header.headerSize();
+    const std::size_t attrsLength = bonusLength - header.headerSize();
+
+    for (const FieldCopy &copy : layout.fixed) {
+      if (copy.from + copy.length <= attrsLength)
+        std::memcpy(reinterpret_cast<u8 *>(&znode) + copy.to,
+                    attrs + copy.from, copy.length);
+    }
+
+    if (layout.firstVariable < layout.attrs.size())
+      decodeVariable(layout, bonus, bonusLength, INOUT & znode);
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  if (swapped)
+    byteswap_uint64_array(&znode, sizeof(znode));
+
+  return znode;
+}
+
+} // end namespace zfs
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "zfs/checksum.h"
+#include "zfs/physical/dnode.h"
+#include "zfs/physical/objset.h"
+#include "zfs/scrub.h"
+
+// the number of blocks a thread reads and verifies at once
+#define SCRUB_BATCH 64
+
+// the object ids of the special dnodes of an objset, see dmu.h
+#define DMU_USERUSED_OBJECT (~0uLL)
+#define DMU_GROUPUSED_OBJECT (~1uLL)
+
+namespace zfs {
+
+namespace {
+
+// A block still to be read, and where it is in the tree.
+struct ScrubItem {
+  physical::Blkptr bp;
+  u64              dataset;
+  u64              object;
+  u64              blockid; // at the level of BP
+  u64              minTxg;  // older blocks belong to the previous snapshot
+};
+
+struct ScrubState {
+  ZPoolReader *reader;
+
+  std::mutex              mutex; // guards everything below
+  std::condition_variable cond;
+  std::vector<ScrubItem>  stack;    // the blocks still to be read, next last
+  unsigned                busy = 0; // threads reading a batch
+  ScrubResult             result;
+};
+
+} // end anonymous namespace
+
+// Whether ZPoolReader can read BP's block at all.
+static bool isSupported(const physical::Blkptr &bp) {
+  if (bp.embedded)
+    return bp.getEmbeddedType() == BP_EMBEDDED_TYPE_DATA;
+
+  for (u32 i = 0; i < bp.numCopies(); i++) {
+    if (bp.dva[i].gang_block)
+      return false;
+  }
+
+  return true;
+}
+
+static void addChild(const physical::Blkptr &bp, u64 dataset, u64 object,
+                     u64 blockid, u64 minTxg,
+                     INOUT std::vector<ScrubItem> *items) {
+  // holes have a type, but no data
+  if (!bp.isValid() || (!bp.embedded && bp.numCopies() == 0))
+    return;
+
+  if (bp.birth_txg <= minTxg)
+    return;
+
+  items->push_back(ScrubItem{bp, dataset, object, blockid, minTxg});
+}
+
+static void addDNode(const physical::DNode &dnode, u64 dataset, u64 object,
+                     u64 minTxg, INOUT std::vector<ScrubItem> *items) {
+  if (!dnode.isValid())
+    return;
+
+  for (u64 i = 0; i < dnode.nblkptr; i++)
+    addChild(dnode.bps[i], dataset, object, i, minTxg, INOUT items);
+}
+
+// Where ITEM's block is on the disk. Embedded blocks have no address, they come
+// first.
+static u64 blockAddress(const ScrubItem &item) {
+  return item.bp.embedded ? 0 : item.bp.dva[0].getAddress();
+}
+
+// Adds the blocks ITEM's block, BLOCK, points to.
+static void expand(const ScrubItem &item, const BlockPtr &block,
+                   INOUT std::vector<ScrubItem> *items) {
+  const physical::Blkptr &bp = item.bp;
+
+  if (bp.lvl > 0) {
+    const auto *bps =
+        reinterpret_cast<const physical::Blkptr *>(block.data());
+    const std::size_t n = block.size() / sizeof(physical::Blkptr);
+    for (std::size_t i = 0; i < n; i++)
+      addChild(bps[i], item.dataset, item.object, item.blockid * n + i,
+               item.minTxg, INOUT items);
+    return;
+  }
+
+  switch (bp.type) {
+  case DNodeType::ObjSet: {
+    if (block.size() < sizeof(physical::DNode))
+      return;
+
+    const auto &objset =
+        *reinterpret_cast<const physical::ObjSet *>(block.data());
+    addDNode(objset.metadnode, item.dataset, 0, item.minTxg, INOUT items);
+
+    // objsets from before user accounting only have the meta dnode
+    if (block.size() >= sizeof(physical::ObjSet)) {
+      addDNode(objset.userused_dnode, item.dataset, DMU_USERUSED_OBJECT,
+               item.minTxg, INOUT items);
+      addDNode(objset.groupused_dnode, item.dataset, DMU_GROUPUSED_OBJECT,
+               item.minTxg, INOUT items);
+    }
+    break;
+  }
+
+  case DNodeType::DNode: {
+    const auto *dnodes =
+        reinterpret_cast<const physical::DNode *>(block.data());
+    const std::size_t n = block.size() / sizeof(physical::DNode);
+
+    for (std::size_t i = 0; i < n; i++) {
+      const physical::DNode &dnode  = dnodes[i];
+      const u64              object = item.blockid * n + i;
+      addDNode(dnode, item.dataset, object, item.minTxg, INOUT items);
+
+      // the DSL datasets of the MOS lead to the objsets of the datasets and
+      // snapshots, each of which only owns what was born after its previous
+      // snapshot
+      if (item.dataset == 0 && dnode.isValid() &&
+          dnode.bonustype == static_cast<u8>(DNodeType::DataSet) &&
+          dnode.nblkptr < 3 &&
+          dnode.bonuslen >= sizeof(physical::DSLDataSet)) {
+        const auto &ds = dnode.getBonusAs<physical::DSLDataSet>();
+        addChild(ds.bp, object, 0, 0, ds.prev_snap_txg, INOUT items);
+      }
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+// Reads and verifies ITEMS, adding their children to CHILDREN.
+static void scrubBatch(ScrubState &state, const std::vector<ScrubItem> &items,
+                       INOUT std::vector<ScrubItem> *children) {
+  ScrubResult                           counts;
+  std::vector<const physical::Blkptr *> bps;
+  std::vector<const ScrubItem *>        batch;
+
+  for (const ScrubItem &item : items) {
+    const physical::Blkptr &bp = item.bp;
+    if (!isSupported(bp)) {
+      counts.unsupported++;
+      continue;
+    }
+
+    if (!bp.embedded) {
+      if (!canVerifyChecksum(bp))
+        counts.unverified++;
+
+      counts.bytes += bp.getPhysicalSize();
+      state.reader->prefetch(bp, /*dva=*/0);
+    }
+
+    bps.push_back(&bp);
+    batch.push_back(&item);
+  }
+
+  const std::vector<BlockPtr> blocks = state.reader->readBatch(bps);
+  counts.blocks += blocks.size();
+
+  for (std::size_t i = 0; i < blocks.size(); i++) {
+    const ScrubItem &item = *batch[i];
+    if (blocks[i]) {
+      expand(item, blocks[i], INOUT children);
+      continue;
+    }
+
+    counts.damaged++;
+    ScrubResult::Damage &damage =
+        counts.damage
+            .emplace(std::make_pair(item.dataset, item.object),
+                     ScrubResult::Damage{item.bp.type, 0})
+            .first->second;
+    damage.blocks++;
+  }
+
+  std::lock_guard<std::mutex> lock{state.mutex};
+
+  ScrubResult &result = state.result;
+  result.blocks += counts.blocks;
+  result.bytes += counts.bytes;
+  result.unverified += counts.unverified;
+  result.unsupported += counts.unsupported;
+  result.damaged += counts.damaged;
+
+  for (const auto &entry : counts.damage) {
+    auto it = result.damage.find(entry.first);
+    if (it == result.damage.end())
+      result.damage.insert(entry);
+    else
+      it->second.blocks += entry.second.blocks;
+  }
+}
+
+// Takes batches of blocks off the top of the stack until there is nothing left
+// to read. The children of a batch go back on top, so that a subtree is done
+// before its siblings are started and the stack stays shallow.
+static void scrubWorker(ScrubState &state) {
+  std::vector<ScrubItem> items;
+  std::vector<ScrubItem> children;
+
+  std::unique_lock<std::mutex> lock{state.mutex};
+  for (;;) {
+    state.cond.wait(lock, [&state] {
+      return !state.stack.empty() || state.busy == 0;
+    });
+
+    // nobody is left to add more
+    if (state.stack.empty())
+      return;
+
+    const std::size_t n =
+        std::min<std::size_t>(SCRUB_BATCH, state.stack.size());
+    items.assign(state.stack.end() - n, state.stack.end());
+    state.stack.resize(state.stack.size() - n);
+    state.busy++;
+
+    lock.unlock();
+
+    std::sort(items.begin(), items.end(),
+              [](const ScrubItem &lhs, const ScrubItem &rhs) {
+                return blockAddress(lhs) < blockAddress(rhs);
+              });
+
+    children.clear();
+    scrubBatch(state, items, INOUT & children);
+
+    // the lowest addresses on top, so that they are read first
+    std::sort(children.begin(), children.end(),
+              [](const ScrubItem &lhs, const ScrubItem &rhs) {
+                return blockAddress(lhs) > blockAddress(rhs);
+              });
+
+    lock.lock();
+
+    state.stack.insert(state.stack.end(), children.begin(), children.end());
+    state.busy--;
+    state.cond.notify_all();
+  }
+}
+
+ScrubResult scrubPool(ZPoolReader &reader, const physical::Blkptr &rootbp,
+                      unsigned numThreads) {
+  const auto start = std::chrono::steady_clock::now();
+
+  ScrubState state;
+  state.reader = &reader;
+  addChild(rootbp, 0, 0, 0, 0, INOUT & state.stack);
+
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < numThreads; t++)
+    pool.emplace_back(scrubWorker, std::ref(state));
+
+  scrubWorker(state);
+
+  for (std::thread &thread : pool)
+    thread.join();
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  state.result.seconds = elapsed.count();
+
+  return std::move(state.result);
+}
+
+void printScrubReport(std::FILE *fp, const ScrubResult &result) {
+  const double mb = static_cast<double>(result.bytes) / MB;
+
+  std::fprintf(fp, "Scrubbed %lu blocks (%.1f MB) in %.1f s (%.1f MB/s)\n",
+               result.blocks, mb, result.seconds,
+               result.seconds > 0 ? mb / result.seconds : 0.0);
+  std::fprintf(fp, "  %lu blocks have checksums that cannot be verified\n",
+               result.unverified);
+  std::fprintf(fp, "  %lu blocks cannot be read (gang blocks)\n",
+               result.unsupported);
+  std::fprintf(fp, "  %lu blocks are damaged\n", result.damaged);
+
+  if (result.damage.empty())
+    return;
+
+  std::fprintf(fp, "\ndataset\tobject\ttype\tdamaged blocks\n");
+  for (const auto &entry : result.damage) {
+    if (entry.first.first == 0)
+      std::fprintf(fp, "mos");
+    else
+      std::fprintf(fp, "%lu", entry.first.first);
+
+    std::fprintf(fp, "\t%ld\t%s (%u)\t%lu\n",
+                 static_cast<long>(entry.first.second),
+                 getDNodeTypeAsString(entry.second.type),
+                 static_cast<u32>(entry.second.type), entry.second.blocks);
+  }
+}
+
+} // end namespace zfs
@@ -0,0 +1,486 @@
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include "utils/log.h"
+
+#include "zfs/space_map.h"
+#include "zfs/zap.h"
+
+// where the allocatable space of a vdev starts, after the two front labels and
+// the boot block reservation
+#define VDEV_DATA_START SECTOR_TO_ADDR(0uL)
+
+// the number of blocks of an object read together by forEachObjectBlock()
+#define SPACE_MAP_BATCH 32
+
+// nvpair data types, see data_type_t in nvpair.h
+#define NV_TYPE_UINT64 8
+#define NV_TYPE_NVLIST 19
+#define NV_TYPE_NVLIST_ARRAY 20
+
+// nvs_header_t::nvh_encoding
+#define NV_ENCODE_XDR 1
+
+// how deep embedded nvlists may go before the config is considered damaged
+#define NV_MAX_DEPTH 16
+
+// space map entry types, see maptype_t in space_map.h
+#define SM_ALLOC 0
+#define SM_FREE 1
+
+namespace zfs {
+
+namespace {
+
+// space_map_phys_t, the bonus of a space map object, without the histogram
+// that newer pools append
+struct SpaceMapPhys {
+  u64 object; // the object id of the space map itself
+  u64 length; // bytes of entries in the object
+  u64 alloc;  // bytes allocated, signed
+} __attribute__((packed));
+
+// Collects the 64-bit integers of an XDR encoded nvlist by their path: "a.b"
+// for the pair B of the embedded nvlist A, and "a[1].b" for the pair B of the
+// second nvlist of the array A. Everything else is skipped.
+struct NvListParser {
+  const u8 *                  data;
+  std::size_t                 size;
+  std::size_t                 pos;
+  std::map<std::string, u64> *values;
+
+  bool readU32(OUT u32 *value) {
+    if (size - pos < sizeof(u32))
+      return false;
+
+    u32 be;
+    std::memcpy(&be, data + pos, sizeof(be));
+    *value = __builtin_bswap32(be);
+    pos += sizeof(u32);
+    return true;
+  }
+
+  bool readU64(OUT u64 *value) {
+    u32 high, low;
+    if (!readU32(OUT & high) || !readU32(OUT & low))
+      return false;
+
+    *value = static_cast<u64>(high) << 32 | low;
+    return true;
+  }
+
+  // strings are a length followed by the bytes, padded to 4 bytes
+  bool readString(OUT std::string *value) {
+    u32 length;
+    if (!readU32(OUT & length) || size - pos < length)
+      return false;
+
+    value->assign(reinterpret_cast<const char *>(data + pos), length);
+    pos += (length + 3) & ~3u;
+    return pos <= size;
+  }
+
+  bool parseList(const std::string &prefix, unsigned depth) {
+    u32 version, flags;
+    if (depth > NV_MAX_DEPTH || !readU32(OUT & version) ||
+        !readU32(OUT & flags))
+      return false;
+
+    for (;;) {
+      const std::size_t pairStart = pos;
+
+      // the list ends with a pair of sizes that are both 0
+      u32 encodedSize, decodedSize;
+      if (!readU32(OUT & encodedSize) || !readU32(OUT & decodedSize))
+        return false;
+      if (encodedSize == 0 && decodedSize == 0)
+        return true;
+
+      std::string name;
+      u32         type, count;
+      if (!readString(OUT & name) || !readU32(OUT & type) ||
+          !readU32(OUT & count))
+        return false;
+
+      const std::string path = prefix + name;
+
+      // embedded nvlists follow their pair, whatever its size says
+      if (type == NV_TYPE_NVLIST) {
+        if (!parseList(path + ".", depth + 1))
+          return false;
+        continue;
+      }
+
+      if (type == NV_TYPE_NVLIST_ARRAY) {
+        for (u32 i = 0; i < count; i++) {
+          if (!parseList(path + "[" + std::to_string(i) + "].", depth + 1))
+            return false;
+        }
+        continue;
+      }
+
+      u64 value;
+      if (type == NV_TYPE_UINT64 && count == 1 && readU64(OUT & value))
+        (*values)[path] = value;
+
+      if (encodedSize > size - pairStart)
+        return false;
+      pos = pairStart + encodedSize;
+    }
+  }
+};
+
+} // end anonymous namespace
+
+void ExtentTree::add(u64 start, u64 end) {
+  if (start >= end)
+    return;
+
+  // merge with the extents it overlaps or touches
+  auto it = m_extents.upper_bound(start);
+  if (it != m_extents.begin() && std::prev(it)->second >= start) {
+    --it;
+    start = it->first;
+  }
+
+  while (it != m_extents.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it  = m_extents.erase(it);
+  }
+
+  m_extents.emplace(start, end);
+}
+
+void ExtentTree::remove(u64 start, u64 end) {
+  if (start >= end)
+    return;
+
+  auto it = m_extents.upper_bound(start);
+
+  // the extent starting before START keeps its head, and its tail if it goes
+  // past END
+  if (it != m_extents.begin() && std::prev(it)->second > start) {
+    auto      prev    = std::prev(it);
+    const u64 prevEnd = prev->second;
+
+    if (prev->first == start)
+      m_extents.erase(prev);
+    else
+      prev->second = start;
+
+    if (prevEnd > end) {
+      m_extents.emplace(end, prevEnd);
+      return;
+    }
+  }
+
+  while (it != m_extents.end() && it->first < end) {
+    const u64 itEnd = it->second;
+    it              = m_extents.erase(it);
+
+    if (itEnd > end) {
+      m_extents.emplace(end, itEnd);
+      break;
+    }
+  }
+}
+
+u64 ExtentTree::bytes() const {
+  u64 total = 0;
+  for (const auto &extent : m_extents)
+    total += extent.second - extent.first;
+  return total;
+}
+
+std::vector<Extent> ExtentTree::extents() const {
+  std::vector<Extent> result;
+  result.reserve(m_extents.size());
+
+  for (const auto &extent : m_extents)
+    result.push_back(Extent{extent.first, extent.second});
+
+  return result;
+}
+
+std::vector<Extent> ExtentTree::gaps(u64 start, u64 end) const {
+  std::vector<Extent> result;
+
+  // starting with the extent START is in, if any
+  auto it = m_extents.upper_bound(start);
+  if (it != m_extents.begin() && std::prev(it)->second > start)
+    --it;
+
+  u64 cursor = start;
+  for (; it != m_extents.end() && it->first < end; ++it) {
+    if (it->first > cursor)
+      result.push_back(Extent{cursor, it->first});
+    cursor = std::max(cursor, it->second);
+  }
+
+  if (cursor < end)
+    result.push_back(Extent{cursor, end});
+
+  return result;
+}
+
+// Calls FN with the blocks of the object DNODE, in order, up to SIZE bytes.
+// Holes are passed as zeros. Returns false if a block cannot be read.
+template <typename TFn>
+static bool forEachObjectBlock(ZPoolReader &          reader,
+                               const physical::DNode &dnode, u64 size,
+                               TFn fn) {
+  IndirectBlock     blocks{reader, dnode};
+  const std::size_t blockSize = blocks.dataBlockSize();
+  const u64         numBlocks =
+      std::min<u64>((size + blockSize - 1) / blockSize, blocks.numDataBlocks());
+
+  std::vector<u8> zeros;
+  for (u64 first = 0; first < numBlocks; first += SPACE_MAP_BATCH) {
+    const u64 last = std::min<u64>(first + SPACE_MAP_BATCH, numBlocks);
+
+    std::vector<const physical::Blkptr *> bps;
+    for (u64 blockid = first; blockid < last; blockid++) {
+      const physical::Blkptr *bp = blocks.blkptrByID(blockid);
+
+      // holes of hole_birth pools keep their type and birth, but no DVA;
+      // they read as zeros, see below
+      if (!bp || !bp->isValid() || (!bp->embedded && bp->numCopies() == 0))
+        bp = nullptr;
+
+      bps.push_back(bp);
+    }
+
+    std::vector<const physical::Blkptr *> toRead;
+    for (const physical::Blkptr *bp : bps) {
+      if (bp)
+        toRead.push_back(bp);
+    }
+
+    std::vector<BlockPtr> read = reader.readBatch(toRead);
+    std::size_t           next = 0;
+
+    for (u64 blockid = first; blockid < last; blockid++) {
+      const std::size_t length =
+          std::min<u64>(blockSize, size - blockid * blockSize);
+      const physical::Blkptr *bp = bps[blockid - first];
+
+      if (!bp) {
+        zeros.resize(blockSize);
+        fn(zeros.data(), length);
+        continue;
+      }
+
+      const BlockPtr &block = read[next++];
+      if (!block) {
+        LOG("Could not read block %lu of an object!\n", blockid);
+        return false;
+      }
+
+      fn(static_cast<const u8 *>(block.data()),
+         std::min<std::size_t>(length, block.size()));
+    }
+  }
+
+  return true;
+}
+
+static bool readConfig(ZPoolReader &                      reader,
+                       IndirectObjBlock<physical::DNode> &mos,
+                       OUT std::map<std::string, u64> *config) {
+  const physical::DNode *objDir = nullptr;
+  for (const physical::DNode &dnode : mos.objects()) {
+    if (dnode.isValid() && dnode.type == DNodeType::ObjDirectory) {
+      objDir = &dnode;
+      break;
+    }
+  }
+
+  if (!objDir) {
+    LOG("Could not find the object directory!\n");
+    return false;
+  }
+
+  u64       configObjID;
+  ZapObject zap{reader, *objDir};
+  if (!zap.isValid() || !zap.findEntry("config", OUT & configObjID) ||
+      configObjID >= mos.numObjects()) {
+    LOG("Could not find the pool configuration!\n");
+    return false;
+  }
+
+  // the bonus holds the size of the packed nvlist
+  const physical::DNode &configNode = mos.objectByID(configObjID);
+  if (configNode.type != DNodeType::PackedNvList || configNode.bonuslen < 8 ||
+      configNode.nblkptr >= 3) {
+    LOG("The pool configuration is not a packed nvlist!\n");
+    return false;
+  }
+
+  const u64       packedSize = configNode.getBonusAs<u64>();
+  std::vector<u8> packed;
+  const bool      read = forEachObjectBlock(
+      reader, configNode, packedSize, [&](const u8 *data, std::size_t size) {
+        packed.insert(packed.end(), data, data + size);
+      });
+
+  // a 4 byte header says how the pairs are encoded
+  if (!read || packed.size() < 4 || packed[0] != NV_ENCODE_XDR) {
+    LOG("Could not read the pool configuration!\n");
+    return false;
+  }
+
+  NvListParser parser{packed.data(), packed.size(), 4, config};
+  if (!parser.parseList("", 0)) {
+    LOG("The pool configuration is damaged!\n");
+    return false;
+  }
+
+  return true;
+}
+
+// Replays the space map of the metaslab starting at MS_START (relative to the
+// start of the allocatable space) into ALLOCATED.
+static bool replaySpaceMap(ZPoolReader &reader, const physical::DNode &dnode,
+                           u64 msStart, u64 msSize, unsigned ashift,
+                           INOUT ExtentTree *allocated) {
+  if (dnode.type != DNodeType::SpaceMap || dnode.nblkptr >= 3 ||
+      dnode.bonuslen < sizeof(SpaceMapPhys)) {
+    LOG("Metaslab at 0x%lx: not a space map!\n", msStart);
+    return false;
+  }
+
+  const auto &phys = dnode.getBonusAs<SpaceMapPhys>();
+
+  const auto apply = [&](u64 type, u64 offset, u64 run) {
+    if (offset >= msSize || run > msSize - offset)
+      return;
+
+    const u64 start = VDEV_DATA_START + msStart + offset;
+    if (type == SM_ALLOC)
+      allocated->add(start, start + run);
+    else
+      allocated->remove(start, start + run);
+  };
+
+  // the first word of a two-word entry, if the second one is still to come
+  bool havePrefix = false;
+  u64  prefix     = 0;
+
+  return forEachObjectBlock(
+      reader, dnode, phys.length, [&](const u8 *data, std::size_t size) {
+        for (std::size_t i = 0; i + sizeof(u64) <= size; i += sizeof(u64)) {
+          u64 word;
+          std::memcpy(&word, data + i, sizeof(word));
+
+          if (havePrefix) {
+            // run in bits 24-59, then the type in bit 63 and the offset below
+            havePrefix = false;
+            apply(word >> 63, (word & ~(1uL << 63)) << ashift,
+                  (((prefix >> 24) & ((1uL << 36) - 1)) + 1) << ashift);
+            continue;
+          }
+
+          switch (word >> 62) {
+          case 2: // debug entries, with the txg and the sync pass
+            break;
+
+          case 3:
+            havePrefix = true;
+            prefix     = word;
+            break;
+
+          default:
+            // offset in bits 16-62, the type in bit 15, the run below
+            apply((word >> 15) & 1, ((word >> 16) & ((1uL << 47) - 1))
+                                        << ashift,
+                  ((word & ((1uL << 15) - 1)) + 1) << ashift);
+            break;
+          }
+        }
+      });
+}
+
+bool loadSpaceMaps(ZPoolReader &reader, IndirectObjBlock<physical::DNode> &mos,
+                   OUT SpaceMaps *maps) {
+  try {
+    std::map<std::string, u64> config;
+    if (!readConfig(reader, mos, OUT & config))
+      return false;
+
+    // the config of the MOS has the root vdev, with the top level vdevs as
+    // its children
+    const std::string vdev = "vdev_tree.children[0].";
+    if (config.count("vdev_tree.children[1].id")) {
+      std::fprintf(stderr, "Warning: the pool has several top level vdevs, "
+                           "their space maps are not supported\n");
+      return false;
+    }
+
+    const auto msArray = config.find(vdev + "metaslab_array");
+    const auto msShift = config.find(vdev + "metaslab_shift");
+    const auto ashift  = config.find(vdev + "ashift");
+    const auto asize   = config.find(vdev + "asize");
+    if (msArray == config.end() || msShift == config.end() ||
+        ashift == config.end() || asize == config.end() ||
+        msShift->second >= 64 || ashift->second >= 32 ||
+        msArray->second >= mos.numObjects()) {
+      LOG("The pool configuration has no metaslabs!\n");
+      return false;
+    }
+
+    const u64 msSize   = 1uL << msShift->second;
+    maps->metaslabs    = asize->second >> msShift->second;
+    maps->start        = VDEV_DATA_START;
+    maps->end          = VDEV_DATA_START + maps->metaslabs * msSize;
+    maps->allocated    = ExtentTree{};
+
+    // the space map object of every metaslab, 0 if nothing has ever been
+    // allocated there
+    std::vector<u64> smObjIDs;
+    const bool       read = forEachObjectBlock(
+        reader, mos.objectByID(msArray->second), maps->metaslabs * sizeof(u64),
+        [&](const u8 *data, std::size_t size) {
+          for (std::size_t i = 0; i + sizeof(u64) <= size; i += sizeof(u64)) {
+            u64 objid;
+            std::memcpy(&objid, data + i, sizeof(objid));
+            smObjIDs.push_back(objid);
+          }
+        });
+
+    if (!read) {
+      LOG("Could not read the metaslab array!\n");
+      return false;
+    }
+
+    for (u64 i = 0; i < smObjIDs.size(); i++) {
+      const u64 objid = smObjIDs[i];
+      if (objid == 0)
+        continue;
+
+      bool replayed = false;
+      try {
+        replayed = objid < mos.numObjects() &&
+                   replaySpaceMap(reader, mos.objectByID(objid), i * msSize,
+                                  msSize, static_cast<unsigned>(ashift->second),
+                                  INOUT & maps->allocated);
+      } catch (const std::exception &ex) {
+        LOG("Metaslab %lu: %s\n", i, ex.what());
+      }
+
+      if (!replayed)
+        std::fprintf(stderr,
+                     "Warning: the space map of metaslab %lu cannot be read, "
+                     "some of its allocations may be missing\n",
+                     i);
+    }
+
+    return true;
+  } catch (const std::exception &ex) {
+    LOG("Could not load the space maps: %s\n", ex.what());
+    return false;
+  }
+}
+
+} // end namespace zfs
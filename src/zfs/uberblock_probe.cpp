@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#include "utils/log.h"
+
+#include "zfs/physical/fzap.h"
+#include "zfs/physical/mzap.h"
+#include "zfs/physical/objset.h"
+#include "zfs/uberblock_probe.h"
+
+// the number of uberblocks probed at the same time; probes are latency bound
+#define PROBE_THREADS 8
+
+namespace zfs {
+
+// Checks that the object directory has the entry everything else hangs off.
+static bool probeObjDirectory(const BlockPtr &block) {
+  if (block.size() < sizeof(physical::FatZapHeader))
+    return false;
+
+  const auto &header =
+      *reinterpret_cast<const physical::FatZapHeader *>(block.data());
+
+  // a fat ZAP would take more reads to search, a valid header has to do
+  if (header.block_type != physical::ZapBlockType::Micro)
+    return header.isValid();
+
+  const auto *entries = reinterpret_cast<const physical::MZapEntry *>(
+      static_cast<const char *>(block.data()) + sizeof(physical::MZapHeader));
+  const std::size_t numEntries =
+      physical::MZapHeader::getNumChunks(block.size());
+
+  for (std::size_t i = 0; i < numEntries; i++) {
+    if (std::strncmp(entries[i].name, "root_dataset",
+                     sizeof(entries[i].name)) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+bool probeUberblock(BlockCache &cache, const physical::Uberblock &ub) {
+  std::shared_ptr<const BlockPtr> objset = cache.read(ub.rootbp);
+  if (!objset || objset->size() < sizeof(physical::ObjSet)) {
+    LOG("Probe txg %lu: cannot read the root objset\n", ub.txg);
+    return false;
+  }
+
+  const physical::DNode &metadnode =
+      reinterpret_cast<const physical::ObjSet *>(objset->data())->metadnode;
+  if (!metadnode.isValid() || metadnode.type != DNodeType::DNode) {
+    LOG("Probe txg %lu: invalid MOS meta dnode\n", ub.txg);
+    return false;
+  }
+
+  std::shared_ptr<const BlockPtr> dnodes = cache.readFirstDataBlock(metadnode);
+  if (!dnodes || dnodes->size() < 2 * sizeof(physical::DNode)) {
+    LOG("Probe txg %lu: cannot read the MOS dnode array\n", ub.txg);
+    return false;
+  }
+
+  // the object directory is always object 1 of the MOS
+  const physical::DNode &objDir =
+      reinterpret_cast<const physical::DNode *>(dnodes->data())[1];
+  if (!objDir.isValid() || objDir.type != DNodeType::ObjDirectory) {
+    LOG("Probe txg %lu: no object directory\n", ub.txg);
+    return false;
+  }
+
+  std::shared_ptr<const BlockPtr> zap = cache.readFirstDataBlock(objDir);
+  if (!zap || !probeObjDirectory(*zap)) {
+    LOG("Probe txg %lu: cannot decode the object directory\n", ub.txg);
+    return false;
+  }
+
+  return true;
+}
+
+const UberblockEntry *
+findUsableUberblock(ZPoolReader &reader,
+                    const std::vector<UberblockEntry> &ubs) {
+  // copies of the same uberblock in different labels only need one probe
+  std::vector<const UberblockEntry *> candidates;
+  for (const UberblockEntry &entry : ubs) {
+    if (candidates.empty() || candidates.back()->ub.txg != entry.ub.txg ||
+        std::memcmp(&candidates.back()->ub.rootbp, &entry.ub.rootbp,
+                    sizeof(entry.ub.rootbp)) != 0)
+      candidates.push_back(&entry);
+  }
+
+  BlockCache               cache{reader};
+  std::atomic<std::size_t> next{0};
+  std::atomic<std::size_t> best{candidates.size()};
+
+  const auto worker = [&] {
+    for (;;) {
+      const std::size_t i = next++;
+
+      // anything older than a usable uberblock is not interesting anymore
+      if (i >= candidates.size() || i > best)
+        return;
+
+      if (!probeUberblock(cache, candidates[i]->ub))
+        continue;
+
+      std::size_t current = best;
+      while (i < current && !best.compare_exchange_weak(current, i)) {
+      }
+    }
+  };
+
+  const std::size_t numThreads =
+      std::min<std::size_t>(PROBE_THREADS, candidates.size());
+
+  std::vector<std::thread> threads;
+  for (std::size_t t = 1; t < numThreads; t++)
+    threads.emplace_back(worker);
+
+  worker();
+
+  for (std::thread &thread : threads)
+    thread.join();
+
+  return best < candidates.size() ? candidates[best] : nullptr;
+}
+
+} // end namespace zfs
@@ -0,0 +1,410 @@
+#include <algorithm>
+#include <cstring>
+
+#include "utils/log.h"
+
+#include "zfs/zap.h"
+
+// the number of fat ZAP leaf blocks read in one go
+#define ZAP_LEAF_BATCH 16
+
+#define ZFS_CRC64_POLY 0xC96C5795D7870F42uLL
+
+namespace zfs {
+
+namespace {
+
+// The layout of a fat ZAP leaf block only depends on the block size.
+struct LeafGeometry {
+  explicit LeafGeometry(std::size_t blockSize)
+      : hashEntries{blockSize / 32},
+        numChunks{(blockSize - 2 * hashEntries) / ZAP_LEAF_CHUNKSIZE - 2} {}
+
+  const physical::ZapLeafHeader &header(const BlockPtr &leaf) const {
+    return *reinterpret_cast<const physical::ZapLeafHeader *>(leaf.data());
+  }
+
+  const physical::ZapLeafChunk *chunks(const BlockPtr &leaf) const {
+    return reinterpret_cast<const physical::ZapLeafChunk *>(
+        reinterpret_cast<const char *>(leaf.data()) +
+        sizeof(physical::ZapLeafHeader) + hashEntries * sizeof(u16));
+  }
+
+  std::size_t hashEntries;
+  std::size_t numChunks;
+};
+
+struct CRC64Table {
+  CRC64Table() {
+    for (unsigned i = 0; i < 256; i++) {
+      u64 crc = i;
+      for (unsigned bit = 0; bit < 8; bit++)
+        crc = (crc >> 1) ^ (-(crc & 1) & ZFS_CRC64_POLY);
+
+      table[i] = crc;
+    }
+  }
+
+  u64 table[256];
+};
+
+} // end anonymous namespace
+
+u64 zapHash(u64 salt, const char *name, std::size_t length,
+            unsigned hashBits) {
+  static const CRC64Table crc64;
+
+  u64 hash = salt;
+  for (std::size_t i = 0; i < length; i++) {
+    hash = (hash >> 8) ^
+           crc64.table[(hash ^ static_cast<u8>(name[i])) & 0xff];
+  }
+
+  // ZFS keeps the high bits, the low ones are for the collision differentiator
+  return hash & ~((1uLL << (64 - hashBits)) - 1);
+}
+
+// Follows a chain of array chunks, copying SIZE bytes into OUT.
+static bool readLeafArray(const physical::ZapLeafChunk *chunks,
+                          std::size_t numChunks, u16 chunkIndex,
+                          std::size_t size, OUT u8 *out) {
+  while (size > 0) {
+    if (chunkIndex >= numChunks)
+      return false;
+
+    const physical::ZapLeafChunk &chunk = chunks[chunkIndex];
+    if (chunk.type != physical::ZapChunkType::Array)
+      return false;
+
+    const std::size_t n = std::min<std::size_t>(size, ZAP_LEAF_ARRAY_BYTES);
+    std::memcpy(out, chunk.array.data, n);
+
+    out += n;
+    size -= n;
+    chunkIndex = chunk.array.next;
+  }
+
+  return true;
+}
+
+struct ZapObject::Cursor {
+  explicit Cursor(ZapObject &zap)
+      : m_zap{&zap}, m_geometry{zap.blockSize()} {}
+
+  bool next(OUT ZapEntry *entry) {
+    return m_zap->isMicro() ? nextMicro(OUT entry) : nextFat(OUT entry);
+  }
+
+private:
+  bool nextMicro(OUT ZapEntry *entry);
+  bool nextFat(OUT ZapEntry *entry);
+
+  void collectLeaves();
+  void addLeaves(const u64 *table, std::size_t count);
+  bool fetchBatch();
+
+  bool decodeEntry(const BlockPtr &leaf, const physical::ZapLeafChunk &chunk,
+                   OUT ZapEntry *entry) const;
+
+  ZapObject *  m_zap;
+  LeafGeometry m_geometry;
+
+  // micro ZAP: index of the next entry, fat ZAP: index of the next chunk in the
+  // current leaf
+  std::size_t m_index = 0;
+
+  bool                  m_leavesCollected = false;
+  std::vector<u64>      m_leafIDs;
+  std::size_t           m_nextLeaf = 0;
+  std::vector<BlockPtr> m_batch;
+  std::size_t           m_batchPos = 0;
+};
+
+bool ZapObject::Cursor::nextMicro(OUT ZapEntry *entry) {
+  MZapBlockPtr &mzap = m_zap->m_micro;
+
+  while (m_index < mzap.numEntries()) {
+    const physical::MZapEntry &mentry = mzap[m_index++];
+    if (!mentry.isValid())
+      continue;
+
+    entry->name.assign(mentry.name, strnlen(mentry.name, sizeof(mentry.name)));
+    entry->value = mentry.value;
+    entry->hash  = 0;
+    entry->values.clear();
+    return true;
+  }
+
+  return false;
+}
+
+void ZapObject::Cursor::addLeaves(const u64 *table, std::size_t count) {
+  // all pointer table entries of a leaf are adjacent
+  for (std::size_t i = 0; i < count; i++) {
+    if (m_leafIDs.empty() || m_leafIDs.back() != table[i])
+      m_leafIDs.push_back(table[i]);
+  }
+}
+
+void ZapObject::Cursor::collectLeaves() {
+  m_leavesCollected = true;
+
+  const physical::FatZapHeader &header    = m_zap->fatHeader();
+  const std::size_t             blockSize = m_zap->blockSize();
+
+  if (header.ptrtbl.numblks == 0) {
+    // embedded in the second half of the header block
+    addLeaves(reinterpret_cast<const u64 *>(
+                  reinterpret_cast<const char *>(m_zap->m_fat.data()) +
+                  blockSize / 2),
+              blockSize / 2 / sizeof(u64));
+    return;
+  }
+
+  for (u64 i = 0; i < header.ptrtbl.numblks; i++) {
+    BlockPtr table = m_zap->readBlock(header.ptrtbl.blk + i);
+    if (!table) {
+      LOG("Could not read fat ZAP pointer table block %lu, skipping!\n",
+          header.ptrtbl.blk + i);
+      continue;
+    }
+
+    addLeaves(reinterpret_cast<const u64 *>(table.data()),
+              table.size() / sizeof(u64));
+  }
+}
+
+bool ZapObject::Cursor::fetchBatch() {
+  m_batch.clear();
+  m_batchPos = 0;
+  m_index    = 0;
+
+  while (m_batch.empty() && m_nextLeaf < m_leafIDs.size()) {
+    const std::size_t end =
+        std::min(m_nextLeaf + ZAP_LEAF_BATCH, m_leafIDs.size());
+    std::vector<u64> ids{m_leafIDs.begin() + m_nextLeaf,
+                         m_leafIDs.begin() + end};
+    m_nextLeaf = end;
+
+    // read them in on-disk order
+    std::vector<std::pair<u64, u64>> byAddress;
+    for (u64 id : ids) {
+      if (id < m_zap->m_blocks.numDataBlocks())
+        byAddress.emplace_back(m_zap->blockAddress(id), id);
+    }
+
+    std::sort(byAddress.begin(), byAddress.end());
+
+    std::vector<const physical::Blkptr *> bps;
+    std::vector<u64>                      batchIDs;
+    for (const auto &entry : byAddress) {
+      const physical::Blkptr *bp = m_zap->m_blocks.blkptrByID(entry.second);
+      if (bp && bp->isValid()) {
+        bps.push_back(bp);
+        batchIDs.push_back(entry.second);
+      }
+    }
+
+    std::vector<BlockPtr> leaves = m_zap->m_reader->readBatch(bps);
+    for (std::size_t i = 0; i < leaves.size(); i++) {
+      BlockPtr &leaf = leaves[i];
+      if (!leaf || leaf.size() != m_zap->blockSize() ||
+          !m_geometry.header(leaf).isValid()) {
+        LOG("Could not read fat ZAP leaf block %lu, skipping!\n",
+            batchIDs[i]);
+        continue;
+      }
+
+      m_batch.push_back(std::move(leaf));
+    }
+  }
+
+  return !m_batch.empty();
+}
+
+bool ZapObject::Cursor::decodeEntry(const BlockPtr &              leaf,
+                                    const physical::ZapLeafChunk &chunk,
+                                    OUT ZapEntry *entry) const {
+  const physical::ZapLeafChunk *chunks = m_geometry.chunks(leaf);
+  const auto &                  e      = chunk.entry;
+
+  if (e.name_numints == 0 || e.value_intlen == 0 || e.value_numints == 0)
+    return false;
+
+  // names are NUL-terminated byte arrays
+  entry->name.resize(e.name_numints);
+  if (!readLeafArray(chunks, m_geometry.numChunks, e.name_chunk,
+                     e.name_numints,
+                     OUT reinterpret_cast<u8 *>(&entry->name[0])))
+    return false;
+
+  entry->name.resize(strnlen(entry->name.data(), entry->name.size()));
+  entry->hash = e.hash;
+
+  // values are stored as big endian integers
+  entry->values.clear();
+  if (e.value_numints == 1) {
+    u8                valueBytes[sizeof(u64)];
+    const std::size_t intlen =
+        std::min<std::size_t>(e.value_intlen, sizeof(u64));
+    if (!readLeafArray(chunks, m_geometry.numChunks, e.value_chunk, intlen,
+                       OUT valueBytes))
+      return false;
+
+    entry->value = 0;
+    for (std::size_t i = 0; i < intlen; i++)
+      entry->value = (entry->value << 8) | valueBytes[i];
+
+    return true;
+  }
+
+  if (e.value_intlen > sizeof(u64))
+    return false;
+
+  std::vector<u8> valueBytes(e.value_intlen * e.value_numints);
+  if (!readLeafArray(chunks, m_geometry.numChunks, e.value_chunk,
+                     valueBytes.size(), OUT valueBytes.data()))
+    return false;
+
+  entry->values.resize(e.value_numints, 0);
+  for (std::size_t i = 0; i < valueBytes.size(); i++) {
+    u64 &value = entry->values[i / e.value_intlen];
+    value      = (value << 8) | valueBytes[i];
+  }
+
+  entry->value = entry->values[0];
+  return true;
+}
+
+bool ZapObject::Cursor::nextFat(OUT ZapEntry *entry) {
+  if (!m_leavesCollected)
+    collectLeaves();
+
+  for (;;) {
+    if (m_batchPos < m_batch.size()) {
+      const BlockPtr &              leaf   = m_batch[m_batchPos];
+      const physical::ZapLeafChunk *chunks = m_geometry.chunks(leaf);
+
+      while (m_index < m_geometry.numChunks) {
+        const physical::ZapLeafChunk &chunk = chunks[m_index++];
+        if (chunk.type == physical::ZapChunkType::Entry &&
+            decodeEntry(leaf, chunk, OUT entry))
+          return true;
+      }
+
+      // done with this leaf, release it right away
+      m_batch[m_batchPos++] = nullptr;
+      m_index               = 0;
+      continue;
+    }
+
+    if (!fetchBatch())
+      return false;
+  }
+}
+
+ZapObject::iterator::iterator(std::shared_ptr<Cursor> cursor)
+    : m_cursor{std::move(cursor)} {
+  operator++();
+}
+
+ZapObject::iterator &ZapObject::iterator::operator++() {
+  if (m_cursor && !m_cursor->next(OUT & m_entry))
+    m_cursor.reset();
+
+  return *this;
+}
+
+ZapObject::ZapObject(ZPoolReader &reader, const physical::DNode &dnode)
+    : m_reader{&reader}, m_blocks{reader, dnode} {
+  if (!dnode.bps[0].isValid())
+    return;
+
+  BlockPtr first = readBlock(0);
+  if (!first || first.size() < sizeof(physical::FatZapHeader)) {
+    LOG("Could not read the first block of the ZAP object!\n");
+    return;
+  }
+
+  const auto &header =
+      *reinterpret_cast<const physical::FatZapHeader *>(first.data());
+
+  if (header.block_type == physical::ZapBlockType::Micro) {
+    m_micro = std::move(first);
+  } else if (header.isValid()) {
+    m_fat = std::move(first);
+  } else {
+    LOG("Unrecognised ZAP block type: 0x%lx\n",
+        static_cast<u64>(header.block_type));
+  }
+}
+
+ZapObject::~ZapObject() {}
+
+ZapObject::iterator ZapObject::begin() {
+  if (!isValid())
+    return end();
+
+  return iterator{std::make_shared<Cursor>(*this)};
+}
+
+u64 ZapObject::salt() const {
+  if (m_micro)
+    return m_micro->salt;
+
+  return m_fat ? fatHeader().salt : 0;
+}
+
+unsigned ZapObject::hashBits() const {
+  return m_fat && flag_isset(fatHeader().flags, ZAP_FLAG_HASH64) ? 48 : 28;
+}
+
+bool ZapObject::hasNativeHashes() const {
+  return m_fat && fatHeader().normflags == 0 &&
+         !flag_isset(fatHeader().flags,
+                     ZAP_FLAG_UINT64_KEY | ZAP_FLAG_PRE_HASHED_KEY);
+}
+
+bool ZapObject::findEntry(const std::string &name, OUT u64 *value) {
+  for (const ZapEntry &entry : *this) {
+    if (entry.name == name) {
+      OUT *value = entry.value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+u64 ZapObject::blockAddress(u64 blockid) {
+  if (blockid >= m_blocks.numDataBlocks())
+    return 0;
+
+  const physical::Blkptr *bp = m_blocks.blkptrByID(blockid);
+  return bp && bp->isValid() && !bp->embedded ? bp->dva[0].getAddress() : 0;
+}
+
+BlockPtr ZapObject::readBlock(u64 blockid) {
+  if (blockid >= m_blocks.numDataBlocks())
+    return nullptr;
+
+  const physical::Blkptr *bp = m_blocks.blkptrByID(blockid);
+  if (!bp || !bp->isValid())
+    return nullptr;
+
+  // try the other copies if one cannot be read
+  for (u32 dva = 0; dva < bp->numCopies(); dva++) {
+    try {
+      BlockPtr block = m_reader->read(*bp, dva);
+      if (block)
+        return block;
+    } catch (const ZPoolReaderException &ex) {
+      LOG("Could not read ZAP block %lu from DVA %u: %s\n", blockid, dva,
+          ex.what());
+    }
+  }
+
+  return nullptr;
+}
+
+} // end namespace zfs
@@ -0,0 +1,121 @@
+#include "utils/log.h"
+
+#include "zfs/zap_cache.h"
+
+namespace zfs {
+
+// ---- ZapIndex ----
+
+ZapIndex::ZapIndex(ZapObject &zap)
+    : m_salt{zap.salt()}, m_hashBits{zap.hashBits()} {
+  // the hashes stored in fat ZAP leaves spare us hashing every name
+  const bool nativeHashes = zap.hasNativeHashes();
+
+  for (const ZapEntry &entry : zap) {
+    const u64 hash = nativeHashes
+                         ? entry.hash
+                         : hashName(entry.name.data(), entry.name.size());
+
+    m_entries.push_back(Entry{hash, entry.value,
+                              static_cast<u32>(m_names.size()),
+                              static_cast<u32>(entry.name.size())});
+    m_names += entry.name;
+  }
+
+  m_names.shrink_to_fit();
+  m_entries.shrink_to_fit();
+
+  // keep the load factor at or below 1/2
+  std::size_t tableSize = 16;
+  m_tableShift          = 64 - 4;
+  while (tableSize < 2 * m_entries.size()) {
+    tableSize *= 2;
+    m_tableShift--;
+  }
+
+  m_table.assign(tableSize, 0);
+  for (std::size_t i = 0; i < m_entries.size(); i++) {
+    std::size_t slot = slotOf(m_entries[i].hash);
+    while (m_table[slot] != 0)
+      slot = (slot + 1) & (m_table.size() - 1);
+
+    m_table[slot] = static_cast<u32>(i + 1);
+  }
+}
+
+std::size_t ZapIndex::slotOf(u64 hash) const {
+  // ZAP hashes only have their high bits set, so the low bits of the product
+  // are zero; its high bits depend on all of them (Fibonacci hashing)
+  return static_cast<std::size_t>((hash * 0x9E3779B97F4A7C15uLL) >>
+                                  m_tableShift);
+}
+
+bool ZapIndex::findEntry(const std::string &name, OUT u64 *value) const {
+  const u64 hash = hashName(name.data(), name.size());
+
+  for (std::size_t slot = slotOf(hash); m_table[slot] != 0;
+       slot             = (slot + 1) & (m_table.size() - 1)) {
+    const Entry &entry = m_entries[m_table[slot] - 1];
+
+    // the hash is truncated, so collisions are to be expected
+    if (entry.hash == hash && entry.nameLength == name.size() &&
+        m_names.compare(entry.nameOffset, entry.nameLength, name) == 0) {
+      OUT *value = entry.value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+std::size_t ZapIndex::memoryUsage() const {
+  return sizeof(*this) + m_names.capacity() +
+         m_entries.capacity() * sizeof(Entry) + m_table.size() * sizeof(u32);
+}
+
+// ---- ZapCache ----
+
+std::shared_ptr<const ZapIndex>
+ZapCache::get(ZPoolReader &reader, u64 objid, const physical::DNode &dnode) {
+  auto it = m_indexes.find(objid);
+  if (it != m_indexes.end()) {
+    m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+    return it->second.index;
+  }
+
+  ZapObject zap{reader, dnode};
+  if (!zap.isValid())
+    return nullptr;
+
+  auto index = std::make_shared<const ZapIndex>(zap);
+  LOG("Indexed ZAP object %lu: %zu entries, %zu bytes\n", objid,
+      index->numEntries(), index->memoryUsage());
+
+  m_lru.push_front(objid);
+  m_indexes.emplace(objid, CachedIndex{index, m_lru.begin()});
+  m_numEntries += index->numEntries();
+
+  evict();
+  return index;
+}
+
+bool ZapCache::findEntry(ZPoolReader &reader, u64 objid,
+                         const physical::DNode &dnode, const std::string &name,
+                         OUT u64 *value) {
+  std::shared_ptr<const ZapIndex> index = get(reader, objid, dnode);
+  return index && index->findEntry(name, OUT value);
+}
+
+void ZapCache::evict() {
+  // never drop the most recently used one, even if it is over the budget alone
+  while (m_numEntries > m_maxEntries && m_lru.size() > 1) {
+    auto it = m_indexes.find(m_lru.back());
+    ASSERT0(it != m_indexes.end());
+
+    m_numEntries -= it->second.index->numEntries();
+    m_indexes.erase(it);
+    m_lru.pop_back();
+  }
+}
+
+} // end namespace zfs
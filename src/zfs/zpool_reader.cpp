@@ -1,68 +1,297 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
 #include <cstring>
-
-#include "lz4.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #include "utils/log.h"
+#include "zfs/byteorder.h"
+#include "zfs/checksum.h"
+#include "zfs/compression.h"
 #include "zfs/zpool_reader.h"
 
 #define VDEV_LABEL_SIZE (KB * 256)
 
+// the uberblock ring is the second half of the first 256K of a label
+#define VDEV_UBERBLOCK_RING (KB * 128)
+#define VDEV_UBERBLOCK_SLOT_SIZE KB
+
+// larger sectors make for larger slots, up to 8K (MAX_UBERBLOCK_SHIFT)
+#define VDEV_UBERBLOCK_MAX_SLOT_SIZE (KB * 8)
+
+// the magic number of the checksum embedded in label blocks
+#define ZEC_MAGIC 0x0210da7ab10c7a11ULL
+
 namespace zfs {
 
-static bool seekToLabel(std::FILE *fp, u32 label_index) {
-  switch (label_index) {
-  case 0:
-    return std::fseek(fp, 0, SEEK_SET) == 0;
+// Where the given label starts: two at the front of the device, two at the end.
+// Matches vdev_label_offset() in vdev_label.c.
+static u64 labelOffset(u32 label_index, u64 deviceSize) {
+  ASSERT(label_index < VDEV_NLABELS, "Invalid label index: %u!", label_index);
+
+  // the device is used in whole labels
+  deviceSize -= deviceSize % VDEV_LABEL_SIZE;
+
+  return label_index * VDEV_LABEL_SIZE +
+         (label_index < VDEV_NLABELS / 2
+              ? 0
+              : deviceSize - VDEV_NLABELS * VDEV_LABEL_SIZE);
+}
+
+// Reads SIZE bytes at ADDR. Positional, so that blocks can be read from several
+// threads at once.
+static size_t readAt(int fd, u64 addr, size_t size, OUT void *data) {
+  size_t nread = 0;
+  while (nread < size) {
+    const ssize_t n = ::pread(fd, static_cast<char *>(data) + nread,
+                              size - nread, static_cast<off_t>(addr + nread));
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n <= 0)
+      break;
+
+    nread += static_cast<size_t>(n);
+  }
+
+  return nread;
+}
+
+// Uberblocks written by a machine of the other byte order have a swapped magic
+// number, and consist of 64-bit integers only.
+static void fixUberblockByteOrder(INOUT physical::Uberblock *ub) {
+  if (ub->magic == BSWAP_64(static_cast<u64>(UB_MAGIC)))
+    byteswap_uint64_array(ub, sizeof(*ub));
+}
+
+// The checksum at the end of every label block, see zio_eck_t in zio.h.
+struct EmbeddedChecksum {
+  u64 magic;
+  u64 checksum[4];
+};
+
+// Whether the SIZE bytes of SLOT read at the device OFFSET carry their embedded
+// checksum: the SHA-256 of the slot with the checksum replaced by the offset,
+// as set up by zio_checksum_label_verifier(). The digest is stored as big
+// endian words, those in the byte order of the writer.
+static bool verifyLabelChecksum(const char *slot, std::size_t size,
+                                u64 offset) {
+  char block[VDEV_UBERBLOCK_MAX_SLOT_SIZE];
+  ASSERT(size <= sizeof(block), "Slot too large: %zu!", size);
+  std::memcpy(block, slot, size);
+
+  EmbeddedChecksum *const eck = reinterpret_cast<EmbeddedChecksum *>(
+      block + size - sizeof(EmbeddedChecksum));
+
+  bool byteswap;
+  if (eck->magic == ZEC_MAGIC)
+    byteswap = false;
+  else if (eck->magic == BSWAP_64(ZEC_MAGIC))
+    byteswap = true;
+  else
+    return false;
+
+  u64 expected[4];
+  for (std::size_t i = 0; i < 4; i++)
+    expected[i] = byteswap ? BSWAP_64(eck->checksum[i]) : eck->checksum[i];
+
+  eck->checksum[0] = byteswap ? BSWAP_64(offset) : offset;
+  eck->checksum[1] = eck->checksum[2] = eck->checksum[3] = 0;
+
+  u8 digest[32];
+  sha256(block, size, OUT digest);
+
+  for (std::size_t i = 0; i < 4; i++) {
+    u64 word;
+    std::memcpy(&word, digest + i * sizeof(word), sizeof(word));
+    if (BE_64(word) != expected[i])
+      return false;
+  }
 
-  case 1:
-    return std::fseek(fp, static_cast<long>(VDEV_LABEL_SIZE), SEEK_SET) == 0;
+  return true;
+}
 
-  case 2:
-    return std::fseek(fp, -static_cast<long>(VDEV_LABEL_SIZE), SEEK_END) == 0;
+// Whether the uberblock in a ring slot is worth considering at all.
+static bool isUsableUberblock(const physical::Uberblock &ub) {
+  return ub.isValid() && ub.txg != 0 && ub.rootbp.isValid();
+}
 
-  case 3:
-    return std::fseek(fp, -static_cast<long>(VDEV_LABEL_SIZE * 2), SEEK_END) ==
-           0;
+u64 ZPoolReader::deviceSize() const {
+  struct stat st;
+  if (::fstat(fileno(m_fp), &st) != 0)
+    return 0;
 
-  default:
-    UNREACHABLE("Invalid label index: %u!", label_index);
+  // block devices have no size of their own
+  if (S_ISBLK(st.st_mode)) {
+    const off_t end = ::lseek(fileno(m_fp), 0, SEEK_END);
+    return end < 0 ? 0 : static_cast<u64>(end);
   }
+
+  return static_cast<u64>(st.st_size);
+}
+
+std::size_t ZPoolReader::readRaw(u64 offset, std::size_t size,
+                                 OUT void *data) {
+  return readAt(fileno(m_fp), offset, size, OUT data);
 }
 
 bool ZPoolReader::readUberblock(u32 label_index, u32 ub_index,
                                 OUT physical::Uberblock *ub) {
-  if (!seekToLabel(m_fp, label_index)) {
-    LOG("Could not seek to label L%u!\n", label_index);
+  const u64 size = deviceSize();
+  if (size < VDEV_NLABELS * VDEV_LABEL_SIZE) {
+    LOG("The device is too small to hold the labels!\n");
     return false;
   }
 
-  long offset = static_cast<long>(KB * (128 + ub_index));
-  std::fseek(m_fp, offset, SEEK_CUR);
+  const u64 offset = labelOffset(label_index, size) + VDEV_UBERBLOCK_RING +
+                     ub_index * VDEV_UBERBLOCK_SLOT_SIZE;
 
-  size_t nread = std::fread(ub, sizeof(physical::Uberblock), 1, m_fp);
-  if (nread != 1) {
+  if (readAt(fileno(m_fp), offset, sizeof(physical::Uberblock), OUT ub) !=
+      sizeof(physical::Uberblock)) {
     LOG("Uberblock L%u:%u could not be read from file!\n", label_index,
         ub_index);
     return false;
   }
 
+  fixUberblockByteOrder(INOUT ub);
   return ub->isValid();
 }
 
-// blatantly stolen from byteorder.h in linux-on-zfs source tree
-#define BE_IN8(xa) *((u8 *)(xa))
-#define BE_IN16(xa) (((u16)BE_IN8(xa) << 8) | BE_IN8((u8 *)(xa) + 1))
-#define BE_IN32(xa) (((u32)BE_IN16(xa) << 16) | BE_IN16((u8 *)(xa) + 2))
-#define BE_IN64(xa) (((u64)BE_IN32(xa) << 32) | BE_IN32((u8 *)(xa) + 4))
+std::vector<UberblockEntry> ZPoolReader::scanUberblocks() {
+  const u64 size = deviceSize();
+  if (size < VDEV_NLABELS * VDEV_LABEL_SIZE) {
+    LOG("The device is too small to hold the labels!\n");
+    return {};
+  }
+
+  std::vector<UberblockEntry> found[VDEV_NLABELS];
+
+  // one thread per label, so that the reads are in flight at the same time
+  const auto scanLabel = [this, size, &found](u32 label) {
+    std::unique_ptr<char[]> ring{new char[VDEV_UBERBLOCK_RING]};
+
+    const u64 offset = labelOffset(label, size) + VDEV_UBERBLOCK_RING;
+    if (readAt(fileno(m_fp), offset, VDEV_UBERBLOCK_RING, OUT ring.get()) !=
+        VDEV_UBERBLOCK_RING) {
+      LOG("Could not read the uberblock ring of label L%u!\n", label);
+      return;
+    }
+
+    // pools with larger sectors use larger slots, those simply show up as
+    // empty slots in between here
+    for (u32 i = 0; i < VDEV_LABEL_NUBERBLOCKS; i++) {
+      const char *const slot = ring.get() + i * VDEV_UBERBLOCK_SLOT_SIZE;
+
+      physical::Uberblock ub;
+      std::memcpy(&ub, slot, sizeof(ub));
+      fixUberblockByteOrder(INOUT & ub);
+
+      if (!isUsableUberblock(ub))
+        continue;
+
+      // a torn write leaves a valid looking uberblock behind; the sector size
+      // is not known here, so any slot size the slot is aligned to will do
+      bool verified = false;
+      for (u32 slotSize = VDEV_UBERBLOCK_SLOT_SIZE;
+           !verified && slotSize <= VDEV_UBERBLOCK_MAX_SLOT_SIZE &&
+           (i * VDEV_UBERBLOCK_SLOT_SIZE) % slotSize == 0;
+           slotSize *= 2)
+        verified = verifyLabelChecksum(
+            slot, slotSize, offset + i * VDEV_UBERBLOCK_SLOT_SIZE);
+
+      if (!verified) {
+        LOG("Uberblock L%u:%u fails its label checksum!\n", label, i);
+        continue;
+      }
+
+      found[label].push_back(UberblockEntry{label, i, ub});
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (u32 label = 1; label < VDEV_NLABELS; label++)
+    threads.emplace_back(scanLabel, label);
+
+  scanLabel(0);
+
+  for (std::thread &thread : threads)
+    thread.join();
+
+  std::vector<UberblockEntry> ubs;
+  for (const std::vector<UberblockEntry> &labelFound : found)
+    ubs.insert(ubs.end(), labelFound.begin(), labelFound.end());
+
+  // the newest first, like vdev_uberblock_compare() picks them; the label
+  // order is kept among copies of the same uberblock
+  std::stable_sort(ubs.begin(), ubs.end(),
+                   [](const UberblockEntry &lhs, const UberblockEntry &rhs) {
+                     if (lhs.ub.txg != rhs.ub.txg)
+                       return lhs.ub.txg > rhs.ub.txg;
+
+                     return lhs.ub.timestamp > rhs.ub.timestamp;
+                   });
+
+  return ubs;
+}
+
+// Warns that the given copy of BP's block does not match its checksum.
+static void warnChecksumMismatch(const physical::Blkptr &bp, u32 dva_index) {
+  std::fprintf(stderr,
+               "Warning: checksum mismatch in copy %u of the block at "
+               "%u:0x%zx\n",
+               dva_index, static_cast<u32>(bp.dva[dva_index].vdev),
+               bp.dva[dva_index].getAddress());
+}
+
+// Verifies the checksum of the SIZE bytes of DATA just read from the given
+// copy of BP's block, warning about a mismatch.
+static bool checkBlock(const physical::Blkptr &bp, u32 dva_index,
+                       const void *data, size_t size) {
+  if (verifyChecksum(bp, data, size))
+    return true;
+
+  warnChecksumMismatch(bp, dva_index);
+  return false;
+}
+
+// The codec of a block of the given compression, throwing if there is none.
+static const Codec &getCodec(const physical::Blkptr &bp) {
+  const Codec *codec = findCodec(bp.comp);
+  if (!codec)
+    throw ZPoolReaderException{&bp, nullptr,
+                               "Invalid compression method " +
+                                   std::to_string(static_cast<u32>(bp.comp))};
+
+  if (!codec->decompress && bp.comp != Compress::Off)
+    throw UnsupportedException{std::string{"compression method "} +
+                               codec->name};
+
+  return *codec;
+}
+
+// A buffer for the compressed data of a block, one per thread, so that reading
+// does not allocate per block.
+static u8 *compressedBuffer(std::size_t size) {
+  thread_local std::vector<u8> buffer;
+  if (buffer.size() < size)
+    buffer.resize(size);
 
-static bool readLZ4CompressedData(std::FILE *fp, size_t lsize, size_t psize,
-                                  OUT void *data, OUT int *result) {
+  return buffer.data();
+}
+
+static bool readCompressedData(int fd, const physical::Blkptr &bp,
+                               const Codec &codec, u32 dva_index,
+                               size_t lsize, size_t psize, OUT void *data) {
   ASSERT(psize % SECTOR_SIZE == 0, "Non-sector aligned physical size: %zu",
          psize);
 
-  std::unique_ptr<char[]> ibuffer{new char[psize]};
+  u8 *const ibuffer = compressedBuffer(psize);
 
-  const size_t nread = std::fread(ibuffer.get(), sizeof(char), psize, fp);
+  const u64    addr  = bp.dva[dva_index].getAddress();
+  const size_t nread = readAt(fd, addr, psize, OUT ibuffer);
   if (nread != psize) {
     LOG("Failed to read compressed object of psize = %lx, "
         "could only read: %zu\n",
@@ -70,50 +299,81 @@ static bool readLZ4CompressedData(std::FILE *fp, size_t lsize, size_t psize,
     return false;
   }
 
-  u32 *     ibuffer_raw     = reinterpret_cast<u32 *>(ibuffer.get());
-  const u32 compressed_size = BE_IN32(ibuffer_raw);
-
-  if (lsize <= compressed_size + sizeof(compressed_size)) {
-    LOG("Cannot LZ4 decompress: lnvalid logical size %zu: lower than the "
-        "compressed size %u\n",
-        lsize, compressed_size);
+  if (!checkBlock(bp, dva_index, ibuffer, psize))
     return false;
-  }
 
-  const int decompress_result = LZ4_decompress_safe(
-      reinterpret_cast<const char *>(&ibuffer_raw[1]),
-      OUT reinterpret_cast<char *>(data), static_cast<int>(compressed_size),
-      static_cast<int>(lsize));
+  return codec.decompress(ibuffer, psize, OUT static_cast<u8 *>(data), lsize);
+}
+
+// Decodes the data an embedded block pointer carries in place of its DVAs, the
+// padding, the fill count and the checksum (decode_embedded_bp_compressed() in
+// blkptr.c). The logical birth txg and the props are not part of it.
+static bool decodeEmbedded(const physical::Blkptr &bp, OUT void *data) {
+  if (bp.getEmbeddedType() != BP_EMBEDDED_TYPE_DATA)
+    throw UnsupportedException{"embedded block pointers of type " +
+                               std::to_string(bp.getEmbeddedType())};
 
-  LOG("LZ4_decompress_safe => %d (compressed_size = %u, lsize = %zu, psize = "
-      "%zu)\n",
-      decompress_result, compressed_size, lsize, psize);
+  const std::size_t lsize = bp.getLogicalSize();
+  const std::size_t psize = bp.getPhysicalSize();
+  if (psize > BPE_PAYLOAD_SIZE)
+    throw ZPoolReaderException{&bp, nullptr,
+                               "Invalid embedded blkptr payload size " +
+                                   std::to_string(psize)};
+
+  const u8 *raw = reinterpret_cast<const u8 *>(&bp);
+  u8        payload[BPE_PAYLOAD_SIZE];
+  u8 *      p = payload;
+
+  p = std::copy(raw, raw + offsetof(physical::Blkptr, lsize), p);
+  p = std::copy(raw + offsetof(physical::Blkptr, lsize) + sizeof(u64),
+                raw + offsetof(physical::Blkptr, birth_txg), p);
+  p = std::copy(raw + offsetof(physical::Blkptr, fill),
+                raw + sizeof(physical::Blkptr), p);
+  ASSERT0(p == payload + sizeof(payload));
+
+  LOG("Decoding %zu logical (%zu physical) bytes embedded in the blkptr\n",
+      lsize, psize);
+
+  const Codec &codec = getCodec(bp);
+  if (bp.comp != Compress::Off)
+    return codec.decompress(payload, psize, OUT static_cast<u8 *>(data),
+                            lsize);
+
+  if (lsize != psize) {
+    LOG("Mismatch between logical (%zu) and physical (%zu) sizes even "
+        "though compression is off!\n",
+        lsize, psize);
+    return false;
+  }
 
-  OUT *result = decompress_result;
+  std::memcpy(data, payload, lsize);
   return true;
 }
 
-static Compress getEffectiveCompression(Compress comp) {
-  switch (comp) {
-  case Compress::On:
-    return Compress::Default;
-
-  case Compress::Inherit:
-    LOG("Warning: treating Compress::Inherit as Compress::Default!\n");
-    return Compress::Default;
-
-  default:
-    return comp;
-  }
+// Blocks written by a machine of the other byte order are swapped right after
+// decompression, once per read, so that nothing else has to care.
+static void fixBlockByteOrder(const physical::Blkptr &bp, INOUT void *data) {
+  if (bp.endian != SYSTEM_ENDIAN)
+    byteswap_block(bp.type, bp.lvl, data, bp.getLogicalSize());
 }
 
 bool ZPoolReader::read(const physical::Blkptr &bp, u32 dva_index,
                        OUT void *data) {
+  if (!readDecompressed(bp, dva_index, OUT data))
+    return false;
+
+  fixBlockByteOrder(bp, INOUT data);
+  return true;
+}
+
+bool ZPoolReader::readDecompressed(const physical::Blkptr &bp, u32 dva_index,
+                                   OUT void *data) {
   if (!bp.isValid())
     throw ZPoolReaderException{&bp, nullptr, "Cannot resolve invalid blkptr!"};
 
-  if (bp.endian != Endian::Little)
-    throw UnsupportedException{"Big endian block pointers"};
+  // no I/O at all, whichever copy is asked for
+  if (bp.embedded)
+    return decodeEmbedded(bp, OUT data);
 
   const std::size_t lsize = bp.getLogicalSize();
   const std::size_t psize = bp.getPhysicalSize();
@@ -131,36 +391,34 @@ bool ZPoolReader::read(const physical::Blkptr &bp, u32 dva_index,
   LOG("Reading %zu logical (%zu physical) bytes from DVA: ", lsize, psize);
   dva.dump(stderr);
 
-  if (std::fseek(m_fp, addr, SEEK_SET) != 0) {
-    LOG("Seek failed!\n");
+  const int    fd    = fileno(m_fp);
+  const Codec &codec = getCodec(bp);
+  if (bp.comp != Compress::Off)
+    return readCompressedData(fd, bp, codec, dva_index, lsize, psize,
+                              OUT data);
+
+  ASSERT(lsize == psize && lsize == asize, "Mismatch between logical (%zu), "
+                                           "physical (%zu) and allocated "
+                                           "(%zu) sizes "
+                                           "even though compression is off!",
+         lsize, psize, asize);
+
+  if (readAt(fd, addr, lsize, OUT data) != lsize) {
+    LOG("Failed to read uncompressed data!\n");
     return false;
   }
 
-  const Compress comp = getEffectiveCompression(bp.comp);
-  switch (comp) {
-  case Compress::LZ4:
-    int decompress_result;
-    return readLZ4CompressedData(m_fp, lsize, psize, OUT data,
-                                 OUT & decompress_result);
-
-  case Compress::Off:
-    ASSERT(lsize == psize && lsize == asize, "Mismatch between logical (%zu), "
-                                             "physical (%zu) and allocated "
-                                             "(%zu) sizes "
-                                             "even though compression is off!",
-           lsize, psize, asize);
-
-    if (std::fread(data, sizeof(char), lsize, m_fp) != lsize) {
-      LOG("Failed to read uncompressed data!\n");
-      return false;
-    }
+  return checkBlock(bp, dva_index, data, lsize);
+}
 
-    return true;
+void ZPoolReader::prefetch(const physical::Blkptr &bp, u32 dva_index) {
+  const physical::Dva &dva = bp.dva[dva_index];
+  if (!bp.isValid() || bp.embedded || !dva.isValid() || dva.gang_block)
+    return;
 
-  default:
-    throw UnsupportedException{"unknown compression method " +
-                               std::to_string(static_cast<u32>(comp))};
-  }
+  ::posix_fadvise(fileno(m_fp), static_cast<off_t>(dva.getAddress()),
+                  static_cast<off_t>(bp.getPhysicalSize()),
+                  POSIX_FADV_WILLNEED);
 }
 
 BlockPtr ZPoolReader::read(const physical::Blkptr &pbp, u32 dva_index) {
@@ -179,4 +437,122 @@ BlockPtr ZPoolReader::read(const physical::Blkptr &pbp, u32 dva_index) {
   return std::move(bp);
 }
 
+BlockPtr ZPoolReader::readAnyCopy(const physical::Blkptr &bp, u32 first_dva) {
+  for (u32 dva = first_dva; dva < bp.numCopies(); dva++) {
+    try {
+      BlockPtr block = read(bp, dva);
+      if (block)
+        return block;
+    } catch (const std::exception &ex) {
+      LOG("Could not read block from DVA %u: %s\n", dva, ex.what());
+    }
+  }
+
+  return nullptr;
+}
+
+std::vector<BlockPtr>
+ZPoolReader::readBatch(const std::vector<const physical::Blkptr *> &bps) {
+  const int fd = fileno(m_fp);
+
+  std::vector<BlockPtr>     blocks(bps.size());
+  std::vector<const Codec *> codecs(bps.size(), nullptr);
+  std::vector<bool>          triedFirst(bps.size(), false);
+
+  // the compressed blocks are read into one buffer of the thread, one after
+  // the other
+  std::vector<std::size_t> offsets(bps.size(), 0);
+  std::size_t              compressedSize = 0;
+
+  for (std::size_t i = 0; i < bps.size(); i++) {
+    const physical::Blkptr &bp  = *bps[i];
+    const physical::Dva &   dva = bp.dva[0];
+    if (!bp.isValid() || bp.embedded || !dva.isValid() || dva.gang_block)
+      continue;
+
+    // anything unexpected is left for read() to complain about
+    const Codec *codec = findCodec(bp.comp);
+    if (!codec)
+      continue;
+
+    const std::size_t lsize = bp.getLogicalSize();
+    const std::size_t psize = bp.getPhysicalSize();
+    if (bp.comp == Compress::Off) {
+      if (lsize != psize || psize != dva.getAllocatedSize())
+        continue;
+    } else {
+      if (!codec->decompress)
+        continue;
+
+      offsets[i] = compressedSize;
+      compressedSize += psize;
+    }
+
+    codecs[i] = codec;
+  }
+
+  u8 *const compressed = compressedBuffer(compressedSize);
+
+  // read the first copy of every plain block, as it is stored on disk
+  std::vector<ChecksumJob> jobs;
+  std::vector<std::size_t> jobIndices;
+  for (std::size_t i = 0; i < bps.size(); i++) {
+    if (!codecs[i])
+      continue;
+
+    const physical::Blkptr &bp    = *bps[i];
+    const physical::Dva &   dva   = bp.dva[0];
+    const std::size_t       psize = bp.getPhysicalSize();
+
+    BlockPtr block = BlockPtr::allocate(bp.getLogicalSize());
+    if (!block)
+      continue;
+
+    u8 *const raw = bp.comp == Compress::Off
+                        ? static_cast<u8 *>(block.data())
+                        : compressed + offsets[i];
+
+    triedFirst[i] = true;
+    if (readAt(fd, dva.getAddress(), psize, OUT raw) != psize) {
+      LOG("Failed to read %zu bytes at 0x%lx!\n", psize, dva.getAddress());
+      continue;
+    }
+
+    jobs.push_back(ChecksumJob{&bp, raw, psize, false});
+    jobIndices.push_back(i);
+    blocks[i] = std::move(block);
+  }
+
+  verifyChecksums(INOUT & jobs);
+
+  for (std::size_t j = 0; j < jobs.size(); j++) {
+    const std::size_t       i  = jobIndices[j];
+    const physical::Blkptr &bp = *bps[i];
+
+    if (!jobs[j].matches) {
+      warnChecksumMismatch(bp, 0);
+      blocks[i] = nullptr;
+      continue;
+    }
+
+    if (bp.comp != Compress::Off &&
+        !codecs[i]->decompress(static_cast<const u8 *>(jobs[j].data),
+                               jobs[j].size,
+                               OUT static_cast<u8 *>(blocks[i].data()),
+                               bp.getLogicalSize()))
+      blocks[i] = nullptr;
+
+    if (blocks[i])
+      fixBlockByteOrder(bp, INOUT blocks[i].data());
+  }
+
+  // everything else goes the slow way, one copy at a time
+  for (std::size_t i = 0; i < bps.size(); i++) {
+    if (!blocks[i] && bps[i]->isValid())
+      blocks[i] = readAnyCopy(*bps[i], triedFirst[i] ? 1 : 0);
+  }
+
+  return blocks;
+}
+
 } // end namespace zfs